@@ -0,0 +1,161 @@
+// Compares headers tokenizer with PCRE based parser used before it
+
+#include "headers.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <pcre.h>
+
+#define N_MESSAGES 100000
+#define MAX_HEADERS 64
+#define N_ROUNDS 5
+
+static const char *known_headers[] = { "From", "To", "Subject", "Date" };
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// typical headers block of a message sent by MUA
+static const char headers_block[] =
+	"Received: from mx.example.com (mx.example.com [192.0.2.1])\r\n"
+	"\tby smtp.example.org with ESMTP id 4F2A1B3C\r\n"
+	"\tfor <user@example.org>; Sat, 17 Oct 2026 12:00:00 +0000\r\n"
+	"From: Sender Name <sender@example.com>\r\n"
+	"To: user@example.org\r\n"
+	"Subject: Quarterly report for the team,\r\n"
+	" numbers are attached\r\n"
+	"Date: Sat, 17 Oct 2026 12:00:00 +0000\r\n"
+	"Message-ID: <20261017120000.12345@example.com>\r\n"
+	"MIME-Version: 1.0\r\n"
+	"Content-Type: multipart/mixed; boundary=\"----=_Part_12345_67890\"\r\n"
+	"X-Mailer: Example Mail 1.0\r\n"
+	"X-Priority: 3\r\n"
+	"\r\n";
+
+// parser from message.c before the tokenizer
+struct pcre_header_t {
+	int header_type;
+
+	char header_name[128];
+	char header_value[1024];
+};
+
+static pcre *header_re = NULL;
+
+static int pcre_header_type(const char *header_name) {
+	int i = 0;
+	for (; i < VSIZE(known_headers); ++i) {
+		size_t len = strlen(known_headers[i]);
+		if (strlen(header_name) == len && strncasecmp(header_name, known_headers[i], len) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static size_t run_pcre(const char *data, size_t data_len) {
+	struct pcre_header_t headers[MAX_HEADERS];
+	int n_headers = 0;
+
+	int off = 0;
+	int len = (int)data_len;
+	int ovector[24];
+
+	while (off < len && pcre_exec(header_re, NULL, data, len, off, 0, ovector, sizeof(ovector)) >= 0) {
+		if (n_headers >= MAX_HEADERS)
+			break;
+
+		struct pcre_header_t *hdr = headers + n_headers;
+		int name_len = snprintf(hdr->header_name, sizeof(hdr->header_name), "%.*s", ovector[3] - ovector[2], data + ovector[2]);
+		snprintf(hdr->header_value, sizeof(hdr->header_value), "%.*s", ovector[5] - ovector[4], data + ovector[4]);
+		hdr->header_type = pcre_header_type(hdr->header_name);
+
+		int i = 1;
+		hdr->header_name[0] = (char)toupper(hdr->header_name[0]);
+		for (; i < name_len; ++i)
+			hdr->header_name[i] = (char)tolower(hdr->header_name[i]);
+
+		off = ovector[1];
+		++n_headers;
+	}
+
+	size_t known = 0;
+	int i = 0;
+	for (; i < n_headers; ++i)
+		if (headers[i].header_type >= 0)
+			++known;
+
+	return known;
+}
+
+static uint32_t known_hashes[VSIZE(known_headers)];
+
+static size_t run_tokenizer(const char *data, size_t data_len) {
+	struct header_t headers[MAX_HEADERS];
+	size_t n_headers = parse_headers(data, data_len, headers, VSIZE(headers));
+
+	// classification like in message.c: hash first, names are compared on hash match only
+	size_t i = 0;
+	size_t known = 0;
+	for (; i < n_headers; ++i) {
+		int j = 0;
+		for (; j < VSIZE(known_hashes); ++j)
+			if (known_hashes[j] == headers[i].name_hash && strlen(known_headers[j]) == headers[i].name_len
+					&& strncasecmp(headers[i].name, known_headers[j], headers[i].name_len) == 0)
+				++known;
+	}
+
+	return known;
+}
+
+typedef size_t (*bench_fn_t)(const char *data, size_t data_len);
+
+static void bench(const char *name, bench_fn_t fn) {
+	double best = 0;
+	size_t found = 0;
+
+	int i = 0;
+	for (; i < N_ROUNDS; ++i) {
+		double start = now();
+
+		found = 0;
+		int j = 0;
+		for (; j < N_MESSAGES; ++j)
+			found += fn(headers_block, sizeof(headers_block) - 1);
+
+		double elapsed = now() - start;
+		if (i == 0 || elapsed < best)
+			best = elapsed;
+	}
+
+	printf("%-10s %8.1f ns/message %8.1f MB/s (%zu known headers per message)\n", name,
+			best * 1e9 / N_MESSAGES, (double)(sizeof(headers_block) - 1) * N_MESSAGES / best / 1024 / 1024, found / N_MESSAGES);
+}
+
+int main() {
+	const char *err;
+	int err_off;
+	header_re = pcre_compile("([\\w-]+):\\s*(.*)", PCRE_NEWLINE_CRLF, &err, &err_off, NULL);
+	if (!header_re) {
+		printf("Can't compile re: %s (offset %d)\n", err, err_off);
+		return 1;
+	}
+
+	int i = 0;
+	for (; i < VSIZE(known_headers); ++i)
+		known_hashes[i] = header_name_hash(known_headers[i], strlen(known_headers[i]));
+
+	bench("pcre", run_pcre);
+	bench("tokenizer", run_tokenizer);
+
+	pcre_free(header_re);
+	return 0;
+}
@@ -0,0 +1,526 @@
+// In-process microbenchmarks of the parsing hot paths of proto.c and message.c
+//
+// Usage: hotpaths [results.json]
+//
+// Every case runs a fixed number of iterations per round, the best of N_ROUNDS rounds is reported
+// in cycles per iteration and per byte. Results are written as JSON when path is given, so runs can be compared.
+// Cycles are read with read_cycles() from cycles.h.
+// Server objects are linked in: messages are stored by message.c and spool.c into a temporary root
+// in BENCH_TMPFS directory (/dev/shm by default).
+
+#include "headers.h"
+#include "smtp_path.h"
+#include "smtp_command.h"
+#include "scanner.h"
+#include "logger.h"
+#include "event_loop.h"
+#include "common.h"
+#include "cycles.h"
+
+#include "config.h"
+#include "message.h"
+#include "spool.h"
+#include "recipients.h"
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define N_ROUNDS 5 // and one more round to warm up
+#define CHUNK_SIZE (64 * 1024) // READ_MAX_SIZE
+#define MESSAGE_SIZE (256 * 1024)
+#define MAX_RECIPIENTS 100
+#define LOG_LINES 1000 // fit into the log ring, so producer never waits for logger
+#define LOG_DRAIN_US 50000
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// results are summed into it, so compiler can't throw work away
+static volatile size_t sink = 0;
+
+// typical headers block of a message sent by MUA
+static const char headers_block[] =
+	"Received: from mx.example.com (mx.example.com [192.0.2.1])\r\n"
+	"\tby smtp.example.org with ESMTP id 4F2A1B3C\r\n"
+	"\tfor <user@example.org>; Sat, 17 Oct 2026 12:00:00 +0000\r\n"
+	"From: Sender Name <sender@example.com>\r\n"
+	"To: user@example.org\r\n"
+	"Subject: Quarterly report for the team,\r\n"
+	" numbers are attached\r\n"
+	"Date: Sat, 17 Oct 2026 12:00:00 +0000\r\n"
+	"Message-ID: <20261017120000.12345@example.com>\r\n"
+	"MIME-Version: 1.0\r\n"
+	"Content-Type: multipart/mixed; boundary=\"----=_Part_12345_67890\"\r\n"
+	"X-Mailer: Example Mail 1.0\r\n"
+	"X-Priority: 3\r\n"
+	"\r\n";
+
+static const char mail_arg[] = "FROM:<john.smith+list@example-mail.com> SIZE=12345 BODY=8BITMIME";
+static const char rcpt_arg[] = "TO:<@relay.example.org:user_1@mail.example.ru>";
+
+// commands of a typical session
+static const char *command_lines[] = {
+	"EHLO client.example.com",
+	"MAIL FROM:<sender@example.com>",
+	"RCPT TO:<user1@example.org>",
+	"RCPT TO:<user2@example.org>",
+	"DATA",
+	"RSET",
+	"NOOP",
+	"QUIT",
+};
+
+static size_t commands_size = 0;
+static char *commands = NULL; // pipelined RCPT commands, CHUNK_SIZE bytes
+static char *message = NULL; // headers and dot-stuffed body with final dot, MESSAGE_SIZE bytes
+static size_t message_size = 0;
+static char *chunk = NULL; // scanner works in place
+static char root_dir[256];
+static char queue_dir[256];
+static pid_t logger = -1;
+
+static struct event_loop_t *loop = NULL;
+static struct arena_t arena;
+static struct recipients_t rcpts;
+static size_t n_synced = 0;
+
+MK_CONFIG_GETTERS(CONFIG_SPEC)
+
+static void mk_commands() {
+	commands = (char *)malloc(CHUNK_SIZE + 64);
+	while (commands_size < CHUNK_SIZE - 64)
+		commands_size += (size_t)sprintf(commands + commands_size, "RCPT TO:<user%zu@mail.ru>\r\n", commands_size % 10000);
+}
+
+static void mk_message() {
+	message = (char *)malloc(MESSAGE_SIZE + 256);
+
+	memcpy(message, headers_block, sizeof(headers_block) - 1);
+	message_size = sizeof(headers_block) - 1;
+
+	srand(42);
+	while (message_size < MESSAGE_SIZE) {
+		// line starting with a dot is stuffed by client
+		if (rand() % 20 == 0) {
+			message[message_size++] = '.';
+			message[message_size++] = '.';
+		}
+
+		int len = rand() % 120;
+		int i = 0;
+		for (; i < len; ++i)
+			message[message_size++] = (char)('a' + rand() % 26);
+
+		message[message_size++] = '\r';
+		message[message_size++] = '\n';
+	}
+
+	memcpy(message + message_size, ".\r\n", 3);
+	message_size += 3;
+}
+
+static void run_parse_headers(size_t iterations) {
+	struct header_t headers[64];
+
+	size_t i = 0;
+	for (; i < iterations; ++i)
+		sink += parse_headers(headers_block, sizeof(headers_block) - 1, headers, VSIZE(headers));
+}
+
+static void run_smtp_path(size_t iterations) {
+	struct smtp_path_t path;
+
+	size_t i = 0;
+	for (; i < iterations; ++i) {
+		if (parse_smtp_path(mail_arg, sizeof(mail_arg) - 1, "FROM:", SMTP_PATH_NULL_ALLOWED, &path) == 0)
+			sink += path.mailbox_len;
+		if (parse_smtp_path(rcpt_arg, sizeof(rcpt_arg) - 1, "TO:", 0, &path) == 0)
+			sink += path.mailbox_len;
+	}
+}
+
+// verb is split by the first space as COMMAND_CAME does
+static void run_find_command(size_t iterations) {
+	size_t i = 0;
+	for (; i < iterations; ++i) {
+		size_t j = 0;
+		for (; j < VSIZE(command_lines); ++j) {
+			const char *line = command_lines[j];
+			size_t len = strlen(line);
+			const char *delim = scan_byte(line, len, ' ');
+
+			sink += find_smtp_command(line, delim ? (size_t)(delim - line) : len);
+		}
+	}
+}
+
+// commands are split by PARSE_DATA after each read
+static void run_scan_crlf(size_t iterations) {
+	size_t i = 0;
+	for (; i < iterations; ++i) {
+		const char *ptr = commands;
+		const char *end = commands + commands_size;
+		const char *delim = NULL;
+
+		while ((delim = scan_crlf(ptr, (size_t)(end - ptr)))) {
+			++sink;
+			ptr = delim + 2;
+		}
+	}
+}
+
+// message data is scanned by PARSE_MESSAGE in place, so it is copied like read() does
+static void run_scan_data(size_t iterations) {
+	size_t i = 0;
+	for (; i < iterations; ++i) {
+		struct data_scanner_t scanner;
+		scan_data_init(&scanner);
+
+		memcpy(chunk, message, CHUNK_SIZE);
+
+		size_t data_len = 0;
+		int end = 0;
+		sink += scan_data(&scanner, chunk, CHUNK_SIZE, &data_len, &end) + data_len;
+	}
+}
+
+static void on_synced(void *arg, int status) {
+	if (status != 0) {
+		printf("Can't sync %s\n", queue_dir);
+		exit(1);
+	}
+
+	++n_synced;
+}
+
+// DATA_CAME, PARSE_MESSAGE and PROCESS_DATA: chunks are unstuffed and written by message.c, messages are committed
+// into the spool and replied when queue_dir is synced
+static void run_store_message(size_t iterations) {
+	struct spool_waiter_t waiters[iterations];
+	n_synced = 0;
+
+	size_t i = 0;
+	for (; i < iterations; ++i) {
+		struct message_t *msg = message_begin("sender@example.com", &rcpts);
+		if (!msg) {
+			printf("Can't begin message\n");
+			exit(1);
+		}
+
+		struct data_scanner_t scanner;
+		scan_data_init(&scanner);
+
+		size_t off = 0;
+		int end = 0;
+		while (!end && off < message_size) {
+			size_t len = message_size - off < CHUNK_SIZE ? message_size - off : CHUNK_SIZE;
+			memcpy(chunk, message + off, len);
+
+			size_t data_len = 0;
+			off += scan_data(&scanner, chunk, len, &data_len, &end);
+
+			if (data_len && message_write(msg, chunk, data_len) != 0) {
+				printf("Can't write message\n");
+				exit(1);
+			}
+		}
+
+		char uidl[256];
+		uint64_t ticket = 0;
+		if (message_commit(msg, uidl, sizeof(uidl), &ticket) != 0
+				|| spool_wait(loop, waiters + i, ticket, on_synced, NULL) != 0) {
+			printf("Can't store message\n");
+			exit(1);
+		}
+
+		sink += ticket;
+	}
+
+	while (n_synced < iterations)
+		if (event_loop_run_once(loop) < 0) {
+			printf("Can't run event loop\n");
+			exit(1);
+		}
+}
+
+static void clean_queue() {
+	DIR *dir = opendir(queue_dir);
+	if (!dir)
+		return;
+
+	struct dirent *entry = NULL;
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		char path[512];
+		snprintf(path, sizeof(path), "%s/%s", queue_dir, entry->d_name);
+		unlink(path);
+	}
+
+	closedir(dir);
+}
+
+// spool is configured as server does it, but without chroot
+static int setup_store_message() {
+	const char *dir = getenv("BENCH_TMPFS");
+	if (!dir)
+		dir = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+
+	snprintf(root_dir, sizeof(root_dir), "%s/bench_hotpaths_XXXXXX", dir);
+	if (!mkdtemp(root_dir)) {
+		printf("Can't create directory in %s: %s\n", dir, strerror(errno));
+		*root_dir = '\0';
+		return -1;
+	}
+
+	char path[512];
+	snprintf(queue_dir, sizeof(queue_dir), "%s/queue", root_dir);
+	snprintf(path, sizeof(path), "%s/tmp", root_dir);
+	if (mkdir(queue_dir, 0755) != 0 || mkdir(path, 0755) != 0) {
+		printf("Can't create spool in %s: %s\n", root_dir, strerror(errno));
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/bench.cfg", root_dir);
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		printf("Can't create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	fprintf(f, "user = \"nobody\";\ngroup = \"nogroup\";\nlisten_host = \"127.0.0.1\";\nlisten_port = 2525;\n"
+			"root_dir = \"%s\";\nqueue_dir = \"%s/queue\";\ntmp_dir = \"%s/tmp\";\nn_workers = 1;\n"
+			"worker_max_sessions = 0;\nmax_recipients = %d;\nrecipients_db = \"\";\nhostname = \"bench.local\";\n"
+			"control_socket = \"\";\n", root_dir, root_dir, root_dir, MAX_RECIPIENTS);
+	fclose(f);
+
+	DEF_CONFIG(CONFIG_SPEC);
+	if (read_config(path) != 0 || spool_init() != 0 || !(loop = event_loop_create()))
+		return -1;
+
+	arena_init(&arena, 4096);
+	recipients_init(&rcpts, &arena);
+
+	char rcpt[64];
+	int i = 0;
+	for (; i < 3; ++i) {
+		int len = snprintf(rcpt, sizeof(rcpt), "user%d@example.org", i);
+		if (recipients_add(&rcpts, rcpt, (size_t)len) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void cleanup_store_message() {
+	char path[512];
+
+	clean_queue();
+	rmdir(queue_dir);
+	snprintf(path, sizeof(path), "%s/tmp", root_dir);
+	rmdir(path);
+	snprintf(path, sizeof(path), "%s/bench.cfg", root_dir);
+	unlink(path);
+	rmdir(root_dir);
+}
+
+static void run_log_disabled(size_t iterations) {
+	size_t i = 0;
+	for (; i < iterations; ++i)
+		log_debug("Trying to parse came command: %.*s", (int)sizeof(rcpt_arg) - 1, rcpt_arg);
+}
+
+static void run_log_enabled(size_t iterations) {
+	size_t i = 0;
+	for (; i < iterations; ++i)
+		log_debug("Trying to parse came command: %.*s", (int)sizeof(rcpt_arg) - 1, rcpt_arg);
+}
+
+static int setup_log_disabled() {
+	set_log_level(LOG_ERROR);
+	return 0;
+}
+
+// lines are written by a producer into the ring and stored by logger process into a temporary file
+static int setup_log_enabled() {
+	char path[] = "/tmp/bench_hotpaths_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		printf("Can't create log file: %s\n", strerror(errno));
+		return -1;
+	}
+	close(fd);
+
+	struct passwd *pwd = getpwuid(getuid());
+	struct group *grp = getgrgid(getgid());
+	if (!pwd || !grp || init_logger(1, path, pwd->pw_name, grp->gr_name) != 0 || reinit_logger(0) != 0) {
+		printf("Can't init logger\n");
+		unlink(path);
+		return -1;
+	}
+
+	logger = logger_pid();
+	unlink(path); // logger keeps it opened
+
+	set_log_level(LOG_DEBUG);
+	return 0;
+}
+
+struct bench_case_t {
+	const char *name;
+	size_t iterations; // per round
+	size_t bytes; // processed by one iteration
+	useconds_t pause; // between rounds
+	void (*run)(size_t iterations);
+	int (*setup)();
+	void (*round_done)(); // not timed
+
+	// results
+	double cycles_per_iter;
+	double ns_per_iter;
+};
+
+static struct bench_case_t cases[] = {
+	{ .name = "parse_headers", .iterations = 200000, .bytes = sizeof(headers_block) - 1, .run = run_parse_headers, },
+	{ .name = "parse_smtp_path", .iterations = 500000, .bytes = sizeof(mail_arg) + sizeof(rcpt_arg) - 2, .run = run_smtp_path, },
+	{ .name = "find_command", .iterations = 200000, .run = run_find_command, },
+	{ .name = "scan_crlf", .iterations = 1000, .run = run_scan_crlf, },
+	{ .name = "scan_data", .iterations = 1000, .bytes = CHUNK_SIZE, .run = run_scan_data, },
+	{ .name = "store_message", .iterations = 100, .run = run_store_message, .setup = setup_store_message, .round_done = clean_queue, },
+	{ .name = "log_disabled", .iterations = 1000000, .run = run_log_disabled, .setup = setup_log_disabled, },
+	{ .name = "log_enabled", .iterations = LOG_LINES, .pause = LOG_DRAIN_US, .run = run_log_enabled, .setup = setup_log_enabled, },
+};
+
+static void bench(struct bench_case_t *c) {
+	uint64_t best_cycles = 0;
+	uint64_t best_ns = 0;
+
+	int i = 0;
+	for (; i <= N_ROUNDS; ++i) {
+		if (c->pause)
+			usleep(c->pause);
+
+		uint64_t start_ns = now_ns();
+		uint64_t start = read_cycles();
+		c->run(c->iterations);
+		uint64_t elapsed = read_cycles() - start;
+		uint64_t elapsed_ns = now_ns() - start_ns;
+
+		if (c->round_done)
+			c->round_done();
+
+		// the first round warms up caches
+		if (i == 1 || (i > 1 && elapsed < best_cycles)) {
+			best_cycles = elapsed;
+			best_ns = elapsed_ns;
+		}
+	}
+
+	c->cycles_per_iter = (double)best_cycles / (double)c->iterations;
+	c->ns_per_iter = (double)best_ns / (double)c->iterations;
+}
+
+static double per_byte(const struct bench_case_t *c) {
+	return c->bytes ? c->cycles_per_iter / (double)c->bytes : 0;
+}
+
+static double mb_per_s(const struct bench_case_t *c) {
+	return c->bytes && c->ns_per_iter > 0 ? (double)c->bytes / c->ns_per_iter * 1e9 / 1024 / 1024 : 0;
+}
+
+static int write_json(const char *path) {
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		printf("Can't create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	fprintf(f, "{\n\t\"cycles\": \"%s\",\n\t\"rounds\": %d,\n\t\"benchmarks\": [\n", CYCLES_UNITS, N_ROUNDS);
+
+	size_t i = 0;
+	for (; i < VSIZE(cases); ++i) {
+		const struct bench_case_t *c = cases + i;
+		fprintf(f, "\t\t{ \"name\": \"%s\", \"iterations\": %zu, \"bytes\": %zu, \"cycles_per_iter\": %.1f, "
+				"\"cycles_per_byte\": %.3f, \"ns_per_iter\": %.1f, \"mb_per_s\": %.1f }%s\n",
+				c->name, c->iterations, c->bytes, c->cycles_per_iter, per_byte(c), c->ns_per_iter, mb_per_s(c),
+				i + 1 < VSIZE(cases) ? "," : "");
+	}
+
+	fprintf(f, "\t]\n}\n");
+
+	if (fclose(f) != 0) {
+		printf("Can't write %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	set_log_level(LOG_ERROR);
+
+	mk_commands();
+	mk_message();
+	chunk = (char *)malloc(CHUNK_SIZE);
+
+	size_t i = 0;
+	for (; i < VSIZE(cases); ++i) {
+		if (!strcmp(cases[i].name, "scan_crlf"))
+			cases[i].bytes = commands_size;
+		else if (!strcmp(cases[i].name, "store_message"))
+			cases[i].bytes = message_size;
+		else if (!strcmp(cases[i].name, "find_command")) {
+			size_t j = 0;
+			for (; j < VSIZE(command_lines); ++j)
+				cases[i].bytes += strlen(command_lines[j]);
+		}
+	}
+
+	printf("%-16s %12s %14s %12s %12s %10s\n", "benchmark", "iterations", CYCLES_UNITS "/iter", CYCLES_UNITS "/byte", "ns/iter", "MB/s");
+
+	int ret = 0;
+	for (i = 0; i < VSIZE(cases); ++i) {
+		struct bench_case_t *c = cases + i;
+		if (c->setup && c->setup() != 0) {
+			ret = 1;
+			continue;
+		}
+
+		bench(c);
+		printf("%-16s %12zu %14.1f %12.3f %12.1f %10.1f\n", c->name, c->iterations, c->cycles_per_iter, per_byte(c),
+				c->ns_per_iter, mb_per_s(c));
+	}
+
+	if (logger > 0) {
+		kill(logger, SIGTERM);
+		waitpid(logger, NULL, 0);
+	}
+
+	if (*root_dir)
+		cleanup_store_message();
+
+	if (argc > 1 && write_json(argv[1]) != 0)
+		ret = 1;
+
+	free(commands);
+	free(message);
+	free(chunk);
+
+	return ret;
+}
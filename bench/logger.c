@@ -0,0 +1,112 @@
+// Measures log transport throughput at trace level (-l 5): producers write lines, logger process stores them into a file
+
+#include "logger.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/wait.h>
+
+#define N_PRODUCERS 4
+#define N_LINES 200000
+#define DRAIN_TIMEOUT 30 // seconds
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// counts lines appended to the file since last call
+static size_t count_lines(int fd) {
+	char buf[65536];
+	size_t lines = 0;
+	ssize_t received = 0;
+	while ((received = read(fd, buf, sizeof(buf))) > 0) {
+		ssize_t i = 0;
+		for (; i < received; ++i)
+			lines += buf[i] == '\n';
+	}
+
+	return lines;
+}
+
+static void produce(int index) {
+	reinit_logger(index);
+	set_log_level(LOG_TRACE);
+
+	int i = 0;
+	for (; i < N_LINES; ++i)
+		log_trace("Bench line %d from producer %d: Trying to parse came command: RCPT TO:<user%d@example.com>", i, index, i);
+
+	exit(0);
+}
+
+int main() {
+	char path[] = "/tmp/bench_logger_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+
+	struct passwd *pwd = getpwuid(getuid());
+	struct group *grp = getgrgid(getgid());
+	if (!pwd || !grp) {
+		printf("Can't find current user\n");
+		return 1;
+	}
+
+	set_log_level(LOG_ERROR);
+	if (init_logger(N_PRODUCERS, path, pwd->pw_name, grp->gr_name) != 0) {
+		printf("Can't init logger\n");
+		return 1;
+	}
+
+	double start = now();
+
+	int i = 0;
+	for (; i < N_PRODUCERS; ++i) {
+		pid_t pid = fork();
+		if (pid == 0)
+			produce(i);
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < N_PRODUCERS; ++i)
+		wait(NULL);
+
+	double produced = now() - start;
+
+	// each producer writes a line about log level too
+	size_t expected = (size_t)N_PRODUCERS * (N_LINES + 1);
+	size_t found = 0;
+	while (found < expected && now() - start < DRAIN_TIMEOUT) {
+		found += count_lines(fd);
+		if (found < expected)
+			usleep(1000);
+	}
+
+	double stored = now() - start;
+
+	printf("%-10s %10.0f lines/s written by %d producers\n", "producers", (double)expected / produced, N_PRODUCERS);
+	printf("%-10s %10.0f lines/s stored by logger (%zu of %zu lines)\n", "logger", (double)found / stored, found, expected);
+
+	kill(logger_pid(), SIGTERM);
+	waitpid(logger_pid(), NULL, 0);
+
+	close(fd);
+	unlink(path);
+
+	return found == expected ? 0 : 1;
+}
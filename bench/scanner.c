@@ -0,0 +1,189 @@
+// Compares message data scanner with memmem() based delimiter search used before it
+
+#include "scanner.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DATA_SIZE (32 * 1024 * 1024)
+#define CHUNK_SIZE (64 * 1024) // READ_MAX_SIZE
+#define N_ROUNDS 5
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// dot-stuffed message with lines of random length, terminated with <CRLF>.<CRLF>
+static char *mk_message(size_t *size) {
+	char *data = (char *)malloc(DATA_SIZE + 1024);
+	size_t used = 0;
+
+	srand(42);
+	while (used < DATA_SIZE) {
+		// line starting with a dot is stuffed by client
+		if (rand() % 20 == 0) {
+			data[used++] = '.';
+			data[used++] = '.';
+		}
+
+		int len = rand() % 120;
+		int i = 0;
+		for (; i < len; ++i)
+			data[used++] = (char)('a' + rand() % 26);
+
+		data[used++] = '\r';
+		data[used++] = '\n';
+	}
+
+	memcpy(data + used, ".\r\n", 3);
+	*size = used + 3;
+
+	return data;
+}
+
+// commands pipelined by a client
+static char *mk_commands(size_t *size) {
+	char *data = (char *)malloc(DATA_SIZE + 1024);
+	size_t used = 0;
+
+	while (used < DATA_SIZE)
+		used += (size_t)sprintf(data + used, "RCPT TO:<user%zu@mail.ru>\r\n", used % 10000);
+
+	*size = used;
+	return data;
+}
+
+static size_t run_memmem(const char *data, size_t size, char *buf) {
+	size_t found = 0;
+	size_t used = 0;
+	size_t off = 0;
+
+	// "\r\n" is prepended like DATA_CAME did, 4 bytes of tail are kept between chunks
+	memcpy(buf, "\r\n", 2);
+	used = 2;
+
+	while (off < size) {
+		size_t chunk = size - off < CHUNK_SIZE ? size - off : CHUNK_SIZE;
+		memcpy(buf + used, data + off, chunk);
+		used += chunk;
+		off += chunk;
+
+		if (memmem(buf, used, "\r\n.\r\n", 5)) {
+			++found;
+			break;
+		}
+
+		memmove(buf, buf + used - 4, 4);
+		used = 4;
+	}
+
+	return found;
+}
+
+static size_t run_scanner(const char *data, size_t size, char *buf) {
+	struct data_scanner_t scanner;
+	scan_data_init(&scanner);
+
+	size_t found = 0;
+	size_t used = 0;
+	size_t off = 0;
+
+	while (off < size) {
+		size_t chunk = size - off < CHUNK_SIZE ? size - off : CHUNK_SIZE;
+		memcpy(buf + used, data + off, chunk);
+		used += chunk;
+		off += chunk;
+
+		size_t data_len = 0;
+		int end = 0;
+		size_t consumed = scan_data(&scanner, buf, used, &data_len, &end);
+		if (end) {
+			++found;
+			break;
+		}
+
+		memmove(buf, buf + consumed, used - consumed);
+		used -= consumed;
+	}
+
+	return found;
+}
+
+static size_t run_commands_memmem(const char *data, size_t size, char *buf) {
+	size_t found = 0;
+	const char *ptr = data;
+	const char *end = data + size;
+	const char *delim;
+
+	while ((delim = memmem(ptr, (size_t)(end - ptr), "\r\n", 2))) {
+		++found;
+		ptr = delim + 2;
+	}
+
+	return found;
+}
+
+static size_t run_commands_scanner(const char *data, size_t size, char *buf) {
+	size_t found = 0;
+	const char *ptr = data;
+	const char *end = data + size;
+	const char *delim;
+
+	while ((delim = scan_crlf(ptr, (size_t)(end - ptr)))) {
+		++found;
+		ptr = delim + 2;
+	}
+
+	return found;
+}
+
+typedef size_t (*bench_fn_t)(const char *data, size_t size, char *buf);
+
+static void bench(const char *name, const char *impl, bench_fn_t fn, const char *data, size_t size) {
+	if (impl && scanner_select_impl(impl) != 0) {
+		printf("%-10s %-8s not supported\n", name, impl);
+		return;
+	}
+
+	char *buf = (char *)malloc(CHUNK_SIZE + 16);
+	double best = 0;
+	size_t found = 0;
+
+	int i = 0;
+	for (; i < N_ROUNDS; ++i) {
+		double start = now();
+		found = fn(data, size, buf);
+		double elapsed = now() - start;
+
+		if (i == 0 || elapsed < best)
+			best = elapsed;
+	}
+
+	printf("%-10s %-8s %8.1f MB/s (%zu found)\n", name, impl ? impl : "memmem", (double)size / best / 1024 / 1024, found);
+	free(buf);
+}
+
+int main() {
+	size_t size = 0;
+	char *data = mk_message(&size);
+
+	bench("data", NULL, run_memmem, data, size);
+	bench("data", "scalar", run_scanner, data, size);
+	bench("data", "sse2", run_scanner, data, size);
+	bench("data", "avx2", run_scanner, data, size);
+
+	free(data);
+	data = mk_commands(&size);
+
+	bench("commands", NULL, run_commands_memmem, data, size);
+	bench("commands", "scalar", run_commands_scanner, data, size);
+	bench("commands", "sse2", run_commands_scanner, data, size);
+	bench("commands", "avx2", run_commands_scanner, data, size);
+
+	free(data);
+	return 0;
+}
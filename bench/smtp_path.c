@@ -0,0 +1,111 @@
+// Compares MAIL FROM / RCPT TO arguments parser with PCRE based matching used before it
+
+#include "smtp_path.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pcre.h>
+
+#ifndef PCRE_STUDY_JIT_COMPILE
+#	define PCRE_STUDY_JIT_COMPILE 0
+#endif
+
+#define EMAIL_RE "(?:(?:@[a-zA-Z0-9-]+\\.[a-zA-Z0-9-.]+,?)*:)?([a-zA-Z0-9_.+-]+@[a-zA-Z0-9-]+\\.[a-zA-Z0-9-.]+)"
+
+#define N_COMMANDS 1000000
+#define N_ROUNDS 5
+
+struct command_t {
+	const char *name;
+	const char *prefix;
+	const char *pattern;
+	const char *arg; // typical command argument
+};
+
+static const struct command_t commands[] = {
+	{ .name = "MAIL", .prefix = "FROM:", .pattern = "^from: ?<" EMAIL_RE "?>$", .arg = "FROM:<john.smith+list@example-mail.com>", },
+	{ .name = "RCPT", .prefix = "TO:", .pattern = "^to: ?<" EMAIL_RE ">$", .arg = "TO:<@relay.example.org:user_1@mail.example.ru>", },
+};
+
+static pcre *re = NULL;
+static pcre_extra *extra = NULL;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// exec_email_re() from proto.c: address is copied into allocated string
+static size_t run_pcre(const struct command_t *command, const char *arg, size_t len) {
+	int ovec[24];
+	if (pcre_exec(re, extra, arg, (int)len, 0, 0, ovec, VSIZE(ovec)) < 0)
+		return 0;
+
+	int addr_len = ovec[3] - ovec[2];
+	char *addr = malloc((size_t)addr_len + 1);
+	snprintf(addr, (size_t)addr_len + 1, "%.*s", addr_len, arg + ovec[2]);
+	free(addr);
+
+	return (size_t)addr_len;
+}
+
+static size_t run_parser(const struct command_t *command, const char *arg, size_t len) {
+	struct smtp_path_t path;
+	if (parse_smtp_path(arg, len, command->prefix, SMTP_PATH_NULL_ALLOWED, &path) != 0)
+		return 0;
+
+	return path.mailbox_len;
+}
+
+typedef size_t (*bench_fn_t)(const struct command_t *command, const char *arg, size_t len);
+
+static void bench(const char *name, const struct command_t *command, bench_fn_t fn) {
+	size_t len = strlen(command->arg);
+	double best = 0;
+	size_t addr_len = 0;
+
+	int i = 0;
+	for (; i < N_ROUNDS; ++i) {
+		double start = now();
+
+		int j = 0;
+		for (; j < N_COMMANDS; ++j)
+			addr_len = fn(command, command->arg, len);
+
+		double elapsed = now() - start;
+		if (i == 0 || elapsed < best)
+			best = elapsed;
+	}
+
+	printf("%-6s %-8s %8.1f ns/command (address of %zu bytes)\n", command->name, name, best * 1e9 / N_COMMANDS, addr_len);
+}
+
+int main() {
+	int i = 0;
+	for (; i < VSIZE(commands); ++i) {
+		const struct command_t *command = commands + i;
+		const char *err;
+		int err_off;
+
+		re = pcre_compile(command->pattern, PCRE_CASELESS, &err, &err_off, NULL);
+		if (!re) {
+			printf("Can't compile %s pattern: %s\n", command->name, err);
+			return 1;
+		}
+
+		extra = pcre_study(re, PCRE_STUDY_JIT_COMPILE, &err);
+
+		bench("pcre", command, run_pcre);
+		bench("parser", command, run_parser);
+
+		if (extra)
+			pcre_free_study(extra);
+		pcre_free(re);
+	}
+
+	return 0;
+}
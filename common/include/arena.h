@@ -0,0 +1,37 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/*
+ * Bump-pointer allocator. Memory is never freed one by one, all allocations are dropped at once:
+ *	struct arena_t arena;
+ *	arena_init(&arena, 4096);
+ *	char *str = arena_alloc(&arena, 16);
+ *	...
+ *	arena_reset(&arena); // str is invalid now
+ *	...
+ *	arena_free(&arena);
+ *
+ * Memory is taken from the system by blocks of block_size bytes, larger allocations get their own block.
+ */
+
+struct arena_block_t;
+
+struct arena_t {
+	struct arena_block_t *blocks; // the last allocated block is the first one
+	char *ptr;
+	char *end;
+	size_t block_size;
+};
+
+void arena_init(struct arena_t *arena, size_t block_size);
+
+// will return NULL on error. Memory is aligned for any type
+void *arena_alloc(struct arena_t *arena, size_t size);
+
+// the first block is kept, so arena doesn't allocate again while it is enough
+void arena_reset(struct arena_t *arena);
+void arena_free(struct arena_t *arena);
+
+#endif // __ARENA_H__
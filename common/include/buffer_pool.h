@@ -0,0 +1,52 @@
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Process-wide pool of I/O buffers. Sizes are rounded up to power of two, starting from BUFFER_POOL_MIN_SIZE.
+ * Released buffers are kept in per-size lists and are given out again instead of calling malloc:
+ *	size_t allocated;
+ *	char *buf = buffer_pool_get(1000, &allocated); // allocated == 1024
+ *	...
+ *	buffer_pool_put(buf, allocated);
+ *
+ * Each size class keeps at most BUFFER_POOL_CLASS_LIMIT bytes of released buffers, the rest is freed.
+ * Buffers larger than the largest class are not cached at all.
+ * Pool is not shared: each worker gets its own copy after fork.
+ */
+
+#ifndef BUFFER_POOL_MIN_SIZE
+#	define BUFFER_POOL_MIN_SIZE 512
+#endif
+
+#ifndef BUFFER_POOL_N_CLASSES
+// 512 bytes .. 64K
+#	define BUFFER_POOL_N_CLASSES 8
+#endif
+
+#ifndef BUFFER_POOL_CLASS_LIMIT
+#	define BUFFER_POOL_CLASS_LIMIT (256 * 1024)
+#endif
+
+struct buffer_pool_stats_t {
+	uint64_t hits; // buffer was taken from the pool
+	uint64_t misses; // buffer was allocated
+	uint64_t in_use; // buffers given out and not returned yet
+	size_t cached; // bytes kept in the pool
+};
+
+// will return NULL on error. Real size of the buffer is stored into allocated
+char *buffer_pool_get(size_t size, size_t *allocated);
+
+// allocated should be the value returned by buffer_pool_get(). NULL buf is ignored
+void buffer_pool_put(char *buf, size_t allocated);
+
+// moves used bytes into a buffer of at least size bytes. Old buffer is returned to the pool.
+// Will return 0 on success and -1 on error, buffer is not changed on error
+int buffer_pool_resize(char **buf, size_t *allocated, size_t used, size_t size);
+
+void buffer_pool_stats(struct buffer_pool_stats_t *stats);
+
+#endif // __BUFFER_POOL_H__
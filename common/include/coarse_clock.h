@@ -0,0 +1,31 @@
+#ifndef __COARSE_CLOCK_H__
+#define __COARSE_CLOCK_H__
+
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Per-process cached wall clock. Event loop refreshes it once per iteration, so all events of an iteration
+ * see the same time and reading it costs nothing:
+ *	time_t now = coarse_clock_now();
+ *	const char *date = coarse_clock_date(now); // "Sat, 17 Oct 2026 12:00:00 +0000"
+ *
+ * Dates are rendered with localtime_r() and strftime() only when the second changes.
+ * Returned strings are valid until the next call with another second.
+ */
+
+// precise CLOCK_REALTIME, log records are stamped with it
+void clock_gettime_impl(struct timespec *ts);
+
+// reads CLOCK_REALTIME_COARSE into the cache
+void coarse_clock_update();
+
+time_t coarse_clock_now();
+
+// RFC 5322 date-time for Date: header
+const char *coarse_clock_date(time_t sec);
+
+// "17.10.2026 12:00:00" for log lines. Length of the string is stored into len
+const char *coarse_clock_log_date(time_t sec, size_t *len);
+
+#endif // __COARSE_CLOCK_H__
@@ -4,6 +4,8 @@
 #include "assert.h"
 #include "string.h"
 
+#include <sys/socket.h>
+
 #ifdef __GNUC__
 #	define __ATTR_FORMAT__(args...) __attribute__ (( format( args ) ))
 #else
@@ -21,6 +23,18 @@
 
 #define STRSZ(str) (str), (sizeof(str) - 1)
 
+#ifndef MSG_NOSIGNAL
+#	define MSG_NOSIGNAL 0 // XXX: SIGPIPE is not suppressed here
+#endif
+
+// Last occurrence of byte in data or NULL. memrchr() is glibc-only
+static inline const char *rscan_byte(const char *data, size_t len, char byte) {
+	while (len--)
+		if (data[len] == byte)
+			return data + len;
+	return NULL;
+}
+
 // dirs is a list of directories to be used in project.
 // First directory will be used as root. All other dirs will bw subdirs of this dir
 int drop_privileges(const char *user, const char *group, const char **dirs);
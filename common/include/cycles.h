@@ -0,0 +1,32 @@
+#ifndef __CYCLES_H__
+#define __CYCLES_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Cheap timestamp to measure short code paths:
+ *	uint64_t start = read_cycles();
+ *	...
+ *	uint64_t spent = read_cycles() - start; // in CYCLES_UNITS
+ *
+ * Cycles are read with rdtsc, CLOCK_MONOTONIC nanoseconds are used on other CPUs.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#	define CYCLES_UNITS "cycles"
+#else
+#	define CYCLES_UNITS "ns"
+#endif
+
+static inline uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#endif // __CYCLES_H__
@@ -0,0 +1,64 @@
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+#include "common.h"
+
+#include <stdint.h>
+
+/*
+ * Event loop used to multiplex all descriptors, timers and signals of a process.
+ *
+ * Usage:
+ *	struct event_loop_t *loop = event_loop_create();
+ *	event_loop_add(loop, fd, EV_READ | EV_EDGE, callback, arg);
+ *	event_loop_add_timer(loop, 1000, timer_callback, arg);
+ *	event_loop_add_signal(loop, SIGCHLD, signal_callback, arg);
+ *
+ *	while (event_loop_run_once(loop) >= 0) {
+ *		...
+ *	}
+ *
+ * Epoll is used on Linux, poll() is used on other systems. There is no limit on a descriptor value.
+ *
+ * XXX: With EV_EDGE the callback is called only when the descriptor state changes,
+ * so callback should read (or accept) until EAGAIN. EV_EDGE is ignored when epoll is not available,
+ * callbacks draining descriptors work in both cases.
+ *
+ * Signals are delivered through a self-pipe: callbacks are called from the loop, not from the signal handler,
+ * so they are free to log, fork or waitpid.
+ */
+
+enum {
+	EV_READ = 1,
+	EV_WRITE = 2,
+	EV_ERROR = 4, // hangup or error on descriptor. Always reported, no need to subscribe
+	EV_EDGE = 8,
+};
+
+struct event_loop_t;
+
+typedef void (*event_cb_t)(struct event_loop_t *loop, int fd, uint32_t events, void *arg);
+typedef void (*timer_cb_t)(struct event_loop_t *loop, void *arg);
+typedef void (*signal_cb_t)(struct event_loop_t *loop, int signo, void *arg);
+
+struct event_loop_t *event_loop_create();
+
+// XXX: can be called by forked child to forget parent's loop. Descriptors registered in loop are not closed
+void event_loop_destroy(struct event_loop_t *loop);
+
+// will return 0 on success and -1 on error
+int event_loop_add(struct event_loop_t *loop, int fd, uint32_t events, event_cb_t cb, void *arg);
+int event_loop_mod(struct event_loop_t *loop, int fd, uint32_t events);
+int event_loop_del(struct event_loop_t *loop, int fd);
+
+// periodic timer. Will return timer id on success and -1 on error
+int event_loop_add_timer(struct event_loop_t *loop, unsigned interval_ms, timer_cb_t cb, void *arg);
+void event_loop_del_timer(struct event_loop_t *loop, int timer_id);
+
+// will return 0 on success and -1 on error
+int event_loop_add_signal(struct event_loop_t *loop, int signo, signal_cb_t cb, void *arg);
+
+// wait for events and dispatch them. Will return number of dispatched events or -1 on error
+int event_loop_run_once(struct event_loop_t *loop);
+
+#endif // __EVENT_LOOP_H__
@@ -1,6 +1,8 @@
 #ifndef __FSM_H__
 #define __FSM_H__
 
+#include <stdint.h>
+
 /* XXX: define STATES_LIST in a following format:
  * #define STATES_LIST(ARG, _) \
  *	_(ARG, INIT_STATE, FSM_INIT_STATE) \
@@ -36,8 +38,53 @@
  * userdata can be used to catch state machine results
  *
  * FSM_STATE_TYPE macro can be used to decalre state type
+ *
+ * State machine can be stopped in the middle and resumed later (f.e. when it waits for I/O).
+ * Mark such states with FSM_YIELD_STATE:
+ *	_(ARG, WAIT_IO, FSM_YIELD_STATE)
+ * Any number of yield states are allowed. Yield state should have a callback.
+ * Declare cursor of type FSM_CURSOR_TYPE(name), initialize it with FSM_CURSOR_INIT(name) and call
+ *	FSM_STEP(name, &cursor, userdata)
+ * State machine will run until it comes into any yield state or into the last state.
+ * FSM_STEP returns 1 when last state was reached and 0 when state machine yields.
+ * Next FSM_STEP call with the same cursor will start from the callback of the yield state.
+ * FSM_RUN ignores yield states.
+ *
+ * State is a pointer to constant descriptor of the state: callback returns it and the next state is read from it
+ * without any call.
+ * By default states are dispatched via table of callbacks. Define FSM_SWITCH_DISPATCH to generate
+ * switch() over states instead: callbacks are called directly and can be inlined by compiler.
+ *
+ * Define FSM_PROFILE to measure callbacks: each call is timed with cycle counter (with CLOCK_MONOTONIC nanoseconds
+ * where there is no cycle counter), calls and times are accumulated per state of every machine.
+ * fsm_profile_dump() writes them into the log, fsm_profile_reset() drops them (f.e. in forked child).
  */
 
+#ifndef FSM_PROFILE_BUCKETS
+// log2 histogram of callback time: bucket i counts calls, which took less than 2^i cycles
+#	define FSM_PROFILE_BUCKETS 40
+#endif
+
+struct fsm_state_profile_t {
+	uint64_t calls;
+	uint64_t cycles;
+	uint64_t hist[FSM_PROFILE_BUCKETS];
+};
+
+struct fsm_profile_t {
+	const char *name;
+	unsigned n_states;
+	const char *const *state_names;
+	struct fsm_state_profile_t *states;
+
+	struct fsm_profile_t *next;
+};
+
+// machines are registered by constructors when FSM_PROFILE is defined
+void fsm_profile_register(struct fsm_profile_t *profile);
+void fsm_profile_reset();
+void fsm_profile_dump();
+
 #define FSM_STATE_TYPE(name) __fsm_## name ##_state_cb_t
 #define FSM_INIT_STATE(name) __fsm_## name ##_init_state
 #define FSM_LAST_STATE(name) __fsm_## name ##_last_state
@@ -49,6 +96,11 @@
 #define __FSM_CALLBACK_NAME(name, cb_name) __fsm_## name ##_## cb_name ##_state_cb
 #define __FSM_USERDATA_T_NAME(name) __fsm_## name ##_userdata_t
 #define __FSM_STATES_LIST(name) __fsm_## name ##_states_list
+#define __FSM_YIELD_TABLE(name) __fsm_## name ##_yield_table
+#define __FSM_DISPATCHER(name) __fsm_## name ##_dispatch
+#define __FSM_STATE_NAMES(name) __fsm_## name ##_state_names
+#define __FSM_PROFILE(name) __fsm_## name ##_profile
+#define __FSM_PROFILE_STATES(name) __fsm_## name ##_profile_states
 
 // at least 2 args
 #define __FSM_GET_MACRO(_1, _2, _3, NAME, ...) NAME
@@ -69,11 +121,28 @@
 
 #define __FSM_DECLARE_STATE_IMPL(sname, name, ...) [__FSM_STATE(sname, name)] = __FSM_CALLBACK_NAME(sname, name),
 
-#define __FSM_DECLARE_STATES(name, STATES_LIST) \
+#ifdef FSM_SWITCH_DISPATCH
+#	define __FSM_DECLARE_STATES(name, STATES_LIST) /* callbacks are called from switch */
+#else
+#	define __FSM_DECLARE_STATES(name, STATES_LIST) \
 	static __FSM_CB_TYPE(name) __FSM_STATES_LIST(name)[] = { \
 		[__FSM_FIRST_STATE(name)] = NULL, \
 		STATES_LIST(name, __FSM_DECLARE_STATE_IMPL) \
 	};
+#endif
+
+#define __FSM_YIELD_FLAG_FSM_INIT_STATE 0
+#define __FSM_YIELD_FLAG_FSM_LAST_STATE 0
+#define __FSM_YIELD_FLAG_FSM_YIELD_STATE 1
+
+#define __FSM_DECLARE_YIELD_FLAG_IMPL(sname, name, type) [__FSM_STATE(sname, name)] = __FSM_YIELD_FLAG_## type,
+#define __FSM_DECLARE_YIELD_FLAG(...) \
+	__FSM_GET_MACRO(__VA_ARGS__, __FSM_DECLARE_YIELD_FLAG_IMPL, __FSM_DUMMY_MACRO)(__VA_ARGS__)
+
+#define __FSM_DECLARE_YIELD_TABLE(name, STATES_LIST) \
+	static const unsigned char __FSM_YIELD_TABLE(name)[__FSM_MAX_ID(name)] __attribute__((unused)) = { \
+		STATES_LIST(name, __FSM_DECLARE_YIELD_FLAG) \
+	};
 
 #define FSM_CB(name, cb_name, userdata_arg_name) \
 	static FSM_STATE_TYPE(name) __FSM_CALLBACK_NAME(name, cb_name)(__FSM_USERDATA_T_NAME(name) userdata_arg_name)
@@ -85,31 +154,71 @@
 #	define __FSM_DECL_ST_NAME(state) .state_name = #state,
 #	define __FSM_DECL_ST_NAME_FIELD const char *state_name;
 #	define __FSM_GET_STATE(name, some_call) ({ \
-		const __FSM_LOCAL_STATE_TYPE(name) st = (some_call); \
-		log_trace("FSM " # name ": next state is %s", st.state_name); \
-		st.st; \
+		const __FSM_LOCAL_STATE_TYPE(name) *st = (some_call); \
+		log_trace("FSM " # name ": next state is %s", st->state_name); \
+		st->st; \
 	})
 #else // LOG_STATES
 #	define __FSM_DECL_ST_NAME(state)
 #	define __FSM_DECL_ST_NAME_FIELD
-#	define __FSM_GET_STATE(name, some_call) ({ some_call.st; })
+#	define __FSM_GET_STATE(name, some_call) ({ (some_call)->st; })
 #endif // LOG_STATES
 
+#ifdef FSM_PROFILE
+#	include "cycles.h"
+
+static inline void fsm_profile_record(struct fsm_state_profile_t *st, uint64_t cycles) {
+	unsigned bucket = cycles ? 64 - (unsigned)__builtin_clzll(cycles) : 0;
+
+	++st->calls;
+	st->cycles += cycles;
+	++st->hist[bucket < FSM_PROFILE_BUCKETS ? bucket : FSM_PROFILE_BUCKETS - 1];
+}
+
+#	define __FSM_DECLARE_STATE_NAME(sname, name, ...) [__FSM_STATE(sname, name)] = #name,
+#	define __FSM_DECLARE_PROFILE(name, STATES_LIST) \
+	static const char *const __FSM_STATE_NAMES(name)[__FSM_MAX_ID(name)] = { \
+		STATES_LIST(name, __FSM_DECLARE_STATE_NAME) \
+	}; \
+	static struct fsm_state_profile_t __FSM_PROFILE_STATES(name)[__FSM_MAX_ID(name)]; \
+	static struct fsm_profile_t __FSM_PROFILE(name) = { \
+		#name, __FSM_MAX_ID(name), __FSM_STATE_NAMES(name), __FSM_PROFILE_STATES(name), NULL, \
+	}; \
+	static __attribute__((constructor)) void __fsm_## name ##_register_profile() { \
+		fsm_profile_register(&__FSM_PROFILE(name)); \
+	}
+// callback is timed, reading of the returned state costs nothing
+#	define __FSM_PROFILED_CALL(name, state, call) ({ \
+		uint64_t __fsm_start = read_cycles(); \
+		FSM_STATE_TYPE(name) __fsm_next = (call); \
+		fsm_profile_record(__FSM_PROFILE_STATES(name) + (state), read_cycles() - __fsm_start); \
+		__fsm_next; \
+	})
+#else // FSM_PROFILE
+#	define __FSM_DECLARE_PROFILE(name, STATES_LIST)
+#	define __FSM_PROFILED_CALL(name, state, call) (call)
+#endif // FSM_PROFILE
+
+// array of one element: state name is a constant pointer to its descriptor
 #define __FSM_DECLARE_SINGLE_STATE(name, state, ...) \
-	inline static __FSM_LOCAL_STATE_TYPE(name) state() { return (__FSM_LOCAL_STATE_TYPE(name)){ .st = __FSM_STATE(name, state), __FSM_DECL_ST_NAME(state) }; }
+	static const __FSM_LOCAL_STATE_TYPE(name) state[1] __attribute__((unused)) = { \
+		{ .st = __FSM_STATE(name, state), __FSM_DECL_ST_NAME(state) }, \
+	};
 
 #define __FSM_PREDECLARE_FUNCTIONS(name, STATES_LIST) \
 	STATES_LIST(name, __FSM_PREDECLARE_FUNCTION_IMPL) \
 	STATES_LIST(name, __FSM_DECLARE_SINGLE_STATE)
 
-#define __FSM__FSM_INIT_STATE_CB_DEFINER(name, state) /* do nothing */
+#define __FSM__FSM_INIT_STATE_CB_DEFINER(name, state) \
+	static FSM_STATE_TYPE(name) FSM_INIT_STATE(name) = state;
 #define __FSM__FSM_LAST_STATE_CB_DEFINER(name, state) \
+	static FSM_STATE_TYPE(name) FSM_LAST_STATE(name) = state; \
 	FSM_CB(name, state, arg __attribute__((unused))) { assert(!"This function never should be called!"); return state; }
+#define __FSM__FSM_YIELD_STATE_CB_DEFINER(name, state) /* do nothing */
 
 #define __FSM_MK_CB_DEFINER_FROM_STATE_TYPE(type) __FSM__## type ##_CB_DEFINER
 
 #define __FSM_DECLARE_SERVICE_STATE(name, state, type) \
-	static FSM_STATE_TYPE(name) type(name) = state; \
 	__FSM_MK_CB_DEFINER_FROM_STATE_TYPE(type)(name, state)
 
 #define __FSM_DECLARE_FIRST_AND_LAST_STATES_IMPL(...) \
@@ -118,23 +227,64 @@
 #define __FSM_DECLARE_FIRST_AND_LAST_STATES(name, STATES_LIST) \
 	STATES_LIST(name, __FSM_DECLARE_FIRST_AND_LAST_STATES_IMPL)
 
+#define __FSM_SWITCH_CASE(sname, state, ...) \
+	case __FSM_STATE(sname, state): \
+		return __FSM_GET_STATE(sname, __FSM_PROFILED_CALL(sname, __FSM_STATE(sname, state), \
+					__FSM_CALLBACK_NAME(sname, state)(userdata)));
+
+#ifdef FSM_SWITCH_DISPATCH
+#	define __FSM_DISPATCH_IMPL(name, STATES_LIST) \
+		switch (state) { \
+			STATES_LIST(name, __FSM_SWITCH_CASE) \
+			default: break; \
+		} \
+		assert(!"Unknown state"); \
+		return state;
+#else
+#	define __FSM_DISPATCH_IMPL(name, STATES_LIST) \
+		return __FSM_GET_STATE(name, __FSM_PROFILED_CALL(name, state, __FSM_STATES_LIST(name)[state](userdata)));
+#endif
+
+// calls callback of the given state and returns next state
+#define __FSM_DECLARE_DISPATCHER(name, STATES_LIST) \
+	inline static __FSM_STATE_TYPE_LOCAL(name) __FSM_DISPATCHER(name)(__FSM_STATE_TYPE_LOCAL(name) state, __FSM_USERDATA_T_NAME(name) userdata) { \
+		assert(state > __FSM_FIRST_STATE(name) && state < __FSM_MAX_ID(name)); \
+		__FSM_DISPATCH_IMPL(name, STATES_LIST) \
+	}
+
 #define FSM(name, STATES_LIST, userdata_t) \
 	__FSM_DECLARE_STATES_LIST(name, STATES_LIST) \
 	__FSM_LOCAL_STATE_TYPE(name) { __FSM_STATE_TYPE_LOCAL(name) st; __FSM_DECL_ST_NAME_FIELD }; \
-	typedef __FSM_LOCAL_STATE_TYPE(name) (*FSM_STATE_TYPE(name))(); \
+	typedef const __FSM_LOCAL_STATE_TYPE(name) *FSM_STATE_TYPE(name); \
 	typedef FSM_STATE_TYPE(name) (*__FSM_CB_TYPE(name))(userdata_t user_data); \
 	typedef userdata_t __FSM_USERDATA_T_NAME(name); \
 	__FSM_PREDECLARE_FUNCTIONS(name, STATES_LIST) \
 	__FSM_DECLARE_STATES(name, STATES_LIST) \
-	__FSM_DECLARE_FIRST_AND_LAST_STATES(name, STATES_LIST)
+	__FSM_DECLARE_YIELD_TABLE(name, STATES_LIST) \
+	__FSM_DECLARE_FIRST_AND_LAST_STATES(name, STATES_LIST) \
+	__FSM_DECLARE_PROFILE(name, STATES_LIST) \
+	__FSM_DECLARE_DISPATCHER(name, STATES_LIST)
+
+#define FSM_CURSOR_TYPE(name) __FSM_STATE_TYPE_LOCAL(name)
+#define FSM_CURSOR_INIT(name) (FSM_INIT_STATE(name)->st)
 
 #define FSM_RUN(name, userdata) ({ \
-	__FSM_STATE_TYPE_LOCAL(name) current_state = FSM_INIT_STATE(name)().st; \
-	__FSM_STATE_TYPE_LOCAL(name) last_state = FSM_LAST_STATE(name)().st; \
+	__FSM_STATE_TYPE_LOCAL(name) current_state = FSM_INIT_STATE(name)->st; \
+	__FSM_STATE_TYPE_LOCAL(name) last_state = FSM_LAST_STATE(name)->st; \
 	while (current_state != last_state) { \
-		assert(current_state > __FSM_FIRST_STATE(name) && current_state < __FSM_MAX_ID(name)); \
-		current_state = __FSM_GET_STATE(name, __FSM_STATES_LIST(name)[current_state](userdata)()); \
+		current_state = __FSM_DISPATCHER(name)(current_state, userdata); \
+	} \
+})
+
+#define FSM_STEP(name, cursor, userdata) ({ \
+	__FSM_STATE_TYPE_LOCAL(name) *current_state = (cursor); \
+	__FSM_STATE_TYPE_LOCAL(name) last_state = FSM_LAST_STATE(name)->st; \
+	int yielded = 0; \
+	while (!yielded && *current_state != last_state) { \
+		*current_state = __FSM_DISPATCHER(name)(*current_state, userdata); \
+		yielded = __FSM_YIELD_TABLE(name)[*current_state]; \
 	} \
+	*current_state == last_state; \
 })
 
 #endif // __FSM_H__
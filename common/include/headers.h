@@ -0,0 +1,32 @@
+#ifndef __HEADERS_H__
+#define __HEADERS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Message headers tokenizer (RFC 5322, 2.2). Nothing is copied: spans point into parsed data.
+ *
+ *	struct header_t headers[64];
+ *	size_t n_headers = parse_headers(data, data_len, headers, VSIZE(headers));
+ *
+ * Parsing stops on empty line. Folded lines are kept in value as is, so value can be written back without changes.
+ * Lines, which are not headers, are skipped.
+ */
+
+struct header_t {
+	const char *name;
+	size_t name_len;
+	const char *value;
+	size_t value_len;
+
+	uint32_t name_hash; // header_name_hash() of name
+};
+
+// case-insensitive hash of header name
+uint32_t header_name_hash(const char *name, size_t len);
+
+// will return number of parsed headers, max_headers at most
+size_t parse_headers(const char *data, size_t len, struct header_t *headers, size_t max_headers);
+
+#endif // __HEADERS_H__
@@ -37,7 +37,6 @@ void log_impl(int lvl, const char *fmt, ...) __ATTR_FORMAT__(printf, 2, 3);
 int reinit_logger(int index);
 int init_logger(int n_processes, const char *logfile, const char *user, const char *group);
 pid_t logger_pid();
-int logger_sock();
 
 void deinitialize_logger();
 
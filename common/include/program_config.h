@@ -20,6 +20,12 @@
  *  In main() function call DEF_CONFIG(CONFIG_SPEC) and after this read_config(filename).
  *  This will initialize config with values from the given config file.
  *
+ *  All options are required. Options, which can be omitted, are listed with their defaults:
+ *	#define CONFIG_DEFAULTS(_) \
+ *		_(max_recipients, INT, 100) \
+ *		...etc
+ *  and SET_CONFIG_DEFAULTS(CONFIG_DEFAULTS) is called between DEF_CONFIG() and read_config().
+ *
  *  Function will return -1 on error and 0 on read success
  *
  *  To add new option type add option name to TYPES() macro and set _NEW_TYPE macro in the format below
@@ -76,6 +82,7 @@ enum config_option_type_t {
 struct option_t {
 	const char *opt_name;
 	enum config_option_type_t opt_type;
+	int optional; // value is set to default one, when option is not found
 	union {
 		TYPES(MK_OPT_VAR)
 	};
@@ -86,6 +93,12 @@ struct option_t {
 		OPTS_LIST(SINGLE_OPT) \
 	}
 
+#define DEFAULT_OPT(name, type, value) \
+	__just_a_config[OPT_INDEX_## name].optional = 1; \
+	__just_a_config[OPT_INDEX_## name].TO_TYPE(type)(GETTER_VAR) = value;
+
+#define SET_CONFIG_DEFAULTS(DEFAULTS_LIST) do { DEFAULTS_LIST(DEFAULT_OPT) } while (0)
+
 TYPES(MK_OPT_GETTER)
 
 // read_config should be called on program initialize
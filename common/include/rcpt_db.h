@@ -0,0 +1,78 @@
+#ifndef __RCPT_DB_H__
+#define __RCPT_DB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Read-only database of local recipients. It is built by tools/mkrcptdb and is mapped into memory by workers:
+ *	struct rcpt_db_t db;
+ *	rcpt_db_open(&db, "recipients.db");
+ *	int flags = rcpt_db_lookup(&db, "user@example.com", 16);
+ *
+ * Lookup doesn't make syscalls. rcpt_db_reload() maps the file again when it was replaced by rename(),
+ * so the database can be rebuilt while server is running.
+ *
+ * File layout (host byte order):
+ *	struct rcpt_db_header_t
+ *	struct rcpt_db_slot_t[n_slots] -- open addressing hash table with linear probing, offset 0 is an empty slot
+ *	records -- struct rcpt_db_record_t followed by the key, each record is aligned to 4 bytes
+ *
+ * Keys are in lower case: "user@domain" for mailboxes and "domain" for domains.
+ */
+
+#define RCPT_DB_MAGIC 0x42444352 // "RCDB"
+#define RCPT_DB_VERSION 1
+
+enum {
+	RCPT_DB_MAILBOX = 1,
+	RCPT_DB_DOMAIN = 2,
+	RCPT_DB_CATCH_ALL = 4, // any user of the domain is accepted
+};
+
+struct rcpt_db_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_slots; // power of two
+	uint32_t n_records;
+	uint64_t size; // size of the whole file
+};
+
+struct rcpt_db_slot_t {
+	uint32_t hash;
+	uint32_t offset;
+};
+
+struct rcpt_db_record_t {
+	uint16_t len;
+	uint8_t flags;
+	uint8_t reserved;
+};
+
+struct rcpt_db_t {
+	const char *data; // NULL if database is not opened
+	size_t size;
+	const struct rcpt_db_slot_t *slots;
+	uint32_t mask;
+
+	// mapped file, it is compared with the file on disk on reload
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+};
+
+// case-insensitive FNV-1a
+uint32_t rcpt_db_hash(const char *key, size_t len);
+
+// Will return 0 on success and -1 on error
+int rcpt_db_open(struct rcpt_db_t *db, const char *path);
+void rcpt_db_close(struct rcpt_db_t *db);
+
+// Maps the file again if it was replaced. Will return 0 on success and -1 on error, old data is kept on error
+int rcpt_db_reload(struct rcpt_db_t *db, const char *path);
+
+// key is case-insensitive. Will return flags of the record or 0 if there is no such key
+int rcpt_db_lookup(const struct rcpt_db_t *db, const char *key, size_t len);
+
+#endif // __RCPT_DB_H__
@@ -0,0 +1,44 @@
+#ifndef __SCANNER_H__
+#define __SCANNER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Search in received data.
+ * Vectorized implementation (AVX2 or SSE2) is chosen at startup, scalar one is used on other CPUs.
+ */
+
+// will return pointer to the first byte in data or NULL
+const char *scan_byte(const char *data, size_t len, char byte);
+
+// will return pointer to the first "\r\n" in data or NULL
+const char *scan_crlf(const char *data, size_t len);
+
+/*
+ * Message data scanner: finds end of data (<CRLF>.<CRLF>) and removes leading dots (RFC 5321, 4.5.2).
+ * Initialize it right after DATA command: data starts from the beginning of a line.
+ *
+ *	size_t data_len;
+ *	int end;
+ *	size_t consumed = scan_data(&scanner, chunk, chunk_len, &data_len, &end);
+ *
+ * Chunk is processed in place: first data_len bytes are replaced with message data without stuffed dots.
+ * Bytes after consumed (2 at most) can't be processed without the next chunk, they should be passed again.
+ * end is set when end of data was found, final dot line is included into consumed bytes then and scanner is
+ * ready for the next message.
+ */
+struct data_scanner_t {
+	uint8_t bol; // next byte starts a line
+	uint8_t cr; // last scanned byte was '\r'
+};
+
+void scan_data_init(struct data_scanner_t *scanner);
+size_t scan_data(struct data_scanner_t *scanner, char *data, size_t len, size_t *data_len, int *end);
+
+// Used by benchmarks: "scalar", "sse2" or "avx2".
+// Will return 0 on success and -1 when implementation is not supported
+int scanner_select_impl(const char *name);
+const char *scanner_impl_name();
+
+#endif // __SCANNER_H__
@@ -0,0 +1,40 @@
+#ifndef __SMTP_COMMAND_H__
+#define __SMTP_COMMAND_H__
+
+#include <stddef.h>
+
+/*
+ * Lookup of SMTP command verbs. Verb is compared case-insensitively (RFC 5321, 2.4):
+ *	enum smtp_command_t command = find_smtp_command(line, verb_len);
+ *	if (command == CMD_UNKNOWN)
+ *		500 Unknown command
+ *
+ * Verb is packed into 32 bits and found with a single switch.
+ */
+
+// verb and its letters
+#define SMTP_COMMANDS(_) \
+	_(QUIT, 'q', 'u', 'i', 't') \
+	_(RSET, 'r', 's', 'e', 't') \
+	_(HELO, 'h', 'e', 'l', 'o') \
+	_(EHLO, 'e', 'h', 'l', 'o') \
+	_(MAIL, 'm', 'a', 'i', 'l') \
+	_(RCPT, 'r', 'c', 'p', 't') \
+	_(DATA, 'd', 'a', 't', 'a') \
+
+#define MK_CMD_ENUM(name, ...) CMD_## name,
+
+enum smtp_command_t {
+	SMTP_COMMANDS(MK_CMD_ENUM)
+	CMD_MAX,
+	CMD_UNKNOWN = CMD_MAX,
+};
+
+#undef MK_CMD_ENUM
+
+enum smtp_command_t find_smtp_command(const char *verb, size_t len);
+
+// "unknown" for CMD_UNKNOWN. Will return NULL if there is no such command
+const char *smtp_command_name(unsigned command);
+
+#endif // __SMTP_COMMAND_H__
@@ -0,0 +1,45 @@
+#ifndef __SMTP_PATH_H__
+#define __SMTP_PATH_H__
+
+#include <stddef.h>
+
+/*
+ * Parser of MAIL FROM and RCPT TO arguments (RFC 5321, 4.1.2). Nothing is allocated: spans point into parsed data.
+ *
+ *	struct smtp_path_t path;
+ *	if (parse_smtp_path(arg, arg_len, "FROM:", SMTP_PATH_NULL_ALLOWED, &path) != 0)
+ *		syntax error
+ *
+ * Source route is skipped, mailbox is "local@domain" without brackets. Domain should have at least two labels.
+ * Quoted local parts and address literals are not supported.
+ * ESMTP parameters after the path are only split into keyword and value, they are checked by caller.
+ */
+
+// Path is 256 octets at most (RFC 5321, 4.5.3.1.3)
+#define SMTP_PATH_MAX_LEN 256
+#define SMTP_PATH_MAX_PARAMS 8
+
+enum {
+	SMTP_PATH_NULL_ALLOWED = 1, // "<>" is valid reverse-path
+	SMTP_PATH_POSTMASTER = 2, // "<Postmaster>" without domain is valid forward-path
+};
+
+struct smtp_param_t {
+	const char *keyword;
+	size_t keyword_len;
+	const char *value; // NULL for parameters without value
+	size_t value_len;
+};
+
+struct smtp_path_t {
+	const char *mailbox; // empty for null reverse-path
+	size_t mailbox_len;
+
+	struct smtp_param_t params[SMTP_PATH_MAX_PARAMS];
+	size_t n_params;
+};
+
+// prefix is "FROM:" or "TO:", it is case-insensitive. Will return 0 on success and -1 on syntax error
+int parse_smtp_path(const char *data, size_t len, const char *prefix, int flags, struct smtp_path_t *path);
+
+#endif // __SMTP_PATH_H__
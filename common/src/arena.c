@@ -0,0 +1,74 @@
+#include "arena.h"
+#include "logger.h"
+
+#include <stdlib.h>
+
+#define ARENA_ALIGN 16
+
+struct arena_block_t {
+	struct arena_block_t *next;
+	size_t size;
+} __attribute__((aligned(ARENA_ALIGN)));
+
+void arena_init(struct arena_t *arena, size_t block_size) {
+	arena->blocks = NULL;
+	arena->ptr = arena->end = NULL;
+	arena->block_size = block_size;
+}
+
+static void use_block(struct arena_t *arena, struct arena_block_t *block) {
+	arena->ptr = (char *)(block + 1);
+	arena->end = arena->ptr + block->size;
+}
+
+void *arena_alloc(struct arena_t *arena, size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if ((size_t)(arena->end - arena->ptr) < size) {
+		size_t block_size = size > arena->block_size ? size : arena->block_size;
+
+		struct arena_block_t *block = (struct arena_block_t *)malloc(sizeof(*block) + block_size);
+		if (!block) {
+			log_error("Can't allocate %zu bytes for arena", block_size);
+			return NULL;
+		}
+
+		block->size = block_size;
+		block->next = arena->blocks;
+		arena->blocks = block;
+		use_block(arena, block);
+	}
+
+	void *ret = arena->ptr;
+	arena->ptr += size;
+
+	return ret;
+}
+
+void arena_reset(struct arena_t *arena) {
+	struct arena_block_t *block = arena->blocks;
+	while (block && block->next) {
+		struct arena_block_t *next = block->next;
+		free(block);
+		block = next;
+	}
+
+	// huge blocks are not kept
+	if (block && block->size != arena->block_size) {
+		free(block);
+		block = NULL;
+	}
+
+	arena->blocks = block;
+	arena->ptr = arena->end = NULL;
+	if (block)
+		use_block(arena, block);
+}
+
+void arena_free(struct arena_t *arena) {
+	arena_reset(arena);
+
+	free(arena->blocks);
+	arena->blocks = NULL;
+	arena->ptr = arena->end = NULL;
+}
@@ -0,0 +1,105 @@
+#include "buffer_pool.h"
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct free_buffer_t {
+	struct free_buffer_t *next;
+};
+
+struct size_class_t {
+	struct free_buffer_t *free;
+	size_t n_free;
+};
+
+static struct size_class_t classes[BUFFER_POOL_N_CLASSES];
+static struct buffer_pool_stats_t pool_stats;
+
+#define CLASS_SIZE(i) ((size_t)BUFFER_POOL_MIN_SIZE << (i))
+#define MAX_FREE(i) (CLASS_SIZE(i) >= BUFFER_POOL_CLASS_LIMIT ? 1 : BUFFER_POOL_CLASS_LIMIT / CLASS_SIZE(i))
+
+// will return index of the smallest class which fits size and set allocated to its size.
+// Index is BUFFER_POOL_N_CLASSES or greater for buffers which are not cached
+static size_t get_class(size_t size, size_t *allocated) {
+	size_t i = 0;
+	size_t class_size = BUFFER_POOL_MIN_SIZE;
+	while (class_size < size) {
+		class_size <<= 1;
+		++i;
+	}
+
+	*allocated = class_size;
+	return i;
+}
+
+char *buffer_pool_get(size_t size, size_t *allocated) {
+	size_t class_size = 0;
+	size_t i = get_class(size, &class_size);
+
+	char *buf = NULL;
+	if (i < BUFFER_POOL_N_CLASSES && classes[i].free) {
+		struct free_buffer_t *head = classes[i].free;
+		classes[i].free = head->next;
+		--classes[i].n_free;
+
+		pool_stats.cached -= class_size;
+		++pool_stats.hits;
+
+		buf = (char *)head;
+	} else {
+		buf = (char *)malloc(class_size);
+		if (!buf) {
+			log_error("Can't allocate buffer of %zu bytes", class_size);
+			return NULL;
+		}
+
+		++pool_stats.misses;
+	}
+
+	++pool_stats.in_use;
+	*allocated = class_size;
+
+	return buf;
+}
+
+void buffer_pool_put(char *buf, size_t allocated) {
+	if (!buf)
+		return;
+
+	--pool_stats.in_use;
+
+	size_t class_size = 0;
+	size_t i = get_class(allocated, &class_size);
+	if (i >= BUFFER_POOL_N_CLASSES || class_size != allocated || classes[i].n_free >= MAX_FREE(i)) {
+		free(buf);
+		return;
+	}
+
+	struct free_buffer_t *head = (struct free_buffer_t *)buf;
+	head->next = classes[i].free;
+	classes[i].free = head;
+	++classes[i].n_free;
+
+	pool_stats.cached += class_size;
+}
+
+int buffer_pool_resize(char **buf, size_t *allocated, size_t used, size_t size) {
+	size_t new_allocated = 0;
+	char *new_buf = buffer_pool_get(size, &new_allocated);
+	if (!new_buf)
+		return -1;
+
+	if (used)
+		memcpy(new_buf, *buf, used);
+
+	buffer_pool_put(*buf, *allocated);
+	*buf = new_buf;
+	*allocated = new_allocated;
+
+	return 0;
+}
+
+void buffer_pool_stats(struct buffer_pool_stats_t *stats) {
+	*stats = pool_stats;
+}
@@ -0,0 +1,78 @@
+#include "coarse_clock.h"
+
+#ifdef __MACH__ // fucking Machintosh
+#include <mach/clock.h>
+#include <mach/mach.h>
+
+void clock_gettime_impl(struct timespec *ts) {
+	clock_serv_t cclock;
+	mach_timespec_t mts;
+	host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock);
+	clock_get_time(cclock, &mts);
+	mach_port_deallocate(mach_task_self(), cclock);
+	ts->tv_sec = mts.tv_sec;
+	ts->tv_nsec = mts.tv_nsec;
+}
+
+#	define coarse_gettime clock_gettime_impl
+
+#else
+
+void clock_gettime_impl(struct timespec *ts) {
+	clock_gettime(CLOCK_REALTIME, ts);
+}
+
+static void coarse_gettime(struct timespec *ts) {
+#ifdef CLOCK_REALTIME_COARSE
+	clock_gettime(CLOCK_REALTIME_COARSE, ts);
+#else
+	clock_gettime(CLOCK_REALTIME, ts);
+#endif
+}
+
+#endif
+
+struct rendered_date_t {
+	time_t sec;
+	size_t len; // 0 if date was not rendered yet
+	char str[64];
+};
+
+static struct timespec now;
+static struct rendered_date_t header_date;
+static struct rendered_date_t log_date;
+
+void coarse_clock_update() {
+	coarse_gettime(&now);
+}
+
+time_t coarse_clock_now() {
+	// process doesn't run event loop yet
+	if (!now.tv_sec)
+		coarse_clock_update();
+
+	return now.tv_sec;
+}
+
+static const char *render(struct rendered_date_t *date, time_t sec, const char *fmt) {
+	if (date->len && date->sec == sec)
+		return date->str;
+
+	struct tm tm;
+	date->len = localtime_r(&sec, &tm) ? strftime(date->str, sizeof(date->str), fmt, &tm) : 0;
+	date->sec = sec;
+	if (!date->len)
+		date->str[0] = '\0';
+
+	return date->str;
+}
+
+const char *coarse_clock_date(time_t sec) {
+	return render(&header_date, sec, "%a, %e %b %Y %T %z");
+}
+
+const char *coarse_clock_log_date(time_t sec, size_t *len) {
+	const char *str = render(&log_date, sec, "%d.%m.%Y %H:%M:%S");
+	*len = log_date.len;
+	return str;
+}
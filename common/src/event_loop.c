@@ -0,0 +1,478 @@
+#include "event_loop.h"
+#include "logger.h"
+#include "common.h"
+#include "coarse_clock.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#ifdef __linux__
+#	include <sys/epoll.h>
+#	define USE_EPOLL
+#else
+#	include <poll.h>
+#endif
+
+#ifndef EVENT_LOOP_MAX_EVENTS
+// max number of events returned by single epoll_wait() call
+#	define EVENT_LOOP_MAX_EVENTS 256
+#endif
+
+#ifndef EVENT_LOOP_MAX_TIMERS
+#	define EVENT_LOOP_MAX_TIMERS 16
+#endif
+
+#define EVENT_LOOP_MAX_SIGNALS 32
+
+struct event_handler_t {
+	event_cb_t cb;
+	void *arg;
+	uint32_t events;
+};
+
+struct event_timer_t {
+	timer_cb_t cb;
+	void *arg;
+	unsigned interval_ms;
+	uint64_t deadline_ms;
+};
+
+struct event_signal_t {
+	signal_cb_t cb;
+	void *arg;
+};
+
+struct event_loop_t {
+	int poll_fd; // epoll descriptor
+
+	struct event_handler_t *handlers; // indexed by descriptor
+	int n_handlers;
+
+#ifndef USE_EPOLL
+	struct pollfd *pollfds;
+	int n_pollfds;
+#endif
+
+	struct event_timer_t timers[EVENT_LOOP_MAX_TIMERS];
+	struct event_signal_t signals[EVENT_LOOP_MAX_SIGNALS];
+
+	int signal_pipe[2];
+};
+
+// signal handler can't get loop as argument, so write end of the self-pipe is global
+static int signal_fd = -1;
+static pid_t signal_fd_owner = -1;
+
+static void signal_handler(int signo) {
+	int saved_errno = errno;
+
+	// forked child can inherit handler without the loop
+	if (signal_fd >= 0 && getpid() == signal_fd_owner) {
+		uint8_t sym = (uint8_t)signo;
+		write(signal_fd, &sym, 1);
+	}
+
+	errno = saved_errno;
+}
+
+static uint64_t now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int set_nonblock(int fd) {
+	return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+struct event_loop_t *event_loop_create() {
+	struct event_loop_t *loop = (struct event_loop_t *)malloc(sizeof(*loop));
+	assert(loop);
+
+	memset(loop, 0, sizeof(*loop));
+	loop->signal_pipe[0] = loop->signal_pipe[1] = -1;
+	loop->poll_fd = -1;
+
+#ifdef USE_EPOLL
+	loop->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->poll_fd < 0) {
+		log_error("Can't create epoll: %s", strerror(errno));
+		free(loop);
+		return NULL;
+	}
+#endif
+
+	log_trace("Event loop created");
+	return loop;
+}
+
+void event_loop_destroy(struct event_loop_t *loop) {
+	if (!loop)
+		return;
+
+	int i = 0;
+	for (; i < EVENT_LOOP_MAX_SIGNALS; ++i) {
+		if (loop->signals[i].cb)
+			signal(i, SIG_DFL);
+	}
+
+	if (loop->signal_pipe[0] >= 0) {
+		signal_fd = -1;
+		close(loop->signal_pipe[0]);
+		close(loop->signal_pipe[1]);
+	}
+
+	// XXX: don't call EPOLL_CTL_DEL here: epoll set can be shared with parent process
+	if (loop->poll_fd >= 0)
+		close(loop->poll_fd);
+
+#ifndef USE_EPOLL
+	safe_free(loop->pollfds);
+#endif
+	safe_free(loop->handlers);
+	free(loop);
+}
+
+#ifdef USE_EPOLL
+static uint32_t to_epoll_events(uint32_t events) {
+	uint32_t ret = 0;
+	if (events & EV_READ)
+		ret |= EPOLLIN | EPOLLRDHUP;
+	if (events & EV_WRITE)
+		ret |= EPOLLOUT;
+	if (events & EV_EDGE)
+		ret |= EPOLLET;
+	return ret;
+}
+
+static uint32_t from_epoll_events(uint32_t events) {
+	uint32_t ret = 0;
+	if (events & (EPOLLIN | EPOLLRDHUP))
+		ret |= EV_READ;
+	if (events & EPOLLOUT)
+		ret |= EV_WRITE;
+	if (events & (EPOLLERR | EPOLLHUP))
+		ret |= EV_ERROR;
+	return ret;
+}
+
+static int epoll_ctl_impl(struct event_loop_t *loop, int op, int fd, uint32_t events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = to_epoll_events(events);
+	ev.data.fd = fd;
+
+	if (epoll_ctl(loop->poll_fd, op, fd, &ev) != 0) {
+		log_error("epoll_ctl(%d) failed on descriptor %d: %s", op, fd, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+int event_loop_add(struct event_loop_t *loop, int fd, uint32_t events, event_cb_t cb, void *arg) {
+	assert(loop && cb);
+
+	if (fd < 0) {
+		log_error("Invalid descriptor %d passed into event loop", fd);
+		return -1;
+	}
+
+	if (fd >= loop->n_handlers) {
+		int n_handlers = loop->n_handlers ? loop->n_handlers : 64;
+		while (n_handlers <= fd)
+			n_handlers *= 2;
+
+		struct event_handler_t *handlers = (struct event_handler_t *)realloc(loop->handlers, (size_t)n_handlers * sizeof(*handlers));
+		if (!handlers) {
+			log_error("Can't expand event handlers list up to %d", n_handlers);
+			return -1;
+		}
+
+		memset(handlers + loop->n_handlers, 0, (size_t)(n_handlers - loop->n_handlers) * sizeof(*handlers));
+		loop->handlers = handlers;
+		loop->n_handlers = n_handlers;
+	}
+
+	struct event_handler_t *handler = loop->handlers + fd;
+	if (handler->cb) {
+		log_error("Descriptor %d is already registered in event loop", fd);
+		return -1;
+	}
+
+#ifdef USE_EPOLL
+	if (epoll_ctl_impl(loop, EPOLL_CTL_ADD, fd, events) != 0)
+		return -1;
+#endif
+
+	handler->cb = cb;
+	handler->arg = arg;
+	handler->events = events;
+
+	log_trace("Descriptor %d added into event loop, events = 0x%x", fd, events);
+	return 0;
+}
+
+int event_loop_mod(struct event_loop_t *loop, int fd, uint32_t events) {
+	if (fd < 0 || fd >= loop->n_handlers || !loop->handlers[fd].cb) {
+		log_error("Descriptor %d is not registered in event loop", fd);
+		return -1;
+	}
+
+#ifdef USE_EPOLL
+	if (epoll_ctl_impl(loop, EPOLL_CTL_MOD, fd, events) != 0)
+		return -1;
+#endif
+
+	loop->handlers[fd].events = events;
+	return 0;
+}
+
+int event_loop_del(struct event_loop_t *loop, int fd) {
+	if (fd < 0 || fd >= loop->n_handlers || !loop->handlers[fd].cb) {
+		log_error("Descriptor %d is not registered in event loop", fd);
+		return -1;
+	}
+
+#ifdef USE_EPOLL
+	epoll_ctl_impl(loop, EPOLL_CTL_DEL, fd, 0);
+#endif
+
+	memset(loop->handlers + fd, 0, sizeof(*loop->handlers));
+	log_trace("Descriptor %d removed from event loop", fd);
+	return 0;
+}
+
+int event_loop_add_timer(struct event_loop_t *loop, unsigned interval_ms, timer_cb_t cb, void *arg) {
+	assert(loop && cb);
+
+	int i = 0;
+	for (; i < EVENT_LOOP_MAX_TIMERS; ++i) {
+		struct event_timer_t *timer = loop->timers + i;
+		if (!timer->cb) {
+			timer->cb = cb;
+			timer->arg = arg;
+			timer->interval_ms = interval_ms;
+			timer->deadline_ms = now_ms() + interval_ms;
+			return i;
+		}
+	}
+
+	log_error("Too many timers in event loop, maximum %d are expected", EVENT_LOOP_MAX_TIMERS);
+	return -1;
+}
+
+void event_loop_del_timer(struct event_loop_t *loop, int timer_id) {
+	assert(timer_id >= 0 && timer_id < EVENT_LOOP_MAX_TIMERS);
+	memset(loop->timers + timer_id, 0, sizeof(*loop->timers));
+}
+
+static void on_signal_pipe(struct event_loop_t *loop, int fd, uint32_t events, void *arg __attribute__((unused))) {
+	uint8_t signals[64];
+	ssize_t received = 0;
+
+	while ((received = read(fd, signals, sizeof(signals))) > 0) {
+		int i = 0;
+		for (; i < received; ++i) {
+			if (signals[i] >= EVENT_LOOP_MAX_SIGNALS)
+				continue;
+
+			struct event_signal_t *sig = loop->signals + signals[i];
+			if (sig->cb)
+				sig->cb(loop, signals[i], sig->arg);
+		}
+	}
+}
+
+int event_loop_add_signal(struct event_loop_t *loop, int signo, signal_cb_t cb, void *arg) {
+	assert(loop && cb);
+
+	if (signo <= 0 || signo >= EVENT_LOOP_MAX_SIGNALS) {
+		log_error("Signal %d can't be handled by event loop", signo);
+		return -1;
+	}
+
+	if (loop->signal_pipe[0] < 0) {
+		if (signal_fd >= 0 && signal_fd_owner == getpid()) {
+			log_error("Only one event loop per process can handle signals");
+			return -1;
+		}
+
+		if (pipe(loop->signal_pipe) != 0) {
+			log_error("Can't create signal pipe: %s", strerror(errno));
+			return -1;
+		}
+
+		if (set_nonblock(loop->signal_pipe[0]) != 0 || set_nonblock(loop->signal_pipe[1]) != 0
+			|| event_loop_add(loop, loop->signal_pipe[0], EV_READ, on_signal_pipe, NULL) != 0) {
+			log_error("Can't initialize signal pipe: %s", strerror(errno));
+			close(loop->signal_pipe[0]);
+			close(loop->signal_pipe[1]);
+			loop->signal_pipe[0] = loop->signal_pipe[1] = -1;
+			return -1;
+		}
+
+		signal_fd_owner = getpid();
+		signal_fd = loop->signal_pipe[1];
+	}
+
+	loop->signals[signo].cb = cb;
+	loop->signals[signo].arg = arg;
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &signal_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	if (sigaction(signo, &sa, NULL) != 0) {
+		log_error("Can't set sigaction: %s", strerror(errno));
+		memset(loop->signals + signo, 0, sizeof(*loop->signals));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int next_timeout(struct event_loop_t *loop) {
+	uint64_t now = now_ms();
+	int timeout = -1;
+
+	int i = 0;
+	for (; i < EVENT_LOOP_MAX_TIMERS; ++i) {
+		const struct event_timer_t *timer = loop->timers + i;
+		if (!timer->cb)
+			continue;
+
+		int left = timer->deadline_ms <= now ? 0 : (int)(timer->deadline_ms - now);
+		if (timeout < 0 || left < timeout)
+			timeout = left;
+	}
+
+	return timeout;
+}
+
+static int run_timers(struct event_loop_t *loop) {
+	uint64_t now = now_ms();
+	int fired = 0;
+
+	int i = 0;
+	for (; i < EVENT_LOOP_MAX_TIMERS; ++i) {
+		struct event_timer_t *timer = loop->timers + i;
+		if (timer->cb && timer->deadline_ms <= now) {
+			timer->deadline_ms = now + timer->interval_ms;
+			timer->cb(loop, timer->arg);
+			++fired;
+		}
+	}
+
+	return fired;
+}
+
+static int dispatch(struct event_loop_t *loop, int fd, uint32_t events) {
+	// descriptor could be removed by previous callback
+	if (fd >= loop->n_handlers || !loop->handlers[fd].cb)
+		return 0;
+
+	struct event_handler_t *handler = loop->handlers + fd;
+	handler->cb(loop, fd, events, handler->arg);
+	return 1;
+}
+
+#ifdef USE_EPOLL
+
+static int wait_and_dispatch(struct event_loop_t *loop, int timeout) {
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+	int n_events = epoll_wait(loop->poll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+	if (n_events < 0) {
+		if (errno == EINTR)
+			return 0;
+
+		log_error("epoll_wait failed: %s", strerror(errno));
+		return -1;
+	}
+
+	// all events of the iteration see the same time
+	coarse_clock_update();
+
+	int dispatched = 0;
+	int i = 0;
+	for (; i < n_events; ++i)
+		dispatched += dispatch(loop, events[i].data.fd, from_epoll_events(events[i].events));
+
+	return dispatched;
+}
+
+#else // USE_EPOLL
+
+static int wait_and_dispatch(struct event_loop_t *loop, int timeout) {
+	if (loop->n_pollfds < loop->n_handlers) {
+		struct pollfd *pollfds = (struct pollfd *)realloc(loop->pollfds, (size_t)loop->n_handlers * sizeof(*pollfds));
+		if (!pollfds) {
+			log_error("Can't expand poll list up to %d", loop->n_handlers);
+			return -1;
+		}
+
+		loop->pollfds = pollfds;
+		loop->n_pollfds = loop->n_handlers;
+	}
+
+	nfds_t n_fds = 0;
+	int i = 0;
+	for (; i < loop->n_handlers; ++i) {
+		const struct event_handler_t *handler = loop->handlers + i;
+		if (!handler->cb)
+			continue;
+
+		struct pollfd *pfd = loop->pollfds + n_fds++;
+		pfd->fd = i;
+		pfd->events = (short)(((handler->events & EV_READ) ? POLLIN : 0) | ((handler->events & EV_WRITE) ? POLLOUT : 0));
+		pfd->revents = 0;
+	}
+
+	int ret = poll(loop->pollfds, n_fds, timeout);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
+
+		log_error("poll failed: %s", strerror(errno));
+		return -1;
+	}
+
+	coarse_clock_update();
+
+	int dispatched = 0;
+	for (i = 0; ret > 0 && i < n_fds; ++i) {
+		const struct pollfd *pfd = loop->pollfds + i;
+		if (!pfd->revents)
+			continue;
+
+		uint32_t events = 0;
+		if (pfd->revents & POLLIN)
+			events |= EV_READ;
+		if (pfd->revents & POLLOUT)
+			events |= EV_WRITE;
+		if (pfd->revents & (POLLERR | POLLHUP | POLLNVAL))
+			events |= EV_ERROR;
+
+		--ret;
+		dispatched += dispatch(loop, pfd->fd, events);
+	}
+
+	return dispatched;
+}
+
+#endif // USE_EPOLL
+
+int event_loop_run_once(struct event_loop_t *loop) {
+	int dispatched = wait_and_dispatch(loop, next_timeout(loop));
+	if (dispatched < 0)
+		return -1;
+
+	return dispatched + run_timers(loop);
+}
@@ -0,0 +1,84 @@
+#include "fsm.h"
+#include "logger.h"
+
+#include "cycles.h"
+
+#include <string.h>
+
+static struct fsm_profile_t *profiles = NULL;
+
+void fsm_profile_register(struct fsm_profile_t *profile) {
+	profile->next = profiles;
+	profiles = profile;
+}
+
+void fsm_profile_reset() {
+	struct fsm_profile_t *profile = profiles;
+	for (; profile; profile = profile->next)
+		memset(profile->states, 0, profile->n_states * sizeof(*profile->states));
+}
+
+// will return upper bound of the bucket, where the given share of calls is
+static uint64_t percentile(const struct fsm_state_profile_t *st, double share) {
+	uint64_t need = (uint64_t)((double)st->calls * share);
+	uint64_t seen = 0;
+
+	unsigned i = 0;
+	for (; i < FSM_PROFILE_BUCKETS - 1; ++i) {
+		seen += st->hist[i];
+		if (seen > need)
+			break;
+	}
+
+	return (uint64_t)1 << i;
+}
+
+static void dump_profile(const struct fsm_profile_t *profile) {
+	uint64_t total = 0;
+	uint64_t calls = 0;
+
+	unsigned order[profile->n_states];
+	unsigned n = 0;
+
+	// states, which were called, by total time
+	unsigned i = 0;
+	for (; i < profile->n_states; ++i) {
+		const struct fsm_state_profile_t *st = profile->states + i;
+		if (!st->calls)
+			continue;
+
+		total += st->cycles;
+		calls += st->calls;
+
+		unsigned j = n++;
+		for (; j > 0 && profile->states[order[j - 1]].cycles < st->cycles; --j)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	if (!calls)
+		return;
+
+	log_info("FSM %s: %llu calls, %llu " CYCLES_UNITS " spent in callbacks", profile->name,
+			(unsigned long long)calls, (unsigned long long)total);
+
+	for (i = 0; i < n; ++i) {
+		const struct fsm_state_profile_t *st = profile->states + order[i];
+		log_info("FSM %s: %-20s %10llu calls %5.1f%% avg %llu p50 <%llu p99 <%llu " CYCLES_UNITS,
+				profile->name, profile->state_names[order[i]], (unsigned long long)st->calls,
+				total ? 100.0 * (double)st->cycles / (double)total : 0.0,
+				(unsigned long long)(st->cycles / st->calls),
+				(unsigned long long)percentile(st, 0.5), (unsigned long long)percentile(st, 0.99));
+	}
+}
+
+void fsm_profile_dump() {
+	if (!profiles) {
+		log_info("FSM profiling is disabled, build with -DFSM_PROFILE to enable it");
+		return;
+	}
+
+	const struct fsm_profile_t *profile = profiles;
+	for (; profile; profile = profile->next)
+		dump_profile(profile);
+}
@@ -0,0 +1,113 @@
+#include "headers.h"
+#include "scanner.h"
+#include "logger.h"
+
+// FNV-1a
+#define HASH_INIT 2166136261u
+#define HASH_PRIME 16777619u
+
+static inline uint32_t hash_byte(uint32_t hash, unsigned char c) {
+	if (c >= 'A' && c <= 'Z')
+		c |= 0x20;
+
+	return (hash ^ c) * HASH_PRIME;
+}
+
+static inline int is_wsp(char c) {
+	return c == ' ' || c == '\t';
+}
+
+// field name consists of printable US-ASCII characters except colon
+static inline int is_ftext(char c) {
+	return (unsigned char)c > ' ' && (unsigned char)c < 127 && c != ':';
+}
+
+static const char *trim_end(const char *begin, const char *end) {
+	while (end > begin && is_wsp(end[-1]))
+		--end;
+	return end;
+}
+
+uint32_t header_name_hash(const char *name, size_t len) {
+	uint32_t hash = HASH_INIT;
+
+	size_t i = 0;
+	for (; i < len; ++i)
+		hash = hash_byte(hash, (unsigned char)name[i]);
+
+	return hash;
+}
+
+size_t parse_headers(const char *data, size_t len, struct header_t *headers, size_t max_headers) {
+	const char *ptr = data;
+	const char *end = data + len;
+
+	size_t n_headers = 0;
+	struct header_t *cur = NULL; // header, which could be continued by folded line
+
+	while (ptr < end) {
+		const char *lf = scan_byte(ptr, (size_t)(end - ptr), '\n');
+		const char *next = lf ? lf + 1 : end;
+		const char *eol = lf ? lf : end;
+		if (eol > ptr && eol[-1] == '\r')
+			--eol;
+
+		if (eol == ptr)
+			break; // end of headers
+
+		if (is_wsp(*ptr)) {
+			const char *value_end = trim_end(ptr, eol);
+			if (cur && value_end > ptr) {
+				if (!cur->value_len) {
+					// value starts on the folded line
+					while (is_wsp(*ptr))
+						++ptr;
+					cur->value = ptr;
+				}
+
+				cur->value_len = (size_t)(value_end - cur->value);
+			}
+
+			ptr = next;
+			continue;
+		}
+
+		cur = NULL;
+
+		uint32_t hash = HASH_INIT;
+		const char *p = ptr;
+		for (; p < eol && is_ftext(*p); ++p)
+			hash = hash_byte(hash, (unsigned char)*p);
+
+		const char *name_end = p;
+
+		// XXX: obsolete syntax allows spaces before colon
+		while (p < eol && is_wsp(*p))
+			++p;
+
+		if (name_end == ptr || p == eol || *p != ':') {
+			log_trace("Line '%.*s' is not a header, skip it", (int)(eol - ptr), ptr);
+			ptr = next;
+			continue;
+		}
+
+		if (n_headers >= max_headers) {
+			log_warn("Too many headers in message, only %zu are parsed", max_headers);
+			break;
+		}
+
+		for (++p; p < eol && is_wsp(*p); ++p)
+			;
+
+		cur = headers + n_headers++;
+		cur->name = ptr;
+		cur->name_len = (size_t)(name_end - ptr);
+		cur->name_hash = hash;
+		cur->value = p;
+		cur->value_len = (size_t)(trim_end(p, eol) - p);
+
+		ptr = next;
+	}
+
+	return n_headers;
+}
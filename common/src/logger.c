@@ -2,137 +2,592 @@
 #include "stdio.h"
 #include "stdarg.h"
 #include "common.h"
+#include "coarse_clock.h"
 
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
-#include <sys/socket.h>
-#include <sys/select.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#	include <limits.h>
+#	include <linux/futex.h>
+#	include <sys/syscall.h>
+#endif
+
+#ifndef LOG_RECORD_MAX_SIZE
+// log line with arguments is truncated to this size
+#	define LOG_RECORD_MAX_SIZE 4096
+#endif
+
+#ifndef LOG_BATCH_DELAY_US
+// logger sleeps so long after it wrote something, lines are collected in rings meanwhile
+#	define LOG_BATCH_DELAY_US 1000
+#endif
 
 #ifndef LOG_FILE_FLUSH_TIME
-// in seconds
+// logger wakes up at least so often to report dropped lines, in seconds
 #	define LOG_FILE_FLUSH_TIME 1
 #endif
 
-#ifdef __MACH__ // fucking Machintosh
-#include <mach/clock.h>
-#include <mach/mach.h>
-
-void clock_gettime_impl(struct timespec *ts) {
-	clock_serv_t cclock;
-	mach_timespec_t mts;
-	host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock);
-	clock_get_time(cclock, &mts);
-	mach_port_deallocate(mach_task_self(), cclock);
-	ts->tv_sec = mts.tv_sec;
-	ts->tv_nsec = mts.tv_nsec;
+#ifndef LOG_RING_SIZE
+// per process, should be power of two
+#	define LOG_RING_SIZE (256 * 1024)
+#endif
+
+#ifndef LOG_RING_WAIT_MS
+// writer waits for the logger so long when its ring is full, line is dropped after that
+#	define LOG_RING_WAIT_MS 1000
+#endif
+
+#ifdef __linux__
+
+static void futex_wait(volatile uint32_t *addr, uint32_t val, int timeout_ms) {
+	struct timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000L,
+	};
+
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(volatile uint32_t *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
 }
 
 #else
 
-void clock_gettime_impl(struct timespec *ts) {
-	clock_gettime(CLOCK_REALTIME, ts);
+// XXX: there is no futex here, waiter just polls
+static void futex_wait(volatile uint32_t *addr, uint32_t val, int timeout_ms) {
+	if (*addr == val)
+		usleep(1000);
+}
+
+static void futex_wake(volatile uint32_t *addr) {
 }
 
 #endif
 
 static int current_log_level = -1;
-struct logger_connection_t {
-	pid_t pid;
 
-	char buf[4096]; // max log message len is 4kb
-	size_t offset;
+// Each process writes complete lines into its own ring, logger process reads them.
+// Positions are never wrapped, offset in data is position % LOG_RING_SIZE
+struct log_ring_t {
+	volatile uint64_t head; // written by process
+	char pad[64 - sizeof(uint64_t)]; // head and tail are changed by different processes
+
+	volatile uint64_t tail; // written by logger
+	volatile uint32_t drained; // futex, it is changed when logger frees space for waiting process
+	volatile uint32_t waiting; // process waits for free space
+	volatile uint32_t dropped; // number of lines dropped because logger was too slow
+
+	char data[LOG_RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct log_shared_t {
+	volatile uint32_t doorbell; // futex, it is changed to wake logger up
+	volatile uint32_t sleeping; // logger waits for doorbell
 
-	int logger_sock;
-	int remote_sock;
+	struct log_ring_t rings[] __attribute__((aligned(64)));
 };
 
 struct logger_status_t {
-	size_t sockets_count;
-	struct logger_connection_t *conns;
+	struct log_shared_t *shared;
+	size_t shared_size;
+	size_t n_rings;
 	FILE *log_f;
 
-	struct logger_connection_t *cur_conn;
+	struct log_ring_t *cur_ring;
+	uint32_t stalled_at; // ring was full and logger didn't drain it since this value of drained
+	uint8_t stalled;
 
-	char whoami[16];
+	char whoami_prefix;
+	pid_t pid;
 };
 
 static struct logger_status_t logger_status;
 
-static void write_to_log_impl(FILE *f, const char *msg, int size) {
-	fprintf(f, "%.*s", size, msg);
-}
-
 static void set_whoami(char prefix) {
-	snprintf(logger_status.whoami, sizeof(logger_status.whoami), "%c-%d", prefix, getpid());
+	logger_status.whoami_prefix = prefix;
+	logger_status.pid = getpid();
 }
 
-static void write_to_log(const struct logger_connection_t *conn, const char *msg, size_t size) {
-	if (logger_status.whoami[0] == '\0')
-		set_whoami('I');
+static void ring_doorbell(int force) {
+	struct log_shared_t *shared = logger_status.shared;
 
-	char *whoami = logger_status.whoami;
-	FILE *f = logger_status.log_f;
+	// logger checks rings after it set sleeping flag: one of us will see the line
+	__sync_synchronize();
+	if (!force && !shared->sleeping)
+		return;
 
-	if (!f)
-		f = stderr;
+	__sync_add_and_fetch(&shared->doorbell, 1);
+	futex_wake(&shared->doorbell);
+}
 
-	struct timespec time;
-	clock_gettime_impl(&time);
+static size_t ring_free_space(const struct log_ring_t *ring) {
+	return LOG_RING_SIZE - (size_t)(ring->head - ring->tail);
+}
 
-	char time_str[32];
-	struct tm tm;
-	localtime_r(&time.tv_sec, &tm);
+// Will return 0 when there is enough space in the ring and -1 if logger doesn't read it
+static int ring_wait(struct log_ring_t *ring, size_t size) {
+	int waited = 0;
+	while (ring_free_space(ring) < size) {
+		uint32_t drained = ring->drained;
 
-	size_t ret = strftime(time_str, sizeof(time_str), "%d.%m.%Y %H:%M:%S", &tm);
-	snprintf(time_str + ret, sizeof(time_str) - ret, ".%.06ld", time.tv_nsec / 1000);
+		// don't wait for the dead logger on each line
+		if (logger_status.stalled && drained == logger_status.stalled_at)
+			return -1;
+
+		if (waited >= LOG_RING_WAIT_MS) {
+			logger_status.stalled = 1;
+			logger_status.stalled_at = drained;
+			return -1;
+		}
+
+		ring->waiting = 1;
+		ring_doorbell(1);
 
-	const size_t whoami_size = 9; // 5 chars for pid, 2 chars for spaces and some extra space
-	size_t left = whoami_size - strlen(whoami);
-	size_t right = left - left / 2;
-	left -= right;
+		if (ring_free_space(ring) < size)
+			futex_wait(&ring->drained, drained, 10);
+		waited += 10;
+	}
 
-	char spaces[10];
-	memset(spaces, ' ', sizeof(spaces));
+	logger_status.stalled = 0;
+	return 0;
+}
 
-	char str[8192];
-	int printed = snprintf(str, sizeof(str), "%s [%.*s%s%.*s] %.*s\n", time_str, (int)left, spaces, whoami, (int)right, spaces, (int)size, msg);
-	if (printed < 0) {
-		log_error("Can't snprintf");
+static void ring_write(struct log_ring_t *ring, const char *msg, size_t size) {
+	if (ring_wait(ring, size) != 0) {
+		__sync_add_and_fetch(&ring->dropped, 1);
 		return;
 	}
 
-	if (conn)
-		write(conn->logger_sock, str, (size_t)printed);
-	else
-		write_to_log_impl(f, str, printed); // logger process
+	uint64_t head = ring->head;
+	size_t offset = (size_t)(head % LOG_RING_SIZE);
+	size_t first = size < LOG_RING_SIZE - offset ? size : LOG_RING_SIZE - offset;
+
+	memcpy(ring->data + offset, msg, first);
+	memcpy(ring->data, msg + first, size - first);
+
+	// line should be in the ring before logger sees new head
+	__sync_synchronize();
+	ring->head = head + size;
+
+	ring_doorbell(0);
+}
+
+// prints decimal number into the tail of buf. Will return number of chars printed
+static size_t print_uint(char *buf, unsigned long long v, size_t min_digits) {
+	char digits[24];
+	size_t n = 0;
+	do {
+		digits[n++] = (char)('0' + v % 10);
+		v /= 10;
+	} while (v || n < min_digits);
+
+	size_t i = 0;
+	for (; i < n; ++i)
+		buf[i] = digits[n - i - 1];
+
+	return n;
+}
+
+static void write_to_log(FILE *f, char whoami_prefix, pid_t pid, const struct timespec *time, const char *msg, size_t size) {
+	size_t date_len = 0;
+	const char *date = coarse_clock_log_date(time->tv_sec, &date_len);
+
+	// records of a process come together, so its name is formatted once per batch
+	static char last_prefix = 0;
+	static pid_t last_pid = 0;
+	static char whoami[24];
+	static size_t whoami_len = 0;
+	if (whoami_prefix != last_prefix || pid != last_pid) {
+		char name[16];
+		int name_len = snprintf(name, sizeof(name), "%c-%d", whoami_prefix, pid);
+
+		const int whoami_size = 9; // 5 chars for pid, 2 chars for spaces and some extra space
+		int left = name_len < whoami_size ? whoami_size - name_len : 0;
+		int right = left - left / 2;
+		left -= right;
+
+		last_prefix = whoami_prefix;
+		last_pid = pid;
+		whoami_len = (size_t)snprintf(whoami, sizeof(whoami), "[%*s%s%*s]", left, "", name, right, "");
+	}
+
+	char line[LOG_RECORD_MAX_SIZE + 64];
+	if (size > LOG_RECORD_MAX_SIZE)
+		size = LOG_RECORD_MAX_SIZE;
+
+	size_t len = date_len;
+	memcpy(line, date, date_len);
+	line[len++] = '.';
+	len += print_uint(line + len, (unsigned long long)time->tv_nsec / 1000, 6);
+	line[len++] = ' ';
+	memcpy(line + len, whoami, whoami_len);
+	len += whoami_len;
+	line[len++] = ' ';
+	memcpy(line + len, msg, size);
+	len += size;
+	line[len++] = '\n';
+
+	fwrite(line, 1, len, f);
 }
 
-static void receive_msg(struct logger_connection_t *conn) {
-	if (sizeof(conn->buf) <= conn->offset) {
-		log_error("Too large amout of log data came. Flush log");
-		write_to_log(conn, conn->buf, sizeof(conn->buf));
-		conn->offset = 0;
+/*
+ * Processes don't format log lines, they put binary records into the rings:
+ *	struct log_record_t, arguments in order of format string
+ * Integers are stored as 8 bytes, floating point numbers as double or long double, strings with trailing zero.
+ * Line is formatted by the logger. Format string is passed by pointer: all processes are forked from master
+ * without exec, so string literals have the same addresses everywhere.
+ */
+
+struct log_record_t {
+	uint16_t size; // with arguments
+	char whoami_prefix;
+	pid_t pid;
+	struct timespec time;
+	const char *fmt;
+};
+
+// conversion specification of printf
+struct log_spec_t {
+	const char *start; // '%'
+	size_t len;
+	int n_stars; // width and precision passed as arguments
+	int precision; // -1 if it is not set
+	uint8_t precision_star; // precision is the last of star arguments
+	uint8_t plain; // there are no flags, width and precision
+	char length; // 'H' for hh, 'q' for ll, length modifier otherwise
+	char conv;
+};
+
+// will return pointer after the spec
+static const char *parse_spec(const char *ptr, struct log_spec_t *spec) {
+	spec->start = ptr++;
+	spec->n_stars = 0;
+	spec->precision_star = 0;
+	spec->length = 0;
+
+	while (*ptr && strchr("-+ #0", *ptr))
+		++ptr;
+
+	spec->plain = ptr == spec->start + 1;
+	spec->precision = -1;
+	for (; *ptr == '*' || (*ptr >= '0' && *ptr <= '9'); ++ptr) {
+		spec->n_stars += *ptr == '*';
+		spec->plain = 0;
 	}
 
-	ssize_t received = read(conn->remote_sock, conn->buf + conn->offset, sizeof(conn->buf) - conn->offset);
-	if (received <= 0) {
-		log_warn("Read() failed: %s", strerror(errno));
-		return;
+	if (*ptr == '.') {
+		spec->plain = 0;
+		++ptr;
+		if (*ptr == '*') {
+			++spec->n_stars;
+			spec->precision_star = 1;
+			++ptr;
+		} else {
+			spec->precision = 0;
+			for (; *ptr >= '0' && *ptr <= '9'; ++ptr)
+				spec->precision = spec->precision * 10 + (*ptr - '0');
+		}
 	}
 
-	conn->offset += (size_t)received;
+	if (*ptr == 'h' || *ptr == 'l') {
+		spec->length = *ptr++;
+		if (*ptr == spec->length) {
+			spec->length = spec->length == 'h' ? 'H' : 'q';
+			++ptr;
+		}
+	} else if (*ptr && strchr("zjtL", *ptr))
+		spec->length = *ptr++;
 
-	while (1) {
-		char *delim = strnstr(conn->buf, "\n", conn->offset);
-		if (delim) {
-			write_to_log_impl(logger_status.log_f, conn->buf, (int)(delim - conn->buf + 1));
-			conn->offset -= (size_t)(delim - conn->buf + 1);
-			memmove(conn->buf, delim + 1, conn->offset);
-		} else
+	spec->conv = *ptr;
+	if (*ptr)
+		++ptr;
+
+	spec->len = (size_t)(ptr - spec->start);
+	return ptr;
+}
+
+#define PACK(type, value) do { \
+		type __v = (value); \
+		if (size - used < sizeof(__v)) \
+			return used; \
+		memcpy(buf + used, &__v, sizeof(__v)); \
+		used += sizeof(__v); \
+	} while (0)
+
+// Will return number of bytes used. Arguments, which don't fit, are dropped
+static size_t pack_args(char *buf, size_t size, const char *fmt, va_list ap) {
+	size_t used = 0;
+	const char *ptr = fmt;
+
+	while ((ptr = strchr(ptr, '%'))) {
+		struct log_spec_t spec;
+		ptr = parse_spec(ptr, &spec);
+
+		int i = 0;
+		for (; i < spec.n_stars; ++i)
+			PACK(int, va_arg(ap, int));
+
+		switch (spec.conv) {
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+			switch (spec.length) {
+			case 'l': PACK(long long, va_arg(ap, long)); break;
+			case 'q': PACK(long long, va_arg(ap, long long)); break;
+			case 'z': PACK(long long, (long long)va_arg(ap, size_t)); break;
+			case 'j': PACK(long long, va_arg(ap, intmax_t)); break;
+			case 't': PACK(long long, va_arg(ap, ptrdiff_t)); break;
+			default: PACK(long long, va_arg(ap, int)); break;
+			}
 			break;
+
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			if (spec.length == 'L')
+				PACK(long double, va_arg(ap, long double));
+			else
+				PACK(double, va_arg(ap, double));
+			break;
+
+		case 'p':
+			PACK(void *, va_arg(ap, void *));
+			break;
+
+		case 's': {
+			const char *str = va_arg(ap, const char *);
+			if (!str)
+				str = "(null)";
+
+			// precision limits the string, it could be not terminated
+			int precision = spec.precision;
+			if (spec.precision_star)
+				memcpy(&precision, buf + used - sizeof(precision), sizeof(precision));
+
+			size_t len = size - used ? size - used - 1 : 0;
+			if (precision >= 0 && (size_t)precision < len)
+				len = (size_t)precision;
+
+			len = strnlen(str, len);
+			if (size - used < len + 1)
+				return used;
+
+			memcpy(buf + used, str, len);
+			buf[used + len] = '\0';
+			used += len + 1;
+			break;
+		}
+
+		default:
+			break; // "%%" or unsupported conversion
+		}
 	}
+
+	return used;
+}
+
+#undef PACK
+
+#define UNPACK(var) do { \
+		if (args_end - args < (ptrdiff_t)sizeof(var)) \
+			goto truncated; \
+		memcpy(&var, args, sizeof(var)); \
+		args += sizeof(var); \
+	} while (0)
+
+#define FORMAT(value) \
+	(n_stars == 0 ? snprintf(out, out_size, spec_str, value) \
+		: n_stars == 1 ? snprintf(out, out_size, spec_str, stars[0], value) \
+		: snprintf(out, out_size, spec_str, stars[0], stars[1], value))
+
+// Will return length of the message
+static size_t format_record(const struct log_record_t *rec, char *msg, size_t msg_size) {
+	const char *args = (const char *)(rec + 1);
+	const char *args_end = (const char *)rec + rec->size;
+	const char *ptr = rec->fmt;
+	size_t used = 0;
+
+	while (*ptr && used + 1 < msg_size) {
+		const char *next = strchr(ptr, '%');
+		if (!next)
+			next = ptr + strlen(ptr);
+
+		size_t len = (size_t)(next - ptr);
+		if (len > msg_size - used - 1)
+			len = msg_size - used - 1;
+		memcpy(msg + used, ptr, len);
+		used += len;
+
+		if (!*next)
+			break;
+
+		struct log_spec_t spec;
+		ptr = parse_spec(next, &spec);
+
+		char spec_str[32];
+		if (spec.len >= sizeof(spec_str) || spec.n_stars > 2)
+			continue;
+		memcpy(spec_str, spec.start, spec.len);
+		spec_str[spec.len] = '\0';
+
+		int stars[2] = { 0, 0 };
+		int n_stars = spec.n_stars;
+		int i = 0;
+		for (; i < n_stars; ++i)
+			UNPACK(stars[i]);
+
+		char *out = msg + used;
+		size_t out_size = msg_size - used;
+		int printed = 0;
+
+		switch (spec.conv) {
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c': {
+			long long v = 0;
+			UNPACK(v);
+
+			// most of arguments are plain numbers: snprintf is too slow for them
+			if (spec.plain && out_size > 24 && (spec.conv == 'd' || spec.conv == 'i' || spec.conv == 'u')) {
+				unsigned long long u = (unsigned long long)v;
+				if (spec.conv == 'u' && (!spec.length || spec.length == 'h' || spec.length == 'H'))
+					u = (unsigned)v;
+				else if (spec.conv != 'u' && v < 0) {
+					*out++ = '-';
+					u = 0ull - u;
+					++printed;
+				}
+
+				printed += (int)print_uint(out, u, 1);
+				break;
+			}
+
+			if (spec.plain && spec.conv == 'c' && out_size > 1) {
+				*out = (char)v;
+				printed = 1;
+				break;
+			}
+
+			switch (spec.length) {
+			case 'l': printed = FORMAT((long)v); break;
+			case 'q': printed = FORMAT(v); break;
+			case 'z': printed = FORMAT((size_t)v); break;
+			case 'j': printed = FORMAT((intmax_t)v); break;
+			case 't': printed = FORMAT((ptrdiff_t)v); break;
+			default: printed = FORMAT((int)v); break;
+			}
+			break;
+		}
+
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			if (spec.length == 'L') {
+				long double v = 0;
+				UNPACK(v);
+				printed = FORMAT(v);
+			} else {
+				double v = 0;
+				UNPACK(v);
+				printed = FORMAT(v);
+			}
+			break;
+
+		case 'p': {
+			void *v = NULL;
+			UNPACK(v);
+			printed = FORMAT(v);
+			break;
+		}
+
+		case 's': {
+			size_t len = strnlen(args, (size_t)(args_end - args));
+			if (args + len == args_end)
+				goto truncated;
+
+			if (spec.plain) {
+				printed = (int)(len < out_size ? len : out_size - 1);
+				memcpy(out, args, (size_t)printed);
+			} else
+				printed = FORMAT(args);
+			args += len + 1;
+			break;
+		}
+
+		case '%':
+			printed = snprintf(out, out_size, "%%");
+			break;
+
+		default:
+			printed = snprintf(out, out_size, "%s", spec_str);
+			break;
+		}
+
+		if (printed > 0)
+			used += (size_t)printed < out_size ? (size_t)printed : out_size - 1;
+	}
+
+	return used;
+
+truncated:
+	used += (size_t)snprintf(msg + used, msg_size - used, "...");
+	return used < msg_size ? used : msg_size - 1;
+}
+
+#undef FORMAT
+#undef UNPACK
+
+// copies bytes from the ring position into buf
+static void ring_read(const struct log_ring_t *ring, uint64_t pos, void *buf, size_t size) {
+	size_t offset = (size_t)(pos % LOG_RING_SIZE);
+	size_t first = size < LOG_RING_SIZE - offset ? size : LOG_RING_SIZE - offset;
+
+	memcpy(buf, ring->data + offset, first);
+	memcpy((char *)buf + first, ring->data, size - first);
+}
+
+// all records written by process are formatted at once. Will return number of bytes read from the ring
+static size_t drain_ring(struct log_ring_t *ring, FILE *f) {
+	uint64_t head = ring->head;
+	uint64_t tail = ring->tail;
+	if (head == tail)
+		return 0;
+
+	// don't read the record before it was written
+	__sync_synchronize();
+
+	union {
+		struct log_record_t rec;
+		char buf[LOG_RECORD_MAX_SIZE];
+	} data;
+
+	char msg[LOG_RECORD_MAX_SIZE];
+
+	uint64_t pos = tail;
+	while (pos < head) {
+		uint16_t size = 0;
+		ring_read(ring, pos, &size, sizeof(size));
+		if (size < sizeof(data.rec) || size > sizeof(data.buf) || size > head - pos) {
+			fprintf(f, "Broken log record found, %llu bytes are skipped\n", (unsigned long long)(head - pos));
+			break;
+		}
+
+		ring_read(ring, pos, data.buf, size);
+		pos += size;
+
+		size_t len = format_record(&data.rec, msg, sizeof(msg));
+		write_to_log(f, data.rec.whoami_prefix, data.rec.pid, &data.rec.time, msg, len);
+	}
+
+	// process may overwrite data now
+	__sync_synchronize();
+	ring->tail = head;
+
+	if (ring->waiting) {
+		ring->waiting = 0;
+		__sync_add_and_fetch(&ring->drained, 1);
+		futex_wake(&ring->drained);
+	}
+
+	return (size_t)(head - tail);
 }
 
 int set_log_level(int lvl) {
@@ -151,17 +606,36 @@ void log_impl(int lvl, const char *fmt, ...) {
 	if (current_log_level < lvl)
 		return;
 
-	char str[4096] = "";
+	if (!logger_status.whoami_prefix)
+		set_whoami('I');
+
+	union {
+		struct log_record_t rec;
+		char buf[LOG_RECORD_MAX_SIZE];
+	} data;
+
+	struct log_record_t *rec = &data.rec;
+	clock_gettime_impl(&rec->time);
+	rec->whoami_prefix = logger_status.whoami_prefix;
+	rec->pid = logger_status.pid;
+	rec->fmt = fmt;
 
 	va_list ap;
 	va_start(ap, fmt);
-	int printed = vsnprintf(str, sizeof(str), fmt, ap);
+	size_t size = sizeof(*rec) + pack_args(data.buf + sizeof(*rec), sizeof(data.buf) - sizeof(*rec), fmt, ap);
 	va_end(ap);
 
-	if (printed < 0)
-		log_error("vsnprintf failed");
-	else
-		write_to_log(logger_status.cur_conn, str, (unsigned)printed);
+	rec->size = (uint16_t)size;
+
+	if (logger_status.cur_ring) {
+		ring_write(logger_status.cur_ring, data.buf, size);
+		return;
+	}
+
+	// logger process itself and processes started before logger
+	char msg[LOG_RECORD_MAX_SIZE];
+	size_t len = format_record(rec, msg, sizeof(msg));
+	write_to_log(logger_status.log_f ? logger_status.log_f : stderr, rec->whoami_prefix, rec->pid, &rec->time, msg, len);
 }
 
 static __attribute__((destructor))
@@ -170,122 +644,100 @@ void ___destruct() {
 }
 
 void deinitialize_logger() {
-	if (logger_status.conns) {
-		int i = 0;
-		for (; i < logger_status.sockets_count; ++i) {
-			struct logger_connection_t *conn = logger_status.conns + i;
-
-			if (conn->logger_sock)
-				close(conn->logger_sock);
-			if (conn->remote_sock)
-				close(conn->remote_sock);
-		}
-
-		fclose(logger_status.log_f);
+	if (logger_status.shared) {
+		if (logger_status.log_f && logger_status.log_f != stderr)
+			fclose(logger_status.log_f);
 
-		free(logger_status.conns);
+		munmap(logger_status.shared, logger_status.shared_size);
 		memset(&logger_status, 0, sizeof(logger_status));
 	}
 }
 
-int init_pipes(int n_processes) {
+static int init_rings(int n_processes) {
 	if (n_processes <= 0) {
 		log_error("Invalid number of processes");
 		return -1;
 	}
 
 	deinitialize_logger();
-	logger_status.sockets_count = (unsigned)n_processes + 1; // +1 for a master process
 
-	size_t n_bytes = sizeof(struct logger_connection_t) * logger_status.sockets_count;
-	logger_status.conns = (struct logger_connection_t *)malloc(n_bytes);
-	assert(logger_status.conns);
+	size_t n_rings = (unsigned)n_processes + 1; // +1 for a master process
+	size_t size = sizeof(struct log_shared_t) + n_rings * sizeof(struct log_ring_t);
 
-	memset(logger_status.conns, 0, n_bytes);
+	log_trace("Trying to init log rings");
 
-	log_trace("Trying to init pipes");
-
-	int i = 0;
-	for (; i < logger_status.sockets_count; ++i) {
-		// with master process
-		int sockets[2] = { 0, 0 };
-		if (pipe(sockets) < 0) {
-			log_error("Can't init pipe: %s", strerror(errno));
-			return -1;
-		}
-
-		struct logger_connection_t *conn = logger_status.conns + i;
-		conn->remote_sock = sockets[0];
-		conn->logger_sock = sockets[1];
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		log_error("Can't allocate shared memory for logger: %s", strerror(errno));
+		return -1;
 	}
 
-	log_trace("Socket pairs inited successfully");
+	// anonymous mapping is zeroed
+	logger_status.shared = (struct log_shared_t *)mem;
+	logger_status.shared_size = size;
+	logger_status.n_rings = n_rings;
 
-	return 0;
-}
+	log_trace("Log rings inited successfully");
 
-static void close_logger_socks() {
-	int i = 0;
-	log_trace("Closing logger sockets");
-	for (; i < logger_status.sockets_count; ++i) {
-		close(logger_status.conns[i].logger_sock);
-		logger_status.conns[i].logger_sock = -1;
-	}
-	log_trace("Closing done");
+	return 0;
 }
 
-static void close_remote_socks() {
-	int i = 0;
-	log_trace("Closing remote sockets");
-	for (; i < logger_status.sockets_count; ++i) {
-		close(logger_status.conns[i].remote_sock);
-		logger_status.conns[i].remote_sock = -1;
+static void report_dropped(uint32_t *reported) {
+	size_t i = 0;
+	for (; i < logger_status.n_rings; ++i) {
+		uint32_t dropped = logger_status.shared->rings[i].dropped;
+		if (dropped != reported[i]) {
+			log_warn("%u log lines of process #%zu were dropped", dropped - reported[i], i);
+			reported[i] = dropped;
+		}
 	}
-	log_trace("Closing done");
 }
 
 static void run_logger_loop() {
-	fd_set active;
-	struct timeval timeout = {
-		.tv_sec = LOG_FILE_FLUSH_TIME,
-		.tv_usec = 0,
-	};
+	struct log_shared_t *shared = logger_status.shared;
+	FILE *f = logger_status.log_f;
 
-	struct timeval *timeout_ptr = NULL;
-	if (logger_status.log_f != stderr)
-		timeout_ptr = &timeout;
+	uint32_t *reported = (uint32_t *)calloc(logger_status.n_rings, sizeof(*reported));
+	assert(reported);
 
 	while (1) {
-		FD_ZERO(&active);
-
-		int i = 0;
-		for (; i < logger_status.sockets_count; ++i) {
-			FD_SET(logger_status.conns[i].remote_sock, &active);
-		}
-
-		int res = select(FD_SETSIZE, &active, NULL, NULL, timeout_ptr);
-		if (res < 0) {
-			log_info("Select failed: %s", strerror(errno));
+		size_t drained = 0;
+		size_t i = 0;
+		for (; i < logger_status.n_rings; ++i)
+			drained += drain_ring(shared->rings + i, f);
+
+		// let processes fill the rings: they don't ring the doorbell while logger is awake
+		if (drained) {
+			usleep(LOG_BATCH_DELAY_US);
 			continue;
-		} else if (res == 0 && timeout_ptr) {
-			// timeout
-			timeout.tv_sec = LOG_FILE_FLUSH_TIME;
-			fflush(logger_status.log_f);
 		}
 
-		for (i = 0; i < logger_status.sockets_count; ++i) {
-			struct logger_connection_t *conn = logger_status.conns + i;
-			if (FD_ISSET(conn->remote_sock, &active)) {
-				receive_msg(conn);
-			}
+		report_dropped(reported);
+
+		// processes ring the doorbell only when logger sleeps
+		shared->sleeping = 1;
+		__sync_synchronize();
+		uint32_t doorbell = shared->doorbell;
+
+		for (i = 0; i < logger_status.n_rings; ++i)
+			if (shared->rings[i].head != shared->rings[i].tail)
+				break;
+
+		// nothing to write: good time to flush the file
+		if (i == logger_status.n_rings) {
+			fflush(f);
+			futex_wait(&shared->doorbell, doorbell, LOG_FILE_FLUSH_TIME * 1000);
 		}
+
+		shared->sleeping = 0;
 	}
 }
 
 static void connect_to_logger(int index) {
-	assert(index < logger_status.sockets_count);
+	assert(index < logger_status.n_rings);
 
-	logger_status.cur_conn = logger_status.conns + index;
+	logger_status.cur_ring = logger_status.shared->rings + index;
+	logger_status.stalled = 0;
 }
 
 static pid_t __logger_pid = -1;
@@ -297,7 +749,7 @@ pid_t logger_pid() {
 int init_logger(int n_processes, const char *log_file, const char *user, const char *group) {
 	log_trace("Trying to init logger for a process");
 
-	if (init_pipes(n_processes) < 0)
+	if (init_rings(n_processes) < 0)
 		return -1;
 
 	FILE *f = NULL;
@@ -322,7 +774,6 @@ int init_logger(int n_processes, const char *log_file, const char *user, const c
 		logger_status.log_f = f;
 		set_whoami('L');
 
-		close_logger_socks();
 		drop_privileges(user, group, NULL);
 
 		run_logger_loop();
@@ -336,28 +787,17 @@ int init_logger(int n_processes, const char *log_file, const char *user, const c
 	// master process
 	if (log_file)
 		fclose(f);
-	close_remote_socks();
 
 	return 0;
 }
 
-int logger_sock() {
-	return logger_status.cur_conn->logger_sock;
-}
-
 int reinit_logger(int index) {
-	// Child process should write logs into another socket
+	// Child process should write logs into another ring
 	// XXX: this function should be called by child
 
-	assert(index < logger_status.sockets_count);
+	assert(index < logger_status.n_rings);
 	connect_to_logger(index);
 	set_whoami('W');
 
-	int i = 0;
-	for (; i < logger_status.sockets_count; ++i) {
-		if (i != index)
-			close(logger_status.conns[i].logger_sock);
-	}
-
 	return 0;
 }
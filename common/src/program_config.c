@@ -113,6 +113,17 @@ int __read_config(struct option_t *options, unsigned opts_count, const char *pat
 		assert(opt->opt_type < CONFIG_OPT_TYPE_MAX_OPT_INDEX && opt->opt_type > CONFIG_OPT_TYPE_MIN_OPT_INDEX);
 
 		log_trace("Reading config option %s...", opt->opt_name);
+		if (opt->optional && !config_lookup(&config, opt->opt_name)) {
+			// XXX: strings are freed by deinitialize_config()
+			if (opt->opt_type == MK_OPT_TYPE(STR) && !(opt->s_val = strdup(opt->s_val))) {
+				log_error("Can't allocate default value of option %s", opt->opt_name);
+				return -1;
+			}
+
+			log_info("Config option %s is not found, default value is used", opt->opt_name);
+			continue;
+		}
+
 		if (options_parsers[opt->opt_type](&config, opt) != 0) {
 			log_error("Can't parse config %s", path);
 			return -1;
@@ -0,0 +1,136 @@
+#include "rcpt_db.h"
+#include "logger.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+uint32_t rcpt_db_hash(const char *key, size_t len) {
+	uint32_t hash = 2166136261u;
+
+	size_t i = 0;
+	for (; i < len; ++i)
+		hash = (hash ^ (unsigned char)tolower((unsigned char)key[i])) * 16777619u;
+
+	return hash;
+}
+
+static int check_header(const char *data, size_t size, const char *path) {
+	const struct rcpt_db_header_t *hdr = (const struct rcpt_db_header_t *)data;
+
+	if (size < sizeof(*hdr) || hdr->magic != RCPT_DB_MAGIC || hdr->version != RCPT_DB_VERSION) {
+		log_error("%s is not a recipients database", path);
+		return -1;
+	}
+
+	if (hdr->size != size || !hdr->n_slots || (hdr->n_slots & (hdr->n_slots - 1))
+			|| (size - sizeof(*hdr)) / sizeof(struct rcpt_db_slot_t) < hdr->n_slots) {
+		log_error("Recipients database %s is corrupted", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int rcpt_db_open(struct rcpt_db_t *db, const char *path) {
+	memset(db, 0, sizeof(*db));
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		log_error("Can't open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		log_error("Can't stat %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	size_t size = (size_t)st.st_size;
+	void *data = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+
+	if (data == MAP_FAILED) {
+		log_error("Can't map %s: %s", path, size ? strerror(errno) : "file is empty");
+		return -1;
+	}
+
+	if (check_header((const char *)data, size, path) != 0) {
+		munmap(data, size);
+		return -1;
+	}
+
+	const struct rcpt_db_header_t *hdr = (const struct rcpt_db_header_t *)data;
+
+	db->data = (const char *)data;
+	db->size = size;
+	db->slots = (const struct rcpt_db_slot_t *)(hdr + 1);
+	db->mask = hdr->n_slots - 1;
+	db->dev = st.st_dev;
+	db->ino = st.st_ino;
+	db->mtime = st.st_mtime;
+
+	log_info("Recipients database %s was loaded: %u records", path, hdr->n_records);
+
+	return 0;
+}
+
+void rcpt_db_close(struct rcpt_db_t *db) {
+	if (db->data)
+		munmap((void *)db->data, db->size);
+
+	memset(db, 0, sizeof(*db));
+}
+
+int rcpt_db_reload(struct rcpt_db_t *db, const char *path) {
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		log_error("Can't stat %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	// new database is moved over the old one, so inode is changed
+	if (db->data && st.st_dev == db->dev && st.st_ino == db->ino && st.st_mtime == db->mtime)
+		return 0;
+
+	struct rcpt_db_t new_db;
+	if (rcpt_db_open(&new_db, path) != 0)
+		return -1;
+
+	rcpt_db_close(db);
+	*db = new_db;
+
+	return 0;
+}
+
+int rcpt_db_lookup(const struct rcpt_db_t *db, const char *key, size_t len) {
+	if (!db->data)
+		return 0;
+
+	uint32_t hash = rcpt_db_hash(key, len);
+	uint32_t slot = hash & db->mask;
+
+	// table built by mkrcptdb is never full, limit is for broken files
+	uint32_t i = 0;
+	for (; i <= db->mask && db->slots[slot].offset; ++i) {
+		const struct rcpt_db_slot_t *cur = db->slots + slot;
+		slot = (slot + 1) & db->mask;
+
+		if (cur->hash != hash || cur->offset > db->size - sizeof(struct rcpt_db_record_t))
+			continue;
+
+		const struct rcpt_db_record_t *rec = (const struct rcpt_db_record_t *)(db->data + cur->offset);
+		if (rec->len == len && len <= db->size - cur->offset - sizeof(*rec)
+				&& strncasecmp((const char *)(rec + 1), key, len) == 0)
+			return rec->flags;
+	}
+
+	return 0;
+}
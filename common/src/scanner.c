@@ -0,0 +1,177 @@
+#include "scanner.h"
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#	include <immintrin.h>
+#	define USE_SIMD
+#endif
+
+typedef const char *(*scan_byte_impl_t)(const char *data, size_t len, char byte);
+
+static const char *scan_byte_scalar(const char *data, size_t len, char byte) {
+	const char *end = data + len;
+	for (; data < end; ++data)
+		if (*data == byte)
+			return data;
+
+	return NULL;
+}
+
+#ifdef USE_SIMD
+__attribute__((target("sse2")))
+static const char *scan_byte_sse2(const char *data, size_t len, char byte) {
+	const __m128i needle = _mm_set1_epi8(byte);
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+		unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+		if (mask)
+			return data + i + __builtin_ctz(mask);
+	}
+
+	return scan_byte_scalar(data + i, len - i, byte);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_byte_avx2(const char *data, size_t len, char byte) {
+	const __m256i needle = _mm256_set1_epi8(byte);
+
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+		unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+		if (mask)
+			return data + i + __builtin_ctz(mask);
+	}
+
+	return scan_byte_sse2(data + i, len - i, byte);
+}
+#endif // USE_SIMD
+
+struct scanner_impl_t {
+	const char *name;
+	scan_byte_impl_t scan_byte;
+};
+
+static const struct scanner_impl_t impls[] = {
+	{ .name = "scalar", .scan_byte = scan_byte_scalar, },
+#ifdef USE_SIMD
+	{ .name = "sse2", .scan_byte = scan_byte_sse2, },
+	{ .name = "avx2", .scan_byte = scan_byte_avx2, },
+#endif
+};
+
+static const struct scanner_impl_t *cur_impl = impls;
+
+static int impl_supported(const struct scanner_impl_t *impl) {
+#ifdef USE_SIMD
+	if (impl->scan_byte == scan_byte_sse2)
+		return __builtin_cpu_supports("sse2");
+	if (impl->scan_byte == scan_byte_avx2)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+__attribute__((constructor))
+static void select_best_impl() {
+#ifdef USE_SIMD
+	__builtin_cpu_init();
+#endif
+
+	// the last supported implementation is the fastest one
+	int i = 0;
+	for (; i < VSIZE(impls); ++i)
+		if (impl_supported(impls + i))
+			cur_impl = impls + i;
+}
+
+int scanner_select_impl(const char *name) {
+	int i = 0;
+	for (; i < VSIZE(impls); ++i) {
+		if (strcmp(impls[i].name, name) == 0 && impl_supported(impls + i)) {
+			cur_impl = impls + i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+const char *scanner_impl_name() {
+	return cur_impl->name;
+}
+
+const char *scan_byte(const char *data, size_t len, char byte) {
+	return cur_impl->scan_byte(data, len, byte);
+}
+
+const char *scan_crlf(const char *data, size_t len) {
+	const char *end = data + len;
+	const char *ptr = data;
+
+	while (ptr < end && (ptr = cur_impl->scan_byte(ptr, (size_t)(end - ptr), '\n'))) {
+		if (ptr > data && ptr[-1] == '\r')
+			return ptr - 1;
+		++ptr;
+	}
+
+	return NULL;
+}
+
+void scan_data_init(struct data_scanner_t *scanner) {
+	scanner->bol = 1;
+	scanner->cr = 0;
+}
+
+size_t scan_data(struct data_scanner_t *scanner, char *data, size_t len, size_t *data_len, int *end) {
+	size_t pos = 0;
+	size_t out = 0; // end of processed data
+	size_t seg = 0; // beginning of data, which should be moved to out
+
+	*end = 0;
+
+	while (pos < len) {
+		if (scanner->bol && data[pos] == '.') {
+			// ".", ".\r" can't be recognized without the next chunk
+			if (len - pos == 1 || (len - pos == 2 && data[pos + 1] == '\r'))
+				break;
+
+			if (out != seg)
+				memmove(data + out, data + seg, pos - seg);
+			out += pos - seg;
+
+			if (data[pos + 1] == '\r' && data[pos + 2] == '\n') {
+				scan_data_init(scanner);
+				*end = 1;
+				*data_len = out;
+				return pos + 3;
+			}
+
+			// stuffed dot is skipped
+			seg = ++pos;
+		}
+
+		scanner->bol = 0;
+
+		const char *lf = cur_impl->scan_byte(data + pos, len - pos, '\n');
+		if (!lf) {
+			scanner->cr = data[len - 1] == '\r';
+			pos = len;
+			break;
+		}
+
+		size_t lf_pos = (size_t)(lf - data);
+		scanner->bol = lf_pos > 0 ? data[lf_pos - 1] == '\r' : scanner->cr;
+		scanner->cr = 0;
+		pos = lf_pos + 1;
+	}
+
+	if (out != seg)
+		memmove(data + out, data + seg, pos - seg);
+	out += pos - seg;
+
+	*data_len = out;
+	return pos;
+}
@@ -0,0 +1,33 @@
+#include "smtp_command.h"
+#include "common.h"
+
+#include <stdint.h>
+
+// lowercase verb packed into 32 bits
+#define VERB_KEY(a, b, c, d) ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (uint32_t)(d))
+
+#define MK_CMD_CASE(name, a, b, c, d) case VERB_KEY(a, b, c, d): return CMD_## name;
+#define MK_CMD_NAME(name, ...) [CMD_## name] = #name,
+
+static const char *command_names[CMD_MAX + 1] = {
+	SMTP_COMMANDS(MK_CMD_NAME)
+	[CMD_UNKNOWN] = "unknown",
+};
+
+// XXX: all verbs are 4 letters long. Longer ones (STARTTLS) need the rest of verb to be compared
+enum smtp_command_t find_smtp_command(const char *verb, size_t len) {
+	if (len != 4)
+		return CMD_UNKNOWN;
+
+	// only ASCII letters are turned into lowercase letters by this
+	uint32_t key = VERB_KEY(verb[0] | 0x20, verb[1] | 0x20, verb[2] | 0x20, verb[3] | 0x20);
+	switch (key) {
+		SMTP_COMMANDS(MK_CMD_CASE)
+	}
+
+	return CMD_UNKNOWN;
+}
+
+const char *smtp_command_name(unsigned command) {
+	return command < VSIZE(command_names) ? command_names[command] : NULL;
+}
@@ -0,0 +1,184 @@
+#include "smtp_path.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+enum {
+	CH_ALNUM = 1,
+	CH_ATEXT = 2, // atext (RFC 5322, 3.2.3)
+};
+
+static uint8_t char_class[256];
+
+__attribute__((constructor))
+static void init_char_class() {
+	int c = 0;
+	for (; c < 256; ++c) {
+		if (isalnum(c) && c < 128)
+			char_class[c] = CH_ALNUM | CH_ATEXT;
+		else if (c && strchr("!#$%&'*+-/=?^_`{|}~", c))
+			char_class[c] = CH_ATEXT;
+	}
+}
+
+static inline int is_alnum(char c) {
+	return char_class[(unsigned char)c] & CH_ALNUM;
+}
+
+static inline int is_atext(char c) {
+	return char_class[(unsigned char)c] & CH_ATEXT;
+}
+
+// will return end of domain or NULL
+static const char *parse_domain(const char *ptr, const char *end) {
+	int n_labels = 0;
+
+	while (1) {
+		// sub-domain = Let-dig [Ldh-str]
+		const char *label = ptr;
+		while (ptr < end && (is_alnum(*ptr) || *ptr == '-'))
+			++ptr;
+
+		if (ptr == label || label[0] == '-' || ptr[-1] == '-')
+			return NULL;
+
+		++n_labels;
+		if (ptr == end || *ptr != '.')
+			break;
+		++ptr;
+	}
+
+	return n_labels > 1 ? ptr : NULL;
+}
+
+// Dot-string. Will return end of local part or NULL
+static const char *parse_local_part(const char *ptr, const char *end) {
+	while (1) {
+		const char *atom = ptr;
+		while (ptr < end && is_atext(*ptr))
+			++ptr;
+
+		if (ptr == atom)
+			return NULL;
+
+		if (ptr == end || *ptr != '.')
+			return ptr;
+		++ptr;
+	}
+}
+
+// A-d-l = At-domain *( "," At-domain ). Will return position after ':' or NULL
+static const char *skip_source_route(const char *ptr, const char *end) {
+	while (1) {
+		if (ptr == end || *ptr != '@')
+			return NULL;
+
+		ptr = parse_domain(ptr + 1, end);
+		if (!ptr || ptr == end)
+			return NULL;
+
+		if (*ptr == ':')
+			return ptr + 1;
+		if (*ptr != ',')
+			return NULL;
+		++ptr;
+	}
+}
+
+// Mail-parameters (RFC 5321, 4.1.2). Will return 0 on success and -1 on error
+static int parse_params(const char *ptr, const char *end, struct smtp_path_t *path) {
+	while (ptr < end) {
+		if (*ptr != ' ')
+			return -1;
+
+		while (ptr < end && *ptr == ' ')
+			++ptr;
+		if (ptr == end)
+			break;
+
+		if (path->n_params >= SMTP_PATH_MAX_PARAMS)
+			return -1;
+
+		struct smtp_param_t *param = path->params + path->n_params++;
+
+		// esmtp-keyword = (ALPHA / DIGIT) *(ALPHA / DIGIT / "-")
+		param->keyword = ptr;
+		if (!is_alnum(*ptr))
+			return -1;
+		while (ptr < end && (is_alnum(*ptr) || *ptr == '-'))
+			++ptr;
+		param->keyword_len = (size_t)(ptr - param->keyword);
+
+		param->value = NULL;
+		param->value_len = 0;
+		if (ptr == end || *ptr != '=')
+			continue;
+
+		// esmtp-value = 1*(%d33-60 / %d62-126)
+		param->value = ++ptr;
+		while (ptr < end && *ptr > ' ' && *ptr < 127 && *ptr != '=')
+			++ptr;
+		param->value_len = (size_t)(ptr - param->value);
+
+		if (!param->value_len)
+			return -1;
+	}
+
+	return 0;
+}
+
+int parse_smtp_path(const char *data, size_t len, const char *prefix, int flags, struct smtp_path_t *path) {
+	const char *ptr = data;
+	const char *end = data + len;
+	size_t prefix_len = strlen(prefix);
+
+	path->mailbox = NULL;
+	path->mailbox_len = 0;
+	path->n_params = 0;
+
+	if (len < prefix_len || strncasecmp(data, prefix, prefix_len) != 0)
+		return -1;
+	ptr += prefix_len;
+
+	// XXX: space after colon is not allowed by RFC, but some clients send it
+	while (ptr < end && *ptr == ' ')
+		++ptr;
+
+	if (ptr == end || *ptr != '<')
+		return -1;
+	++ptr;
+
+	const char *mailbox = ptr;
+	if (ptr < end && *ptr == '>') {
+		if (!(flags & SMTP_PATH_NULL_ALLOWED))
+			return -1;
+	} else if ((flags & SMTP_PATH_POSTMASTER) && (size_t)(end - ptr) >= sizeof("Postmaster>") - 1
+			&& strncasecmp(ptr, "Postmaster>", sizeof("Postmaster>") - 1) == 0) {
+		ptr += sizeof("Postmaster") - 1;
+	} else {
+		if (ptr < end && *ptr == '@') {
+			ptr = skip_source_route(ptr, end);
+			if (!ptr)
+				return -1;
+			mailbox = ptr;
+		}
+
+		ptr = parse_local_part(ptr, end);
+		if (!ptr || ptr == end || *ptr != '@')
+			return -1;
+
+		ptr = parse_domain(ptr + 1, end);
+		if (!ptr)
+			return -1;
+	}
+
+	if (ptr == end || *ptr != '>' || ptr - mailbox > SMTP_PATH_MAX_LEN)
+		return -1;
+
+	path->mailbox = mailbox;
+	path->mailbox_len = (size_t)(ptr - mailbox);
+
+	return parse_params(ptr + 1, end, path);
+}
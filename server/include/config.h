@@ -12,7 +12,18 @@
 	_(queue_dir, STR) \
 	_(tmp_dir, STR) \
 	_(n_workers, INT) \
+	_(worker_max_sessions, INT) \
+	_(max_recipients, INT) \
+	_(recipients_db, STR) \
 	_(hostname, STR) \
+	_(control_socket, STR) \
+
+// options, which can be omitted in config file
+#define CONFIG_DEFAULTS(_) \
+	_(worker_max_sessions, INT, 0) \
+	_(max_recipients, INT, 100) \
+	_(recipients_db, STR, "") \
+	_(control_socket, STR, "") \
 
 SET_CONFIG_SPEC(CONFIG_SPEC)
 
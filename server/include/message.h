@@ -1,6 +1,34 @@
 #ifndef __MESSAGE_H__
 #define __MESSAGE_H__
 
-int mk_message(const char *data, size_t data_len, const char *mail_from, const char *rcpt_to, char *uidl, size_t uidl_len);
+#include "recipients.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Message is written into the spool while it comes:
+ *	struct message_t *msg = message_begin(from, &rcpts);
+ *	message_write(msg, chunk, chunk_size);
+ *	...
+ *	message_commit(msg, uidl, sizeof(uidl), &ticket); // or message_abort(msg)
+ *
+ * Message headers are kept in memory until the end of headers, body is written to disk directly.
+ * Committed message is in queue_dir, but it is durable only when spool_wait() reports it (see spool.h).
+ * Message object is freed by message_commit() and message_abort() in any case.
+ */
+
+struct message_t;
+
+// will return NULL on error
+struct message_t *message_begin(const char *mail_from, const struct recipients_t *rcpts);
+
+// will return 0 on success, 1 when message headers are too large and -1 on error
+int message_write(struct message_t *msg, const char *data, size_t data_len);
+
+// will return 0 on success and -1 on error
+int message_commit(struct message_t *msg, char *uidl, size_t uidl_len, uint64_t *ticket);
+
+void message_abort(struct message_t *msg);
 
 #endif // __MESSAGE_H__
@@ -0,0 +1,76 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+
+struct event_loop_t;
+
+/*
+ * Counters and latency histograms of the server. They live in shared memory created by master before workers
+ * are forked, each process writes only into its own slot, so updates are plain increments:
+ *	metrics_add(bytes_in, received);
+ *	metrics_command(command);
+ *	metrics_observe(reply_time, metrics_now_us() - start);
+ *
+ * Master sums all slots when somebody connects to control_socket and replies with Prometheus text format.
+ * Both plain requests and HTTP GET are served:
+ *	socat - UNIX-CONNECT:/var/run/smtp.sock < /dev/null
+ *	curl --unix-socket /var/run/smtp.sock http://localhost/metrics
+ *
+ * Slot of restarted worker is reused, so counters never go back.
+ */
+
+#define METRICS_COUNTERS(_) \
+	_(connections, "Sessions started") \
+	_(bytes_in, "Bytes received from clients") \
+	_(bytes_out, "Bytes sent to clients") \
+	_(messages_accepted, "Messages queued for delivery") \
+	_(messages_rejected, "Messages which were not queued") \
+	_(spool_bytes, "Bytes of accepted messages") \
+
+// values are in microseconds
+#define METRICS_HISTOGRAMS(_) \
+	_(data_duration, "Time from DATA command to the final reply") \
+	_(reply_time, "Time from command to the moment its reply was sent. Pipelined commands are timed from the first one of the batch") \
+
+#define MK_METRIC_ENUM(name, ...) METRIC_## name,
+
+enum metrics_counter_t {
+	METRICS_COUNTERS(MK_METRIC_ENUM)
+	METRIC_COUNTERS_MAX,
+};
+
+enum metrics_histogram_t {
+	METRICS_HISTOGRAMS(MK_METRIC_ENUM)
+	METRIC_HISTOGRAMS_MAX,
+};
+
+#undef MK_METRIC_ENUM
+
+// should be called by master before workers are started. Slot n_workers is used by master.
+// Will return 0 on success and -1 on error
+int metrics_init(int n_workers);
+
+// should be called by worker after fork
+void metrics_attach(int slot);
+
+// binds control socket, it should be called before chroot. Empty path disables the socket.
+// Will return 0 on success and -1 on error
+int metrics_listen(const char *path);
+
+// starts serving control socket in master's loop. Will return 0 on success and -1 on error
+int metrics_serve(struct event_loop_t *loop);
+
+void metrics_add_impl(enum metrics_counter_t counter, uint64_t value);
+void metrics_observe_impl(enum metrics_histogram_t histogram, uint64_t usec);
+
+#define metrics_add(name, value) metrics_add_impl(METRIC_## name, value)
+#define metrics_observe(name, usec) metrics_observe_impl(METRIC_## name, usec)
+
+// command is enum smtp_command_t, see smtp_command.h
+void metrics_command(unsigned command);
+
+// CLOCK_MONOTONIC in microseconds
+uint64_t metrics_now_us();
+
+#endif // __METRICS_H__
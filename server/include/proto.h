@@ -1,7 +1,12 @@
 #ifndef __PROTO_H__
 #define __PROTO_H__
 
-void smtp_communicate_with_client(int sock);
+struct event_loop_t;
+
+// starts non-blocking session with client in the given loop. on_done will be called when session is finished
+int smtp_start_session(struct event_loop_t *loop, int sock, void (*on_done)(void *arg), void *arg);
+
+// blocking function, sends error message to the client and closes connection
 void smtp_reject_client(int sock, const char *msg);
 
 #endif // __PROTO_H__
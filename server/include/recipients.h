@@ -0,0 +1,40 @@
+#ifndef __RECIPIENTS_H__
+#define __RECIPIENTS_H__
+
+#include "arena.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Recipients of mail transaction. Addresses, list and set of them are stored in transaction arena,
+ * so recipients_clear() should be called when arena is reset.
+ *
+ * Duplicates are found with case-insensitive domain, local part is compared as is (RFC 5321, 2.4).
+ */
+
+struct recipient_t {
+	const char *addr;
+	size_t len;
+	uint32_t hash;
+};
+
+struct recipients_t {
+	struct arena_t *arena;
+
+	struct recipient_t *items;
+	size_t n_items;
+	size_t allocated;
+
+	// open addressing set: index in items + 1, 0 is empty slot
+	uint32_t *set;
+	size_t set_size;
+};
+
+void recipients_init(struct recipients_t *rcpts, struct arena_t *arena);
+void recipients_clear(struct recipients_t *rcpts);
+
+// address is copied. Will return 0 if recipient was added, 1 if it is already in list and -1 on error
+int recipients_add(struct recipients_t *rcpts, const char *addr, size_t len);
+
+#endif // __RECIPIENTS_H__
@@ -0,0 +1,53 @@
+#ifndef __SPOOL_H__
+#define __SPOOL_H__
+
+#include "event_loop.h"
+
+#include <stdint.h>
+
+/*
+ * Messages are written into tmp_dir and moved into queue_dir when they are complete:
+ *	struct spool_file_t file;
+ *	spool_open(&file);
+ *	write(file.fd, ...);
+ *	spool_commit(&file, &ticket); // or spool_discard(&file)
+ *	spool_wait(loop, &waiter, ticket, on_synced, arg);
+ *
+ * spool_commit() fsyncs the file and renames it into queue_dir, but rename is not durable until queue_dir is synced.
+ * Directory is synced once for all messages committed by all workers during SPOOL_SYNC_INTERVAL_MS:
+ * any worker syncs it, others only check shared counters. Client should get reply when on_synced is called.
+ */
+
+struct spool_file_t {
+	int fd;
+	char name[128]; // file name, it is the same in tmp_dir and queue_dir
+};
+
+// should be called by master before workers are started. Will return 0 on success and -1 on error
+int spool_init();
+
+// will return 0 on success and -1 on error
+int spool_open(struct spool_file_t *file);
+
+// file is closed in any case. Will return 0 on success and -1 on error (file is removed then)
+int spool_commit(struct spool_file_t *file, uint64_t *ticket);
+
+void spool_discard(struct spool_file_t *file);
+
+// status is 0 when message is on disk and -1 when queue_dir can't be synced
+typedef void (*spool_cb_t)(void *arg, int status);
+
+struct spool_waiter_t {
+	uint64_t ticket;
+	spool_cb_t cb;
+	void *arg;
+
+	struct spool_waiter_t *next;
+};
+
+// waiter should stay alive until callback is called or spool_cancel() is called.
+// Will return 0 on success and -1 on error, callback is never called from spool_wait() itself
+int spool_wait(struct event_loop_t *loop, struct spool_waiter_t *waiter, uint64_t ticket, spool_cb_t cb, void *arg);
+void spool_cancel(struct spool_waiter_t *waiter);
+
+#endif // __SPOOL_H__
@@ -1,7 +1,18 @@
 #ifndef __WORKER_H__
 #define __WORKER_H__
 
-int mk_worker(int client_sock);
+struct event_loop_t;
+
+// starts n_workers processes. Workers channels will be served by the given loop
+int init_workers(struct event_loop_t *loop);
+
+// passes accepted client into the least loaded worker. Client socket is closed in master on success
+int pass_to_worker(int client_sock);
+
+// sends signal to all running workers
+void signal_workers(int signo);
+
+// should be called when worker process exited. Worker will be restarted
 int destroy_worker(int pid);
 
 #endif // __WORKER_H__
@@ -50,6 +50,7 @@ int main (int argc, const char **argv) {
 	set_log_level(cmd_line_opts_list[OPT_LOG_LVL].i_val);
 
 	DEF_CONFIG(CONFIG_SPEC);
+	SET_CONFIG_DEFAULTS(CONFIG_DEFAULTS);
 	if (read_config(cmd_line_opts_list[OPT_CONFIG].s_val) != 0)
 		return -1;
 
@@ -58,6 +59,16 @@ int main (int argc, const char **argv) {
 		return -1;
 	}
 
+	if (get_opt_worker_max_sessions() < 0) {
+		log_error("worker_max_sessions parametr should not be negative, use 0 to never restart workers");
+		return -1;
+	}
+
+	if (get_opt_max_recipients() <= 0) {
+		log_error("max_recipients parametr should be greater then zero");
+		return -1;
+	}
+
 	run_server(cmd_line_opts_list[OPT_OUTPUT].s_val);
 
 	return 0;
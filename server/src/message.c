@@ -2,16 +2,24 @@
 #include "message.h"
 #include "logger.h"
 #include "config.h"
+#include "spool.h"
+#include "headers.h"
+#include "coarse_clock.h"
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <pcre.h>
 #include <errno.h>
 #include <time.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 #define MAX_HEADERS 64
 
+#ifndef MESSAGE_HEADERS_MAX_SIZE
+#	define MESSAGE_HEADERS_MAX_SIZE (64 * 1024)
+#endif
+
 #define HEADERS(_) \
 	_(FROM) \
 	_(TO) \
@@ -28,196 +36,385 @@ enum header_type_t {
 struct header_info_t {
 	const char *header_name;
 	size_t header_name_len;
+	uint32_t header_name_hash;
 	enum header_type_t header_type;
 };
 
 #define MK_INFO(name) { .header_name = #name, .header_type = MK_ENUM(name) },
 
-struct header_info_t supported_headers[] = {
+static struct header_info_t supported_headers[] = {
 	HEADERS(MK_INFO)
 };
 
 #undef MK_ENUM
 #undef MK_INFO
 
-static enum header_type_t get_header_type(const char *header_name) {
+// open addressing table of indexes in supported_headers, -1 is empty slot
+#define HEADERS_HASH_SIZE 16
+static int8_t headers_hash[HEADERS_HASH_SIZE];
+
+__attribute__((constructor))
+static void init_headers_hash() {
+	memset(headers_hash, -1, sizeof(headers_hash));
+
 	int i = 0;
 	for (; i < VSIZE(supported_headers); ++i) {
-		size_t len = supported_headers[i].header_name_len;
-		if (len == 0)
-			supported_headers[i].header_name_len = len = strlen(supported_headers[i].header_name);
+		struct header_info_t *info = supported_headers + i;
+		info->header_name_len = strlen(info->header_name);
+		info->header_name_hash = header_name_hash(info->header_name, info->header_name_len);
+
+		uint32_t slot = info->header_name_hash % HEADERS_HASH_SIZE;
+		while (headers_hash[slot] >= 0)
+			slot = (slot + 1) % HEADERS_HASH_SIZE;
+
+		headers_hash[slot] = (int8_t)i;
+	}
+}
 
-		if (strlen(header_name) == len && strncasecmp(header_name, supported_headers[i].header_name, len) == 0) {
-			log_trace("Header %s recognized as %s", header_name, supported_headers[i].header_name);
-			return supported_headers[i].header_type;
+static enum header_type_t get_header_type(const struct header_t *header) {
+	uint32_t slot = header->name_hash % HEADERS_HASH_SIZE;
+	for (; headers_hash[slot] >= 0; slot = (slot + 1) % HEADERS_HASH_SIZE) {
+		const struct header_info_t *info = supported_headers + headers_hash[slot];
+		if (info->header_name_hash == header->name_hash && info->header_name_len == header->name_len
+				&& strncasecmp(header->name, info->header_name, header->name_len) == 0) {
+			log_trace("Header %.*s recognized as %s", (int)header->name_len, header->name, info->header_name);
+			return info->header_type;
 		}
 	}
 
 	return HEADER_OTHER;
 }
 
-struct message_header_t {
-	enum header_type_t header_type;
-
-	char header_name[128];
-	char header_value[1024];
-};
-
 struct added_header_t {
 	const char *header_name;
 	const char *header_value;
 };
 
-static pcre *header_re = NULL;
+struct message_t {
+	struct spool_file_t file;
+	char uidl[255];
+
+	uint8_t in_body;
+
+	// headers to be written, they are sent to disk together with the first chunk of body
+	char *prelude;
+	size_t prelude_used;
+	size_t prelude_allocated;
+
+	// client's headers are collected here until empty line came
+	char *headers;
+	size_t headers_used;
+	size_t headers_allocated;
+};
+
+// will return 0 on success and -1 on error
+static int reserve(char **buf, size_t *allocated, size_t size) {
+	if (*allocated >= size)
+		return 0;
+
+	size_t new_size = *allocated ? *allocated : 1024;
+	while (new_size < size)
+		new_size *= 2;
+
+	char *new_buf = (char *)realloc(*buf, new_size);
+	if (!new_buf) {
+		log_error("Can't allocate %zu bytes for message", new_size);
+		return -1;
+	}
 
-__attribute__((destructor))
-void clean_re() {
-	if (header_re)
-		pcre_free(header_re);
+	*buf = new_buf;
+	*allocated = new_size;
+
+	return 0;
 }
 
-const char *parse_headers(const char *data, size_t data_len, struct message_header_t *headers, size_t max_headers, int *n_headers) {
-	const char delim[] = "\r\n\r\n";
-	const char *data_ptr = memmem(data, data_len, delim, sizeof(delim) - 1);
-	if (data_ptr)
-		data_ptr += sizeof(delim) - 1;
-
-	if (!header_re) {
-		const char *err;
-		int err_off;
-		header_re = pcre_compile("([\\w-]+):\\s*(.*)", PCRE_NEWLINE_CRLF, &err, &err_off, NULL);
-		if (!header_re) {
-			log_error("Can't compile re: %s (offset %d)", err, err_off);
-			return data_ptr;
-		}
+static int add_header(struct message_t *msg, const char *name, size_t name_len, const char *value, size_t value_len) {
+	size_t size = name_len + value_len + sizeof(": \r\n") - 1;
+	if (reserve(&msg->prelude, &msg->prelude_allocated, msg->prelude_used + size) != 0)
+		return -1;
+
+	char *ptr = msg->prelude + msg->prelude_used;
+	memcpy(ptr, name, name_len);
+	ptr += name_len;
+	memcpy(ptr, ": ", 2);
+	ptr += 2;
+	memcpy(ptr, value, value_len);
+	ptr += value_len;
+	memcpy(ptr, "\r\n", 2);
+
+	msg->prelude_used += size;
+	return 0;
+}
+
+static int write_headers(struct message_t *msg, const struct added_header_t *headers, int n_headers) {
+	int i = 0;
+	for (; i < n_headers; ++i) {
+		const char *name = headers[i].header_name;
+		const char *value = headers[i].header_value;
+		if (add_header(msg, name, strlen(name), value, strlen(value)) != 0)
+			return -1;
 	}
 
-	int off = 0;
-	int len = (int)data_len;
-	int rc = 0;
+	return 0;
+}
 
-	int ovector[24];
-	if (data_ptr)
-		len = (int)(data_ptr - data);
+// client's header is written with name like "Content-type"
+static int add_client_header(struct message_t *msg, const struct header_t *header) {
+	size_t name_off = msg->prelude_used;
+	if (add_header(msg, header->name, header->name_len, header->value, header->value_len) != 0)
+		return -1;
 
-	*n_headers = 0;
-	while (off < len && (rc = pcre_exec(header_re, NULL, data, len, off, 0, ovector, sizeof(ovector))) >= 0) {
-		if (*n_headers >= max_headers) {
-			log_error("Too many headers in message. Reject some");
-			break;
-		}
+	char *name = msg->prelude + name_off;
+	name[0] = (char)toupper(name[0]);
 
-		struct message_header_t *hdr = headers + *n_headers;
-		int name_len = snprintf(hdr->header_name, sizeof(hdr->header_name), "%.*s", ovector[3] - ovector[2], data + ovector[2]);
-		snprintf(hdr->header_value, sizeof(hdr->header_value), "%.*s", ovector[5] - ovector[4], data + ovector[4]);
-		hdr->header_type = get_header_type(hdr->header_name);
+	size_t i = 1;
+	for (; i < header->name_len; ++i)
+		name[i] = (char)tolower(name[i]);
+
+	return 0;
+}
 
-		log_trace("Header #%d: %s: %s", *n_headers, hdr->header_name, hdr->header_value);
+// recipients are folded into lines of 78 characters when it is possible
+static int add_to_header(struct message_t *msg, const struct recipients_t *rcpts) {
+	const char delim[] = ", ";
+	const char folded_delim[] = ",\r\n ";
 
-		int i = 1;
-		hdr->header_name[0] = (char)toupper(hdr->header_name[0]);
-		for (; i < name_len; ++i) {
-			hdr->header_name[i] = (char)tolower(hdr->header_name[i]);
+	size_t size = sizeof("To: \r\n") - 1;
+	size_t i = 0;
+	for (; i < rcpts->n_items; ++i)
+		size += rcpts->items[i].len + sizeof(folded_delim) - 1;
+
+	if (reserve(&msg->prelude, &msg->prelude_allocated, msg->prelude_used + size) != 0)
+		return -1;
+
+	char *ptr = msg->prelude + msg->prelude_used;
+	memcpy(ptr, "To: ", 4);
+	ptr += 4;
+
+	size_t line_len = 4;
+	for (i = 0; i < rcpts->n_items; ++i) {
+		const struct recipient_t *rcpt = rcpts->items + i;
+		if (i && line_len + sizeof(delim) - 1 + rcpt->len > 78) {
+			memcpy(ptr, folded_delim, sizeof(folded_delim) - 1);
+			ptr += sizeof(folded_delim) - 1;
+			line_len = 1;
+		} else if (i) {
+			memcpy(ptr, delim, sizeof(delim) - 1);
+			ptr += sizeof(delim) - 1;
+			line_len += sizeof(delim) - 1;
 		}
 
-		off = ovector[1];
-		++*n_headers;
+		memcpy(ptr, rcpt->addr, rcpt->len);
+		ptr += rcpt->len;
+		line_len += rcpt->len;
 	}
 
-	return data_ptr;
+	memcpy(ptr, "\r\n", 2);
+	ptr += 2;
+
+	msg->prelude_used = (size_t)(ptr - msg->prelude);
+	return 0;
 }
 
-static int store_message(const struct added_header_t *headers, int n_headers, const char *data, size_t data_len) {
-	char message_name[128];
-	snprintf(message_name, sizeof(message_name), "%s/%ld-%s-%d-%d", get_opt_tmp_dir(), time(NULL), get_opt_hostname(), getpid(), rand());
+// will return 0 on success and -1 on error
+static int write_all(struct message_t *msg, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t written = writev(msg->file.fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+
+			log_error("Can't write message %s: %s", msg->file.name, strerror(errno));
+			return -1;
+		}
 
-	log_info("Saving message to %s/%s", get_opt_root_dir(), message_name);
+		size_t left = (size_t)written;
+		while (iovcnt > 0 && left >= iov->iov_len) {
+			left -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
 
-	FILE *f = fopen(message_name, "w");
-	if (!f) {
-		log_error("Can't open message %s: %s", message_name, strerror(errno));
-		return -1;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + left;
+			iov->iov_len -= left;
+		}
 	}
 
-	int i = 0;
-	for (; i < n_headers; ++i)
-		fprintf(f, "%s: %s\r\n", headers[i].header_name, headers[i].header_value);
+	return 0;
+}
+
+// adds client's headers, which are not added yet, and empty line after them
+static int flush_headers(struct message_t *msg, const char *data, size_t data_len) {
+	struct header_t headers[MAX_HEADERS];
+	enum header_type_t types[MAX_HEADERS];
+	size_t n_headers = parse_headers(data, data_len, headers, VSIZE(headers));
+
+	size_t i = 0;
+	const struct header_t *subject = NULL;
+	for (; i < n_headers; ++i) {
+		types[i] = get_header_type(headers + i);
+		if (types[i] == HEADER_SUBJECT)
+			subject = headers + i;
+	}
+
+	msg->in_body = 1;
 
-	fprintf(f, "\r\n%.*s", (int)data_len, data);
-	fclose(f);
+	int ret = 0;
+	if (subject)
+		ret = add_client_header(msg, subject);
+	else
+		ret = add_header(msg, STRSZ("Subject"), STRSZ("<No subject>"));
+
+	for (i = 0; ret == 0 && i < n_headers; ++i)
+		if (types[i] == HEADER_OTHER)
+			ret = add_client_header(msg, headers + i);
+
+	if (ret != 0 || reserve(&msg->prelude, &msg->prelude_allocated, msg->prelude_used + 2) != 0)
+		return -1;
+
+	memcpy(msg->prelude + msg->prelude_used, "\r\n", 2);
+	msg->prelude_used += 2;
 
 	return 0;
 }
 
-int mk_message(const char *data, size_t data_len, const char *mail_from, const char *rcpt_to, char *uidl, size_t uidl_len) {
-	log_trace("Saving message from '%s'", mail_from);
-	log_trace("Recipients are: %s", rcpt_to);
+static void free_message(struct message_t *msg) {
+	safe_free(msg->prelude);
+	safe_free(msg->headers);
+	free(msg);
+}
 
-	char timestamp[255];
-	time_t t = time(NULL);
-	struct tm *tmp = localtime(&t);
-	if (tmp == NULL) {
-		log_error("Can't get localtime: %s", strerror(errno));
-		return -1;
+struct message_t *message_begin(const char *mail_from, const struct recipients_t *rcpts) {
+	if (!mail_from)
+		mail_from = "";
+
+	log_trace("Saving message from '%s' to %zu recipients", mail_from, rcpts->n_items);
+
+	time_t now = coarse_clock_now();
+	const char *timestamp = coarse_clock_date(now);
+	if (!*timestamp) {
+		log_error("Can't format date");
+		return NULL;
 	}
 
-	if (strftime(timestamp, sizeof(timestamp), "%a, %e %b %Y %T %z", tmp) == 0) {
-		log_error("Strftime failed: %s", strerror(errno));
-		return -1;
+	struct message_t *msg = (struct message_t *)calloc(1, sizeof(*msg));
+	if (!msg) {
+		log_error("Can't allocate message");
+		return NULL;
 	}
 
 	char from_header_value[1024];
 	snprintf(from_header_value, sizeof(from_header_value), "%s <%s>", mail_from, mail_from);
 
 	char msgid[255];
-	snprintf(msgid, sizeof(msgid), "%ld-%d-%ld", time(NULL) | rand(), rand(), time(NULL));
+	snprintf(msgid, sizeof(msgid), "%ld-%d-%ld", now | rand(), rand(), now);
 
+	// empty reverse path is allowed
 	const char *at_sym = strchr(mail_from, '@');
-	snprintf(uidl, uidl_len, "<%s@%s>", msgid, at_sym + 1);
+	snprintf(msg->uidl, sizeof(msg->uidl), "<%s@%s>", msgid, at_sym ? at_sym + 1 : get_opt_hostname());
 
-	int n_default_headers = 4;
-	struct added_header_t headers_to_add[MAX_HEADERS + 4] = {
+	const struct added_header_t default_headers[] = {
 		{ .header_name = "From", .header_value = from_header_value, },
 		{ .header_name = "Date", .header_value = timestamp, },
-		{ .header_name = "Message-ID", .header_value = uidl, },
-		{ .header_name = "To", .header_value = rcpt_to, },
+		{ .header_name = "Message-ID", .header_value = msg->uidl, },
 	};
 
-	struct message_header_t headers[MAX_HEADERS];
-	int n_headers = 0;
+	if (spool_open(&msg->file) != 0) {
+		free_message(msg);
+		return NULL;
+	}
 
-	const char *data_ptr = parse_headers(data, data_len, headers, VSIZE(headers), &n_headers);
-	if (!data_ptr)
-		log_info("Message without body came");
+	if (write_headers(msg, default_headers, VSIZE(default_headers)) != 0 || add_to_header(msg, rcpts) != 0) {
+		message_abort(msg);
+		return NULL;
+	}
 
-	int i = 0;
-	const struct message_header_t *subject = NULL;
-	for (; i < n_headers; ++i) {
-		if (headers[i].header_type == HEADER_SUBJECT) {
-			subject = headers + i;
-		}
+	return msg;
+}
+
+// writes headers, which are not written yet, and body chunk with a single syscall
+static int write_chunk(struct message_t *msg, const char *data, size_t data_len) {
+	struct iovec iov[] = {
+		{ .iov_base = msg->prelude, .iov_len = msg->prelude_used, },
+		{ .iov_base = (void *)data, .iov_len = data_len, },
+	};
+
+	int ret = write_all(msg, iov, VSIZE(iov));
+
+	if (msg->prelude) {
+		safe_free(msg->prelude);
+		msg->prelude_used = msg->prelude_allocated = 0;
 	}
 
-	if (subject) {
-		headers_to_add[n_default_headers++] = (struct added_header_t){
-			.header_name = subject->header_name,
-			.header_value = subject->header_value,
-		};
+	return ret;
+}
+
+int message_write(struct message_t *msg, const char *data, size_t data_len) {
+	if (msg->in_body)
+		return write_chunk(msg, data, data_len);
+
+	const char delim[] = "\r\n\r\n";
+	size_t search_from = msg->headers_used > sizeof(delim) - 2 ? msg->headers_used - (sizeof(delim) - 2) : 0;
+
+	if (reserve(&msg->headers, &msg->headers_allocated, msg->headers_used + data_len) != 0)
+		return -1;
+
+	memcpy(msg->headers + msg->headers_used, data, data_len);
+	msg->headers_used += data_len;
+
+	size_t headers_len = 0;
+	if (msg->headers_used >= 2 && memcmp(msg->headers, "\r\n", 2) == 0) {
+		// message without headers
+		headers_len = 2;
+		if (flush_headers(msg, msg->headers, 0) != 0)
+			return -1;
 	} else {
-		headers_to_add[n_default_headers++] = (struct added_header_t){
-			.header_name = "Subject",
-			.header_value = "<No subject>",
-		};
+		const char *headers_end = memmem(msg->headers + search_from, msg->headers_used - search_from, delim, sizeof(delim) - 1);
+		if (!headers_end) {
+			if (msg->headers_used > MESSAGE_HEADERS_MAX_SIZE) {
+				log_warn("Too large message headers, %zu bytes", msg->headers_used);
+				return 1;
+			}
+
+			return 0;
+		}
+
+		headers_len = (size_t)(headers_end - msg->headers) + sizeof(delim) - 1;
+		if (flush_headers(msg, msg->headers, headers_len) != 0)
+			return -1;
 	}
 
-	for (i = 0; i < n_headers; ++i) {
-		if (headers[i].header_type == HEADER_OTHER) {
-			headers_to_add[n_default_headers++] = (struct added_header_t){
-				.header_name = headers[i].header_name,
-				.header_value = headers[i].header_value,
-			};
+	int ret = write_chunk(msg, msg->headers + headers_len, msg->headers_used - headers_len);
+
+	safe_free(msg->headers);
+	msg->headers_used = msg->headers_allocated = 0;
+
+	return ret;
+}
+
+int message_commit(struct message_t *msg, char *uidl, size_t uidl_len, uint64_t *ticket) {
+	if (!msg->in_body) {
+		log_info("Message without body came");
+		if (flush_headers(msg, msg->headers ? msg->headers : "", msg->headers_used) != 0
+				|| write_chunk(msg, NULL, 0) != 0) {
+			message_abort(msg);
+			return -1;
 		}
 	}
 
-	return store_message(headers_to_add, n_default_headers, data_ptr, (size_t)(data_ptr ? data_len - (size_t)(data_ptr - data) : 0));
+	if (spool_commit(&msg->file, ticket) != 0) {
+		free_message(msg);
+		return -1;
+	}
+
+	snprintf(uidl, uidl_len, "%s", msg->uidl);
+	free_message(msg);
+
+	return 0;
+}
+
+void message_abort(struct message_t *msg) {
+	spool_discard(&msg->file);
+	free_message(msg);
 }
@@ -0,0 +1,496 @@
+#include "metrics.h"
+#include "smtp_command.h"
+#include "logger.h"
+#include "event_loop.h"
+#include "coarse_clock.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// slots of processes are padded to cache lines, so workers don't invalidate each other's caches
+#ifndef METRICS_CACHE_LINE
+#	define METRICS_CACHE_LINE 64
+#endif
+
+// each power of two of a histogram is split into 2^METRICS_SUB_BITS buckets, so a bucket is at most 12.5% wide
+#ifndef METRICS_SUB_BITS
+#	define METRICS_SUB_BITS 3
+#endif
+
+// values above 2^METRICS_MAX_BITS microseconds (~2 minutes) are counted only in +Inf bucket
+#ifndef METRICS_MAX_BITS
+#	define METRICS_MAX_BITS 27
+#endif
+
+#ifndef METRICS_MAX_COMMANDS
+#	define METRICS_MAX_COMMANDS 16
+#endif
+
+// requests to control socket are short, longer ones are not read till the end
+#ifndef METRICS_REQUEST_SIZE
+#	define METRICS_REQUEST_SIZE 1024
+#endif
+
+// control client should send request and read the reply in this time, in seconds
+#ifndef METRICS_CLIENT_TIMEOUT
+#	define METRICS_CLIENT_TIMEOUT 5
+#endif
+
+// idle control clients are looked for with this interval
+#ifndef METRICS_TIMER_INTERVAL_MS
+#	define METRICS_TIMER_INTERVAL_MS 1000
+#endif
+
+#define SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define N_FINITE_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * SUB_BUCKETS)
+
+struct histogram_t {
+	uint64_t buckets[N_FINITE_BUCKETS + 1]; // the last one is +Inf
+	uint64_t sum;
+};
+
+// XXX: all fields are uint64_t: master sums slots as arrays of words
+struct metrics_slot_t {
+	uint64_t counters[METRIC_COUNTERS_MAX];
+	uint64_t commands[METRICS_MAX_COMMANDS];
+	struct histogram_t histograms[METRIC_HISTOGRAMS_MAX];
+} __attribute__((aligned(METRICS_CACHE_LINE)));
+
+struct control_client_t {
+	int fd;
+	uint8_t eof;
+	time_t deadline;
+
+	size_t used;
+	char buf[METRICS_REQUEST_SIZE];
+
+	// reply is rendered when request is complete, it is sent as socket becomes writable
+	char *reply;
+	size_t reply_size;
+	size_t sent;
+
+	struct control_client_t *next;
+};
+
+static struct metrics_slot_t *slots = NULL;
+static int n_slots = 0;
+static struct metrics_slot_t *own = NULL;
+
+static int control_sock = -1;
+
+static struct control_client_t *control_clients = NULL;
+static int timer_id = -1;
+
+int metrics_init(int n_workers) {
+	assert(!slots);
+
+	n_slots = n_workers + 1;
+	size_t size = (size_t)n_slots * sizeof(*slots);
+
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		log_error("Can't allocate shared memory for metrics: %s", strerror(errno));
+		return -1;
+	}
+
+	slots = (struct metrics_slot_t *)mem;
+	memset(slots, 0, size);
+
+	own = slots + n_workers;
+
+	log_debug("%zu bytes of shared memory were allocated for metrics", size);
+	return 0;
+}
+
+void metrics_attach(int slot) {
+	if (slots && slot >= 0 && slot < n_slots)
+		own = slots + slot;
+}
+
+void metrics_add_impl(enum metrics_counter_t counter, uint64_t value) {
+	if (own)
+		own->counters[counter] += value;
+}
+
+void metrics_command(unsigned command) {
+	if (own && command < METRICS_MAX_COMMANDS)
+		++own->commands[command];
+}
+
+// log-linear buckets: values below SUB_BUCKETS have own buckets, then each power of two is split evenly
+static unsigned bucket_index(uint64_t usec) {
+	if (usec < SUB_BUCKETS)
+		return (unsigned)usec;
+
+	if (usec >> METRICS_MAX_BITS)
+		return N_FINITE_BUCKETS;
+
+	unsigned exp = 63 - (unsigned)__builtin_clzll(usec);
+	unsigned sub = (unsigned)(usec >> (exp - METRICS_SUB_BITS)) & (SUB_BUCKETS - 1);
+
+	return (exp - METRICS_SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// all values of the bucket are less than this
+static uint64_t bucket_upper_bound(unsigned index) {
+	if (index < SUB_BUCKETS)
+		return index + 1;
+
+	unsigned exp = index / SUB_BUCKETS + METRICS_SUB_BITS - 1;
+	unsigned sub = index % SUB_BUCKETS;
+
+	return (uint64_t)(SUB_BUCKETS + sub + 1) << (exp - METRICS_SUB_BITS);
+}
+
+void metrics_observe_impl(enum metrics_histogram_t histogram, uint64_t usec) {
+	if (!own)
+		return;
+
+	struct histogram_t *h = own->histograms + histogram;
+	++h->buckets[bucket_index(usec)];
+	h->sum += usec;
+}
+
+uint64_t metrics_now_us() {
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+	clock_gettime_impl(&ts);
+#endif
+
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// slots are written by other processes without locks: counters could be a bit behind, but never torn
+static void sum_slots(struct metrics_slot_t *total) {
+	memset(total, 0, sizeof(*total));
+
+	uint64_t *dst = (uint64_t *)total;
+	size_t n_words = sizeof(*total) / sizeof(uint64_t);
+
+	int i = 0;
+	for (; i < n_slots; ++i) {
+		const volatile uint64_t *src = (const volatile uint64_t *)(slots + i);
+
+		size_t j = 0;
+		for (; j < n_words; ++j)
+			dst[j] += src[j];
+	}
+}
+
+#define MK_COUNTER_TEXT(name, help) \
+	fprintf(f, "# HELP smtp_" #name "_total " help "\n# TYPE smtp_" #name "_total counter\n" \
+			"smtp_" #name "_total %llu\n", (unsigned long long)total->counters[METRIC_## name]);
+
+static void print_histogram(FILE *f, const char *name, const char *help, const struct histogram_t *h) {
+	fprintf(f, "# HELP smtp_%s_seconds %s\n# TYPE smtp_%s_seconds histogram\n", name, help, name);
+
+	uint64_t count = 0;
+	unsigned i = 0;
+	for (; i < N_FINITE_BUCKETS; ++i) {
+		count += h->buckets[i];
+		uint64_t le = bucket_upper_bound(i);
+		fprintf(f, "smtp_%s_seconds_bucket{le=\"%llu.%06llu\"} %llu\n", name,
+				(unsigned long long)(le / 1000000), (unsigned long long)(le % 1000000), (unsigned long long)count);
+	}
+
+	count += h->buckets[N_FINITE_BUCKETS];
+	fprintf(f, "smtp_%s_seconds_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+	fprintf(f, "smtp_%s_seconds_sum %llu.%06llu\n", name,
+			(unsigned long long)(h->sum / 1000000), (unsigned long long)(h->sum % 1000000));
+	fprintf(f, "smtp_%s_seconds_count %llu\n", name, (unsigned long long)count);
+}
+
+#define MK_HISTOGRAM_TEXT(name, help) \
+	print_histogram(f, #name, help, total->histograms + METRIC_## name);
+
+// Will return malloc'ed text or NULL on error
+static char *render_metrics(size_t *size) {
+	char *text = NULL;
+	FILE *f = open_memstream(&text, size);
+	if (!f) {
+		log_error("Can't open memory stream: %s", strerror(errno));
+		return NULL;
+	}
+
+	struct metrics_slot_t *total = (struct metrics_slot_t *)malloc(sizeof(*total));
+	if (!total) {
+		log_error("Can't allocate memory for metrics");
+		fclose(f);
+		free(text);
+		return NULL;
+	}
+
+	sum_slots(total);
+
+	METRICS_COUNTERS(MK_COUNTER_TEXT)
+
+	fprintf(f, "# HELP smtp_commands_total Commands received from clients\n# TYPE smtp_commands_total counter\n");
+
+	unsigned i = 0;
+	const char *verb = NULL;
+	for (; i < METRICS_MAX_COMMANDS && (verb = smtp_command_name(i)); ++i)
+		fprintf(f, "smtp_commands_total{verb=\"%s\"} %llu\n", verb, (unsigned long long)total->commands[i]);
+
+	METRICS_HISTOGRAMS(MK_HISTOGRAM_TEXT)
+
+	free(total);
+
+	if (fclose(f) != 0) {
+		log_error("Can't render metrics: %s", strerror(errno));
+		free(text);
+		return NULL;
+	}
+
+	return text;
+}
+
+static int is_http(const struct control_client_t *client) {
+	return client->used >= 4 && memcmp(client->buf, "GET ", 4) == 0;
+}
+
+// plain request is a single line (or nothing at all), HTTP request ends with an empty line
+static int request_complete(const struct control_client_t *client) {
+	if (client->eof || client->used == sizeof(client->buf))
+		return 1;
+
+	if (is_http(client))
+		return memmem(client->buf, client->used, STRSZ("\r\n\r\n")) != NULL;
+
+	return memchr(client->buf, '\n', client->used) != NULL;
+}
+
+// Will return 0 on success and -1 on error
+static int render_reply(struct control_client_t *client) {
+	size_t size = 0;
+	char *text = render_metrics(&size);
+	if (!text)
+		return -1;
+
+	if (!is_http(client)) {
+		client->reply = text;
+		client->reply_size = size;
+		return 0;
+	}
+
+	char header[256];
+	int len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\nConnection: close\r\n\r\n", size);
+
+	client->reply = (char *)malloc((size_t)len + size);
+	if (!client->reply) {
+		log_error("Can't allocate memory for metrics reply");
+		free(text);
+		return -1;
+	}
+
+	memcpy(client->reply, header, (size_t)len);
+	memcpy(client->reply + len, text, size);
+	client->reply_size = (size_t)len + size;
+
+	free(text);
+	return 0;
+}
+
+// Will return 0 when the whole reply was sent, 1 when socket buffer is full and -1 on error
+static int send_reply(struct control_client_t *client) {
+	while (client->sent < client->reply_size) {
+		ssize_t written = send(client->fd, client->reply + client->sent, client->reply_size - client->sent, MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+
+			log_warn("Can't send metrics: %s", strerror(errno));
+			return -1;
+		}
+
+		client->sent += (size_t)written;
+	}
+
+	return 0;
+}
+
+static void stop_timer(struct event_loop_t *loop) {
+	if (timer_id < 0)
+		return;
+
+	event_loop_del_timer(loop, timer_id);
+	timer_id = -1;
+}
+
+static void close_control_client(struct event_loop_t *loop, struct control_client_t *client) {
+	struct control_client_t **ptr = &control_clients;
+	for (; *ptr; ptr = &(*ptr)->next) {
+		if (*ptr == client) {
+			*ptr = client->next;
+			break;
+		}
+	}
+
+	if (!control_clients)
+		stop_timer(loop);
+
+	event_loop_del(loop, client->fd);
+	close(client->fd);
+	free(client->reply);
+	free(client);
+}
+
+// clients, which don't send request or don't read reply, would hold descriptors forever
+static void on_control_timer(struct event_loop_t *loop, void *arg) {
+	time_t now = coarse_clock_now();
+
+	struct control_client_t *client = control_clients;
+	while (client) {
+		struct control_client_t *next = client->next;
+		if (client->deadline <= now) {
+			log_info("Control client %d is idle for too long. Close connection", client->fd);
+			close_control_client(loop, client);
+		}
+
+		client = next;
+	}
+}
+
+static void on_control_client(struct event_loop_t *loop, int fd, uint32_t events, void *arg) {
+	struct control_client_t *client = (struct control_client_t *)arg;
+
+	if (client->reply) {
+		if (send_reply(client) != 1)
+			close_control_client(loop, client);
+		return;
+	}
+
+	while (client->used < sizeof(client->buf)) {
+		ssize_t received = read(fd, client->buf + client->used, sizeof(client->buf) - client->used);
+		if (received > 0) {
+			client->used += (size_t)received;
+			continue;
+		}
+
+		if (received == 0) {
+			client->eof = 1;
+			break;
+		}
+
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+
+		log_info("Can't read from control client %d: %s", fd, strerror(errno));
+		close_control_client(loop, client);
+		return;
+	}
+
+	if (!request_complete(client))
+		return;
+
+	log_debug("Sending metrics to control client %d", fd);
+	if (render_reply(client) != 0) {
+		close_control_client(loop, client);
+		return;
+	}
+
+	// reply is small, so it is sent at once usually
+	int ret = send_reply(client);
+	if (ret == 1 && event_loop_mod(loop, fd, EV_WRITE) == 0)
+		return;
+
+	close_control_client(loop, client);
+}
+
+static void on_control_sock(struct event_loop_t *loop, int fd, uint32_t events, void *arg) {
+	int client_sock = -1;
+	while ((client_sock = accept(fd, NULL, NULL)) >= 0) {
+		struct control_client_t *client = (struct control_client_t *)calloc(1, sizeof(*client));
+		if (!client) {
+			log_error("Can't allocate control client");
+			close(client_sock);
+			continue;
+		}
+
+		if (timer_id < 0 && (timer_id = event_loop_add_timer(loop, METRICS_TIMER_INTERVAL_MS, on_control_timer, NULL)) < 0) {
+			log_error("Can't start timer of control clients");
+			close(client_sock);
+			free(client);
+			continue;
+		}
+
+		client->fd = client_sock;
+		client->deadline = coarse_clock_now() + METRICS_CLIENT_TIMEOUT;
+		if (fcntl(client_sock, F_SETFL, fcntl(client_sock, F_GETFL, 0) | O_NONBLOCK) != 0
+			|| event_loop_add(loop, client_sock, EV_READ, on_control_client, client) != 0) {
+			log_error("Can't serve control client %d", client_sock);
+			close(client_sock);
+			free(client);
+
+			if (!control_clients)
+				stop_timer(loop);
+			continue;
+		}
+
+		client->next = control_clients;
+		control_clients = client;
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+		log_error("Can't accept control client: %s", strerror(errno));
+}
+
+int metrics_listen(const char *path) {
+	if (!*path)
+		return 0;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_error("Control socket path %s is too long", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		log_error("Can't create control socket: %s", strerror(errno));
+		return -1;
+	}
+
+	// socket of the previous run
+	if (unlink(path) != 0 && errno != ENOENT)
+		log_warn("Can't remove %s: %s", path, strerror(errno));
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, SOMAXCONN) != 0
+		|| fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) != 0) {
+		log_error("Can't listen on %s: %s", path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	log_info("Metrics are served on %s", path);
+
+	control_sock = sock;
+	return 0;
+}
+
+int metrics_serve(struct event_loop_t *loop) {
+	if (control_sock < 0)
+		return 0;
+
+	return event_loop_add(loop, control_sock, EV_READ | EV_EDGE, on_control_sock, NULL);
+}
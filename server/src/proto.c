@@ -1,21 +1,34 @@
 #include "proto.h"
+#include "common.h"
 #include "logger.h"
 #include "fsm.h"
 #include "config.h"
+#include "event_loop.h"
+#include "scanner.h"
+#include "smtp_command.h"
 
 #include "message.h"
+#include "spool.h"
+#include "smtp_path.h"
+#include "arena.h"
+#include "buffer_pool.h"
+#include "rcpt_db.h"
+#include "coarse_clock.h"
+#include "recipients.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <strings.h>
 #include <stdarg.h>
 #include <ctype.h>
-#include <pcre.h>
+#include <time.h>
 
 #if !defined(VERSION) || !defined(BUILD_YEAR) || !defined(DEVELOPERS) || !defined(PROJECT)
 #	error "Pass constants above via makefile"
@@ -25,12 +38,35 @@
 #	define BLOCK_SIZE 512
 #endif
 
+// reads grow up to this size while client sends data faster than we read it
+#ifndef READ_MAX_SIZE
+#	define READ_MAX_SIZE (64 * 1024)
+#endif
+
+// buffers larger than this are given back to the pool after message is received
+#ifndef BUFFER_SHRINK_SIZE
+#	define BUFFER_SHRINK_SIZE (8 * BLOCK_SIZE)
+#endif
+
+// recipients database is checked for updates not more often than once per this interval, in seconds
+#ifndef RCPT_DB_RELOAD_INTERVAL
+#	define RCPT_DB_RELOAD_INTERVAL 5
+#endif
+
+// memory of transaction is taken by blocks of this size
+#ifndef TRANSACTION_ARENA_SIZE
+#	define TRANSACTION_ARENA_SIZE 4096
+#endif
+
+// command line with CRLF (RFC 5321, 4.5.3.1.4). Longer lines close the session
+#ifndef COMMAND_LINE_MAX_SIZE
+#	define COMMAND_LINE_MAX_SIZE 512
+#endif
+
 #ifndef MESSAGE_MAX_SIZE
 #	define MESSAGE_MAX_SIZE (unsigned long)1025*1024
 #endif
 
-#define EMAIL_RE "(?:(?:@[a-zA-Z0-9-]+\\.[a-zA-Z0-9-.]+,?)*:)?([a-zA-Z0-9_.+-]+@[a-zA-Z0-9-]+\\.[a-zA-Z0-9-.]+)"
-#define RCPT_DELIM ", "
 
 enum {
 	ST_SERVICE_READY = 220,
@@ -46,51 +82,9 @@ enum {
 	ST_NO_SUCH_USER = 550,
 	ST_NO_MAIL_STORAGE = 552,
 	ST_TRANSACTION_FAILED = 554,
+	ST_INVALID_PARAMS_CMD = 555,
 };
 
-static void send_response_ex(int sock, const char *msg, size_t msg_size) {
-	log_trace("Sending to client %d: '%.*s'", sock, (int)msg_size, msg);
-	write(sock, msg, strlen(msg));
-}
-
-static int send_response(int sock, int status, const char *msg) {
-	char real_msg[4096] = "";
-	int printed = snprintf(real_msg, sizeof(real_msg), "%d %s", status, msg);
-
-	if (printed >= sizeof(real_msg))
-		log_error("Too long error message: %s, maximum %zu chars are expected", msg, sizeof(real_msg));
-	else if (printed < 0) {
-		log_error("Can't send error message: snprintf failed");
-		return -1;
-	}
-
-	send_response_ex(sock, real_msg, (size_t)printed);
-	write(sock, STRSZ("\r\n"));
-
-	return 0;
-}
-
-static void send_response_f(int sock, int status, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
-static void send_response_f(int sock, int status, const char *fmt, ...) {
-	char buf[4096];
-
-	va_list ap;
-	va_start(ap, fmt);
-	int ret = vsnprintf(buf, sizeof(buf), fmt, ap);
-	va_end(ap);
-
-	if (ret < 0) {
-		log_error("Can't printf: %s", strerror(errno));
-		send_response(sock, ST_LOCAL_ERR, "Local error in processing");
-		return;
-	}
-
-	if (ret > sizeof(buf))
-		log_error("Too small buf into send_response_f");
-
-	send_response(sock, status, buf);
-}
-
 struct client_error_t {
 	int status;
 	const char *msg;
@@ -102,32 +96,58 @@ struct buffer_t {
 	char *buf;
 };
 
+// transaction state. Strings are allocated from client arena and are dropped with transaction
 struct cli_info_t {
 	char *cli_domain;
-	char *cli_from;
-	char *cli_data;
+	char cli_from[SMTP_PATH_MAX_LEN + 1]; // empty for null reverse-path
 
-	struct buffer_t cli_recipients; // ; is delimiter
+	struct recipients_t cli_recipients;
 };
 
-static void init_buffer(struct buffer_t *buf) {
-	buf->allocated = BLOCK_SIZE;
+// buffers are taken from the pool, so sessions reuse memory of each other
+static int init_buffer(struct buffer_t *buf) {
 	buf->used = 0;
-	buf->buf = (char *)malloc(buf->allocated);
+	buf->buf = buffer_pool_get(BLOCK_SIZE, &buf->allocated);
 
-	assert(buf->buf);
+	return buf->buf ? 0 : -1;
 }
 
-static void expand_buffer(struct buffer_t *buf) {
-	buf->allocated *= 2;
-	buf->buf = (char *)realloc(buf->buf, buf->allocated);
+static void release_buffer(struct buffer_t *buf) {
+	buffer_pool_put(buf->buf, buf->allocated);
+	buf->buf = NULL;
+	buf->used = 0;
+	buf->allocated = 0;
+}
+
+// Will return 0 if buffer can hold size bytes and -1 on error
+static int reserve_buffer(struct buffer_t *buf, size_t size) {
+	if (buf->allocated >= size)
+		return 0;
+
+	size_t new_size = buf->allocated * 2;
+	if (new_size < size)
+		new_size = size;
+
+	return buffer_pool_resize(&buf->buf, &buf->allocated, buf->used, new_size);
+}
+
+// gives memory back to the pool when buffer grew much larger than its contents
+static void shrink_buffer(struct buffer_t *buf) {
+	if (buf->allocated <= BUFFER_SHRINK_SIZE || buf->used > BLOCK_SIZE)
+		return;
+
+	if (buffer_pool_resize(&buf->buf, &buf->allocated, buf->used, BLOCK_SIZE) == 0)
+		log_trace("Buffer was shrunk to %zu bytes", buf->allocated);
 }
 
 #define STATES(ARG, _) \
 	_(ARG, INIT, FSM_INIT_STATE) \
 	_(ARG, WELCOME_CLIENT) \
-	_(ARG, WAIT_DATA) \
+	_(ARG, WAIT_DATA, FSM_YIELD_STATE) \
 	_(ARG, READ_DATA) \
+	_(ARG, PARSE_DATA) \
+	_(ARG, PARSE_MESSAGE) \
+	_(ARG, SEND_REPLIES) \
 	_(ARG, WAIT_COMMAND) \
 	_(ARG, COMMAND_CAME) \
 	_(ARG, HELO_CAME) \
@@ -136,9 +156,9 @@ static void expand_buffer(struct buffer_t *buf) {
 	_(ARG, RCPT_CAME) \
 	_(ARG, DATA_CAME) \
 	_(ARG, RSET_CAME) \
-	_(ARG, RSET_CAME_AFTER) \
 	_(ARG, NEXT_CMD) \
 	_(ARG, PROCESS_DATA) \
+	_(ARG, WAIT_SYNC, FSM_YIELD_STATE) \
 	_(ARG, SYNTAX_ERR) \
 	_(ARG, SERVER_ERROR) \
 	_(ARG, SHOW_ERROR_AND_CLOSE) \
@@ -149,26 +169,187 @@ static void expand_buffer(struct buffer_t *buf) {
 struct client_t;
 FSM(smtp, STATES, struct client_t *);
 
-struct transaction_t;
 struct client_t {
 	int sock;
 
-	const char *delimiter;
-	unsigned short delimiter_size;
-
+	// buffers live as long as session: pipelined commands stay in input buffer after RSET
 	struct buffer_t buffer;
 	struct buffer_t cli_data;
+	struct buffer_t out; // replies, which were not sent yet
+	size_t read_size;
+
+	// message, which is being received now
+	struct message_t *message;
+	size_t message_size;
+	struct data_scanner_t scanner;
+	struct client_error_t data_error;
+
+	// committed message, reply is sent when it is synced to disk
+	char uidl[255];
+	struct spool_waiter_t spool_waiter;
+	uint8_t wait_sync;
+	int sync_status;
+
 	struct client_error_t cli_error;
 	struct cli_info_t cli_info;
+	struct arena_t arena; // transaction data, it is dropped with transaction
 
-	const struct transaction_t *cur_transaction;
-	const struct command_t *cur_command;
+	uint8_t seq; // position in mail transaction, see transitions
 
-	int32_t transaction_flags;
+	// metrics_now_us() when the oldest command without reply came, 0 if all replies were sent
+	uint64_t command_start;
+	uint32_t replies; // replies to commands, which are queued since command_start
+	uint64_t data_start; // DATA command came
 
 	FSM_STATE_TYPE(smtp) next_state;
+
+	// following fields are used when session is served by event loop.
+	// Session yields in WAIT_DATA when it would block and continues from it on next event
+	struct event_loop_t *loop;
+	FSM_CURSOR_TYPE(smtp) state;
+	uint8_t readable;
+	uint8_t writable;
+	uint8_t wait_writable; // EV_WRITE is requested from the loop
+
+	void (*on_done)(void *arg);
+	void *on_done_arg;
 };
 
+static void close_client_sock(struct client_t *cli) {
+	if (cli->sock < 0)
+		return;
+
+	if (cli->loop)
+		event_loop_del(cli->loop, cli->sock);
+
+	close(cli->sock);
+	cli->sock = -1;
+}
+
+static int buffer_append(struct buffer_t *buf, const char *data, size_t size) {
+	if (reserve_buffer(buf, buf->used + size) != 0)
+		return -1;
+
+	memcpy(buf->buf + buf->used, data, size);
+	buf->used += size;
+
+	return 0;
+}
+
+// formats string into the tail of the buffer. Will return 0 on success and -1 on error
+static int buffer_vprintf(struct buffer_t *buf, const char *fmt, va_list ap) {
+	while (1) {
+		va_list aq;
+		va_copy(aq, ap);
+		int printed = vsnprintf(buf->buf + buf->used, buf->allocated - buf->used, fmt, aq);
+		va_end(aq);
+
+		if (printed < 0)
+			return -1;
+
+		if ((size_t)printed < buf->allocated - buf->used) {
+			buf->used += (size_t)printed;
+			return 0;
+		}
+
+		if (reserve_buffer(buf, buf->used + (size_t)printed + 1) != 0)
+			return -1;
+	}
+}
+
+// Replies are formatted right into the output queue and sent all together when client should send next command.
+// sep is '-' for all lines of multiline reply except the last one and ' ' otherwise
+static void send_response_v(struct client_t *cli, int status, char sep, const char *fmt, va_list ap) {
+	struct buffer_t *out = &cli->out;
+	size_t start = out->used;
+
+	if (reserve_buffer(out, out->used + sizeof("000 ")) != 0) {
+		log_error("Can't send reply to client %d", cli->sock);
+		return;
+	}
+	out->used += (size_t)snprintf(out->buf + out->used, out->allocated - out->used, "%03d%c", status, sep);
+
+	if (buffer_vprintf(out, fmt, ap) != 0) {
+		log_error("Can't printf: %s", strerror(errno));
+		out->used = start;
+		buffer_append(out, STRSZ("451 Local error in processing\r\n"));
+		return;
+	}
+
+	log_trace("Sending to client %d: '%.*s'", cli->sock, (int)(out->used - start), out->buf + start);
+	if (buffer_append(out, STRSZ("\r\n")) != 0) {
+		out->used = start;
+		return;
+	}
+
+	if (sep == ' ' && cli->command_start)
+		++cli->replies;
+}
+
+static void send_response_f(struct client_t *cli, int status, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static void send_response_f(struct client_t *cli, int status, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	send_response_v(cli, status, ' ', fmt, ap);
+	va_end(ap);
+}
+
+// not last line of multiline reply
+static void send_response_cont_f(struct client_t *cli, int status, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static void send_response_cont_f(struct client_t *cli, int status, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	send_response_v(cli, status, '-', fmt, ap);
+	va_end(ap);
+}
+
+static void send_response(struct client_t *cli, int status, const char *msg) {
+	send_response_f(cli, status, "%s", msg);
+}
+
+// Will return 0 when all replies were sent, 1 when socket buffer is full and -1 on error.
+// Unsent tail is kept in the queue
+static int flush_responses(struct client_t *cli) {
+	struct buffer_t *out = &cli->out;
+	size_t sent = 0;
+	int ret = 0;
+
+	while (sent < out->used) {
+		ssize_t written = send(cli->sock, out->buf + sent, out->used - sent, MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				log_debug("Client %d doesn't read responses, %zu bytes are pending", cli->sock, out->used - sent);
+				ret = 1;
+				break;
+			}
+
+			log_info("Can't send response to client %d: %s", cli->sock, strerror(errno));
+			out->used = 0;
+			return -1;
+		}
+
+		sent += (size_t)written;
+	}
+
+	metrics_add(bytes_out, sent);
+
+	out->used -= sent;
+	if (out->used)
+		memmove(out->buf, out->buf + sent, out->used);
+	else if (cli->command_start) {
+		// pipelined commands came together with the oldest one, so each reply gets its time
+		uint64_t elapsed = metrics_now_us() - cli->command_start;
+		for (; cli->replies; --cli->replies)
+			metrics_observe(reply_time, elapsed);
+		cli->command_start = 0;
+	}
+
+	return ret;
+}
+
 FSM_CB(smtp, WELCOME_CLIENT, cli) {
 	int status = ST_SERVICE_READY;
 	if (cli->cli_error.msg) {
@@ -177,14 +358,14 @@ FSM_CB(smtp, WELCOME_CLIENT, cli) {
 
 	log_debug("Trying to welcome the client");
 
-	char welcome_str[4096] = "";
+	static char welcome_str[4096];
 	if (welcome_str[0] == '\0') {
 		log_trace("Creating welcome string");
 		snprintf(welcome_str, sizeof(welcome_str), "%s, " PROJECT ", v" VERSION ". Developed by " DEVELOPERS ", " BUILD_YEAR ". Ready", get_opt_hostname());
 		log_info("Setting welcome string to '%s'", welcome_str);
 	}
 
-	send_response(cli->sock, status, welcome_str);
+	send_response(cli, status, welcome_str);
 	if (cli->cli_error.msg)
 		return SHOW_ERROR_AND_CLOSE;
 
@@ -195,66 +376,57 @@ FSM_CB(smtp, SHOW_ERROR_AND_CLOSE, cli) {
 	if (!cli->cli_error.msg)
 		return NEXT_CMD;
 
-	send_response(cli->sock, cli->cli_error.status, cli->cli_error.msg);
+	send_response(cli, cli->cli_error.status, cli->cli_error.msg);
 	return CLOSE_CLIENT;
 }
 
 FSM_CB(smtp, WAIT_COMMAND, cli) {
 	cli->next_state = COMMAND_CAME;
-	return WAIT_DATA;
+	return PARSE_DATA;
 }
 
-struct command_t {
-	const char cmd[64];
-	size_t cmd_len;
-	FSM_STATE_TYPE(smtp) state;
-};
+// state to go for each command of smtp_command.h
+#define COMMAND_STATES(_) \
+	_(QUIT, CLOSE_CLIENT) \
+	_(RSET, RSET_CAME) \
+	_(HELO, HELO_CAME) \
+	_(EHLO, EHLO_CAME) \
+	_(MAIL, MAIL_CAME) \
+	_(RCPT, RCPT_CAME) \
+	_(DATA, DATA_CAME) \
 
-enum {
-	FL_ABORT_ACTIONS = 1,
-	FL_SHOULD_RETRY = 2,
-	FL_CAN_RETRY = 4,
+#define MK_CMD_STATE(name, state) [CMD_## name] = state,
+
+static const FSM_STATE_TYPE(smtp) command_states[CMD_MAX] = {
+	COMMAND_STATES(MK_CMD_STATE)
 };
 
-struct transaction_t {
-	struct command_t commands[64]; // MAX COMMANDS
-	size_t commands_count;
-	struct command_t *cur_command;
+#undef MK_CMD_STATE
 
-	uint32_t flags;
+// Commands sequence. MAIL and RCPT handlers promote *_RETRY state to *_DONE on success,
+// so failed command should be sent again
+enum {
+	SEQ_DENY = 0,
+	SEQ_IDLE,
+	SEQ_MAIL_RETRY,
+	SEQ_MAIL_DONE,
+	SEQ_RCPT_RETRY,
+	SEQ_RCPT_DONE,
+	SEQ_MAX,
 };
 
-#define CMDL(name) .cmd = name, .cmd_len = sizeof(name) - 1
-
-static const struct transaction_t transactions[] = {
-	{
-		.commands = {
-			{ CMDL("QUIT"), .state = CLOSE_CLIENT, },
-			{ CMDL("RSET"), .state = RSET_CAME, },
-		},
-		.commands_count = 2,
-		.flags = FL_ABORT_ACTIONS,
-	}, {
-		.commands = {
-			{ CMDL("HELO"), .state = HELO_CAME, },
-		},
-		.commands_count = 1,
-	}, {
-		.commands = {
-			{ CMDL("EHLO"), .state = EHLO_CAME, },
-		},
-		.commands_count = 1,
-	}, {
-		.commands = {
-			{ CMDL("MAIL"), .state = MAIL_CAME, },
-			{ CMDL("RCPT"), .state = RCPT_CAME, },
-			{ CMDL("DATA"), .state = DATA_CAME, },
-		},
-		.commands_count = 3,
-	},
+#define ANY_TIME(seq) [CMD_QUIT] = seq, [CMD_RSET] = SEQ_IDLE
+
+// state after command came, SEQ_DENY if command is out of sequence
+static const uint8_t transitions[SEQ_MAX][CMD_MAX] = {
+	[SEQ_IDLE] = { ANY_TIME(SEQ_IDLE), [CMD_HELO] = SEQ_IDLE, [CMD_EHLO] = SEQ_IDLE, [CMD_MAIL] = SEQ_MAIL_RETRY, },
+	[SEQ_MAIL_RETRY] = { ANY_TIME(SEQ_MAIL_RETRY), [CMD_MAIL] = SEQ_MAIL_RETRY, },
+	[SEQ_MAIL_DONE] = { ANY_TIME(SEQ_MAIL_DONE), [CMD_RCPT] = SEQ_RCPT_RETRY, },
+	[SEQ_RCPT_RETRY] = { ANY_TIME(SEQ_RCPT_RETRY), [CMD_RCPT] = SEQ_RCPT_RETRY, },
+	[SEQ_RCPT_DONE] = { ANY_TIME(SEQ_RCPT_DONE), [CMD_RCPT] = SEQ_RCPT_RETRY, [CMD_DATA] = SEQ_IDLE, },
 };
 
-#undef CMDL
+#undef ANY_TIME
 
 FSM_CB(smtp, COMMAND_CAME, cli) {
 	struct buffer_t *buf = &cli->cli_data;
@@ -264,8 +436,11 @@ FSM_CB(smtp, COMMAND_CAME, cli) {
 		return WAIT_COMMAND;
 	}
 
+	if (!cli->command_start)
+		cli->command_start = metrics_now_us();
+
 	log_debug("Trying to parse came command: %.*s", (int)buf->used, buf->buf);
-	const char *delim = strnstr(buf->buf, " ", buf->used);
+	const char *delim = scan_byte(buf->buf, buf->used, ' ');
 	uint8_t space_found = 1;
 
 	if (!delim) {
@@ -274,71 +449,33 @@ FSM_CB(smtp, COMMAND_CAME, cli) {
 		space_found = 0;
 	}
 
-	const struct transaction_t *transaction = NULL;
-	const struct command_t *command = NULL;
-
-	int i = 0;
 	size_t cli_cmd_len = (size_t)(delim - buf->buf);
-	for (; !transaction && i < VSIZE(transactions); ++i) {
-		int j = 0;
-		const struct transaction_t *cur_transaction = transactions + i;
-		for (; !command && j < cur_transaction->commands_count; ++j) {
-			const struct command_t *cmd = cur_transaction->commands + j;
-			if (cli_cmd_len == cmd->cmd_len && (strncasecmp(cmd->cmd, buf->buf, cli_cmd_len) == 0)) {
-				log_trace("Command recognized as %.*s", (int)cli_cmd_len, cmd->cmd);
-				command = cmd;
-				transaction = cur_transaction;
-			}
-		}
-	}
+	enum smtp_command_t command = find_smtp_command(buf->buf, cli_cmd_len);
+	metrics_command(command);
 
-	if (!transaction || !command) {
+	if (command == CMD_UNKNOWN) {
 		log_debug("Invalid command came: %.*s", (int)cli_cmd_len, buf->buf);
-		send_response(cli->sock, ST_SYNTAX_ERR, "Unknown command");
+		send_response(cli, ST_SYNTAX_ERR, "Unknown command");
 		return NEXT_CMD;
 	}
 
-	if (cli->cur_transaction && cli->cur_command == &cli->cur_transaction->commands[cli->cur_transaction->commands_count - 1]) {
-		log_trace("Transaction ended");
-		cli->cur_transaction = NULL;
-		cli->cur_command = NULL;
-	}
-
-	if (transaction->flags & FL_ABORT_ACTIONS) {
-		log_debug("Abort action came");
-		return command->state;
-	}
-
-	// cur transaction and cur command should be both set or not set
-	assert(!cli->cur_transaction == !cli->cur_command);
-
-	int32_t flags = cli->transaction_flags;
-	cli->transaction_flags = 0;
-
-	if ((flags & FL_CAN_RETRY) != 0 && command == cli->cur_command)
-		log_debug("Retry last command");
-	else if (((flags & FL_SHOULD_RETRY) != 0 && command != cli->cur_command)
-		|| ((flags & FL_SHOULD_RETRY) == 0
-			&& ((cli->cur_transaction && (transaction != cli->cur_transaction || command <= cli->cur_command || command != cli->cur_command + 1))
-			|| (!cli->cur_transaction && command != &transaction->commands[0])))) {
-		send_response(cli->sock, ST_IN_TRANSACTION, "Command out of sequence; try again later");
+	uint8_t seq = transitions[cli->seq][command];
+	if (seq == SEQ_DENY) {
+		send_response(cli, ST_IN_TRANSACTION, "Command out of sequence; try again later");
 		return NEXT_CMD;
 	}
 
-	cli->cur_transaction = transaction;
-	cli->cur_command = command;
+	log_trace("Command recognized as %.*s", (int)cli_cmd_len, buf->buf);
+	cli->seq = seq;
 
 	buf->used -= cli_cmd_len + space_found; // next space should be removed
 	memmove(buf->buf, buf->buf + cli_cmd_len + space_found, buf->used);
 
-	FSM_STATE_TYPE(smtp) next_state = command->state;
-	assert(next_state);
-
-	return next_state;
+	return command_states[command];
 }
 
 FSM_CB(smtp, SYNTAX_ERR, cli) {
-	send_response(cli->sock, ST_SYNTAX_ERR, "Syntax error");
+	send_response(cli, ST_SYNTAX_ERR, "Syntax error");
 	return NEXT_CMD;
 }
 
@@ -363,12 +500,19 @@ static int set_client_domain(struct client_t *cli) {
 
 	if (cli->cli_info.cli_domain) {
 		log_info("Domain is already set");
-		send_response(cli->sock, ST_SYNTAX_ERR, "Unknown command");
+		send_response(cli, ST_SYNTAX_ERR, "Unknown command");
 		return -1;
 	}
 
-	cli->cli_info.cli_domain = (char *)malloc(buf->used + 1);
-	snprintf(cli->cli_info.cli_domain, buf->used + 1, "%.*s", (int)buf->used, buf->buf);
+	char *domain = (char *)arena_alloc(&cli->arena, buf->used + 1);
+	if (!domain) {
+		send_response(cli, ST_LOCAL_ERR, "Requested action aborted: local error in processing");
+		return -1;
+	}
+
+	memcpy(domain, buf->buf, buf->used);
+	domain[buf->used] = '\0';
+	cli->cli_info.cli_domain = domain;
 
 	log_info("Client domain was set to %s", cli->cli_info.cli_domain);
 
@@ -382,53 +526,53 @@ FSM_CB(smtp, HELO_CAME, cli) {
 	if (ret > 0)
 		return SYNTAX_ERR;
 	if (ret == 0)
-		send_response_f(cli->sock, ST_MAILING_OK, "%s ready to serve", get_opt_hostname());
+		send_response_f(cli, ST_MAILING_OK, "%s ready to serve", get_opt_hostname());
 
 	return NEXT_CMD;
 }
 
-static pcre *from_re = NULL;
-static pcre *rcpt_re = NULL;
-
-__attribute__((destructor))
-static void pcre_cleanup() {
-	if (from_re)
-		pcre_free(from_re);
-	if (rcpt_re)
-		pcre_free(rcpt_re);
-}
+// will return 0 if parameters are supported, reply is sent otherwise
+static int check_mail_params(struct client_t *cli, const struct smtp_path_t *path) {
+	size_t i = 0;
+	for (; i < path->n_params; ++i) {
+		const struct smtp_param_t *param = path->params + i;
+
+		if (param->keyword_len == sizeof("SIZE") - 1 && strncasecmp(param->keyword, "SIZE", param->keyword_len) == 0 && param->value) {
+			unsigned long size = 0;
+			size_t j = 0;
+			for (; j < param->value_len && isdigit((unsigned char)param->value[j]) && size <= MESSAGE_MAX_SIZE; ++j)
+				size = size * 10 + (unsigned long)(param->value[j] - '0');
+
+			if (j < param->value_len && !isdigit((unsigned char)param->value[j])) {
+				send_response(cli, ST_INVALID_PARAMS, "Syntax error in SIZE parameter");
+				return -1;
+			}
 
-static char *exec_email_re(pcre *re, const char *data, size_t data_len, int *len) {
-	int ovec[24];
-	int ovecsize = VSIZE(ovec);
+			if (size > MESSAGE_MAX_SIZE) {
+				send_response(cli, ST_NO_MAIL_STORAGE, "Message size exceeds fixed maximum message size");
+				return -1;
+			}
 
-	int rc = pcre_exec(re, 0, data, (int)data_len, 0, 0, ovec, ovecsize);
+			continue;
+		}
 
-	int off = ovec[2];
-	*len = ovec[3] - ovec[2];
-	if (rc < 0) {
-		log_info("Invalid command came, data == '%.*s'", (int)data_len, data);
-		*len = -1;
-		return NULL;
-	}
+		// message is stored as is, both bodies are accepted
+		if (param->keyword_len == sizeof("BODY") - 1 && strncasecmp(param->keyword, "BODY", param->keyword_len) == 0 && param->value
+				&& ((param->value_len == sizeof("7BIT") - 1 && strncasecmp(param->value, "7BIT", param->value_len) == 0)
+				|| (param->value_len == sizeof("8BITMIME") - 1 && strncasecmp(param->value, "8BITMIME", param->value_len) == 0)))
+			continue;
 
-	if (*len == 0) {
-		log_info("Empty addr found cmd");
-		return "";
+		log_info("Unsupported parameter %.*s", (int)param->keyword_len, param->keyword);
+		send_response(cli, ST_INVALID_PARAMS_CMD, "Parameters not recognized or not implemented");
+		return -1;
 	}
 
-	char *ret = malloc((size_t)*len + 1);
-	snprintf(ret, (size_t)*len + 1, "%.*s", *len, data + off);
-
-	log_debug("Email was recognized as '%s'", ret);
-	return ret;
+	return 0;
 }
 
 FSM_CB(smtp, MAIL_CAME, cli) {
 	log_debug("MAIL command came");
 
-	cli->transaction_flags |= FL_SHOULD_RETRY;
-
 	struct buffer_t *buf = &cli->cli_data;
 	if (buf->used == 0) {
 		log_info("MAIL command came without args");
@@ -437,43 +581,68 @@ FSM_CB(smtp, MAIL_CAME, cli) {
 
 	log_trace("MAIL request: '%.*s'", (int)buf->used, buf->buf);
 
-	if (!from_re) {
-		const char *err;
-		int err_off;
-
-		from_re = pcre_compile("^from: ?<" EMAIL_RE "?>$", PCRE_CASELESS, &err, &err_off, NULL);
-
-		if (!from_re) {
-			log_error("pcre_compile failed (offset: %d), %s", err_off, err);
-			return SERVER_ERROR;
-		}
+	struct smtp_path_t path;
+	if (parse_smtp_path(buf->buf, buf->used, "FROM:", SMTP_PATH_NULL_ALLOWED, &path) != 0) {
+		log_info("Invalid command came, data == '%.*s'", (int)buf->used, buf->buf);
+		return SYNTAX_ERR;
 	}
 
-	int len = 0;
-	char *ret = exec_email_re(from_re, buf->buf, buf->used, &len);
-	if (len < 0)
-		return SYNTAX_ERR;
-	if (len)
-		cli->cli_info.cli_from = ret;
+	if (check_mail_params(cli, &path) != 0)
+		return NEXT_CMD;
+
+	memcpy(cli->cli_info.cli_from, path.mailbox, path.mailbox_len);
+	cli->cli_info.cli_from[path.mailbox_len] = '\0';
 
-	send_response_f(cli->sock, ST_MAILING_OK, "Sender <%.*s> Ok", len, cli->cli_info.cli_from);
-	cli->transaction_flags &= ~FL_SHOULD_RETRY;
+	send_response_f(cli, ST_MAILING_OK, "Sender <%s> Ok", cli->cli_info.cli_from);
+	cli->seq = SEQ_MAIL_DONE;
 
 	return NEXT_CMD;
 }
 
-static void free_str(char **str) {
-	if (str && *str)
-		free(*str);
-}
+static struct rcpt_db_t rcpt_db;
+static time_t rcpt_db_checked = 0;
+
+// Will return 0 if recipient is accepted, 1 if there is no such user and -1 if it can't be checked now
+static int check_recipient(const char *user, size_t len) {
+	const char *path = get_opt_recipients_db();
+	if (!*path)
+		return 0; // recipients are not checked
 
-static int user_exists(const char *user, size_t len) {
-	return 0; // user exists
+	const char *at = rscan_byte(user, len, '@');
+	if (!at)
+		return 0; // Postmaster
+
+	// database is mapped lazily: workers close all descriptors on start
+	time_t now = coarse_clock_now();
+	if (now - rcpt_db_checked >= RCPT_DB_RELOAD_INTERVAL) {
+		rcpt_db_checked = now;
+		rcpt_db_reload(&rcpt_db, path);
+	}
+
+	if (!rcpt_db.data)
+		return -1;
+
+	if (rcpt_db_lookup(&rcpt_db, user, len) & RCPT_DB_MAILBOX)
+		return 0;
+
+	size_t local_len = (size_t)(at - user);
+	int flags = rcpt_db_lookup(&rcpt_db, at + 1, len - local_len - 1);
+	if (flags & RCPT_DB_CATCH_ALL)
+		return 0;
+
+	// postmaster of each local domain should exist (RFC 5321, 4.5.1)
+	if ((flags & RCPT_DB_DOMAIN) && local_len == sizeof("postmaster") - 1 && strncasecmp(user, "postmaster", local_len) == 0)
+		return 0;
+
+	return 1;
 }
 
 FSM_CB(smtp, RCPT_CAME, cli) {
 	log_debug("RCPT command came");
-	cli->transaction_flags |= FL_SHOULD_RETRY;
+
+	// failed RCPT doesn't cancel recipients, which were accepted before: message still can be sent to them
+	if (cli->cli_info.cli_recipients.n_items)
+		cli->seq = SEQ_RCPT_DONE;
 
 	struct buffer_t *buf = &cli->cli_data;
 	if (buf->used == 0) {
@@ -483,95 +652,162 @@ FSM_CB(smtp, RCPT_CAME, cli) {
 
 	log_trace("RCPT request: '%.*s'", (int)buf->used, buf->buf);
 
-	if (!rcpt_re) {
-		const char *err;
-		int err_off;
-
-		rcpt_re = pcre_compile("^to: ?<" EMAIL_RE ">$", PCRE_CASELESS, &err, &err_off, NULL);
+	struct smtp_path_t path;
+	if (parse_smtp_path(buf->buf, buf->used, "TO:", SMTP_PATH_POSTMASTER, &path) != 0) {
+		log_info("Invalid command came, data == '%.*s'", (int)buf->used, buf->buf);
+		return SYNTAX_ERR;
+	}
 
-		if (!rcpt_re) {
-			log_error("pcre_compile failed (offset: %d), %s", err_off, err);
-			return SERVER_ERROR;
-		}
+	// no RCPT parameters are supported
+	if (path.n_params) {
+		send_response(cli, ST_INVALID_PARAMS_CMD, "Parameters not recognized or not implemented");
+		return NEXT_CMD;
 	}
 
-	int len = 0;
-	char *ret __attribute__((cleanup(free_str))) = exec_email_re(rcpt_re, buf->buf, buf->used, &len);
-	if (len < 0 || len > 256)
-		return SYNTAX_ERR;
+	const char *rcpt = path.mailbox;
+	int len = (int)path.mailbox_len;
 
-	if (user_exists(ret, (size_t)len) != 0) {
-		send_response(cli->sock, ST_NO_SUCH_USER, "No such user!");
-		log_info("No such user: %.*s", len, ret);
+	int checked = check_recipient(rcpt, (size_t)len);
+	if (checked < 0) {
+		send_response(cli, ST_LOCAL_ERR, "Requested action aborted: local error in processing");
 		return NEXT_CMD;
 	}
 
-	struct buffer_t *rcpts = &cli->cli_info.cli_recipients;
-	while (rcpts->allocated < rcpts->used + (size_t)len + sizeof(RCPT_DELIM))
-		expand_buffer(rcpts);
+	if (checked > 0) {
+		send_response(cli, ST_NO_SUCH_USER, "No such user!");
+		log_info("No such user: %.*s", len, rcpt);
+		return NEXT_CMD;
+	}
 
-	memcpy(rcpts->buf + rcpts->used, ret, (size_t)len);
-	memcpy(rcpts->buf + rcpts->used + len, RCPT_DELIM, sizeof(RCPT_DELIM) - 1);
+	struct recipients_t *rcpts = &cli->cli_info.cli_recipients;
+	if (rcpts->n_items >= (size_t)get_opt_max_recipients()) {
+		send_response(cli, ST_NO_LOCAL_STORAGE, "Too many recipients");
+		return NEXT_CMD;
+	}
 
-	rcpts->used += (size_t)len + sizeof(RCPT_DELIM) - 1;
+	int ret = recipients_add(rcpts, rcpt, (size_t)len);
+	if (ret < 0) {
+		send_response(cli, ST_LOCAL_ERR, "Requested action aborted: local error in processing");
+		return NEXT_CMD;
+	}
 
-	cli->transaction_flags &= ~FL_SHOULD_RETRY;
-	cli->transaction_flags |= FL_CAN_RETRY;
+	cli->seq = SEQ_RCPT_DONE;
 
-	send_response_f(cli->sock, ST_MAILING_OK, "Recipient <%.*s> Ok", len, ret);
+	send_response_f(cli, ST_MAILING_OK, "Recipient <%.*s> Ok%s", len, rcpt, ret > 0 ? ", duplicate is ignored" : "");
 
 	return NEXT_CMD;
 }
 
 static void clear_sendmail_transaction(struct client_t *cli) {
-	safe_free(cli->cli_info.cli_from);
-	safe_free(cli->cli_info.cli_data);
-	safe_free(cli->cli_info.cli_domain);
+	if (cli->message) {
+		message_abort(cli->message);
+		cli->message = NULL;
+	}
+
+	cli->cli_info.cli_from[0] = '\0';
+	cli->cli_info.cli_domain = NULL;
+
+	recipients_clear(&cli->cli_info.cli_recipients);
+	arena_reset(&cli->arena);
+}
+
+// message got its final reply
+static void count_message(struct client_t *cli, int accepted) {
+	if (accepted) {
+		metrics_add(messages_accepted, 1);
+		metrics_add(spool_bytes, cli->message_size);
+	} else {
+		metrics_add(messages_rejected, 1);
+	}
 
-	cli->cli_info.cli_recipients.used = 0;
-	cli->delimiter = "\r\n";
-	cli->delimiter_size = 2;
+	metrics_observe(data_duration, metrics_now_us() - cli->data_start);
 }
 
 FSM_CB(smtp, DATA_CAME, cli) {
-	cli->delimiter = "\r\n.\r\n";
-	cli->delimiter_size = 5;
+	cli->data_start = metrics_now_us();
+	cli->message_size = 0;
 
-	struct buffer_t *buf = &cli->buffer;
-	while (buf->allocated < buf->used + 2)
-		expand_buffer(buf);
+	cli->message = message_begin(cli->cli_info.cli_from, &cli->cli_info.cli_recipients);
+	if (!cli->message) {
+		send_response(cli, ST_LOCAL_ERR, "Requested action aborted: local error in processing");
+		count_message(cli, 0);
+		clear_sendmail_transaction(cli);
+		return NEXT_CMD;
+	}
 
-	// TODO: process dot as first sym
-	memmove(buf->buf + 2, buf->buf, buf->used);
-	memcpy(buf->buf, "\r\n", 2); // small hack to simplify delimiter finding
-	buf->used += 2;
+	cli->data_error.status = 0;
+	cli->data_error.msg = NULL;
+
+	scan_data_init(&cli->scanner);
 
 	log_info("Reading data");
-	send_response(cli->sock, ST_START_DATA, "Start mail input; end with <CRLF>.<CRLF>");
+	send_response(cli, ST_START_DATA, "Start mail input; end with <CRLF>.<CRLF>");
 
 	cli->next_state = PROCESS_DATA;
 	cli->cli_data.used = 0;
 
-	return WAIT_DATA;
+	return PARSE_DATA;
+}
+
+static void run_session(struct client_t *cli);
+
+static void on_spool_synced(void *arg, int status) {
+	struct client_t *cli = (struct client_t *)arg;
+
+	cli->wait_sync = 0;
+	cli->sync_status = status;
+
+	run_session(cli);
 }
 
 FSM_CB(smtp, PROCESS_DATA, cli) {
-	struct buffer_t *buf = &cli->cli_data;
-	log_trace("Data came: %.*s", (int)buf->used, buf->buf);
+	log_debug("Message of %zu bytes came", cli->message_size);
 
-	cli->cli_info.cli_recipients.used -= sizeof(RCPT_DELIM) - 1;
-	cli->cli_info.cli_recipients.buf[cli->cli_info.cli_recipients.used] = '\0';
+	// end of data waits for reply as any command
+	if (!cli->command_start)
+		cli->command_start = metrics_now_us();
 
-	char uidl[255];
-	// ignore first \r\n chars
-	if (mk_message(buf->buf + 2, buf->used, cli->cli_info.cli_from, cli->cli_info.cli_recipients.buf, uidl, sizeof(uidl)) != 0) {
+	struct message_t *message = cli->message;
+	cli->message = NULL;
+
+	// large message was read by large chunks, they are not needed anymore
+	cli->read_size = BLOCK_SIZE;
+	shrink_buffer(&cli->buffer);
+
+	uint64_t ticket = 0;
+	if (!message) {
+		log_warn("Message not accepted: %s", cli->data_error.msg);
+		send_response(cli, cli->data_error.status, cli->data_error.msg);
+	} else if (message_commit(message, cli->uidl, sizeof(cli->uidl), &ticket) != 0) {
 		log_warn("Message not accepted");
-		send_response(cli->sock, ST_TRANSACTION_FAILED, "Transaction failed");
+		send_response(cli, ST_TRANSACTION_FAILED, "Transaction failed");
+	} else if (spool_wait(cli->loop, &cli->spool_waiter, ticket, on_spool_synced, cli) != 0) {
+		log_error("Can't wait for message %s to be synced", cli->uidl);
+		send_response(cli, ST_LOCAL_ERR, "Requested action aborted: local error in processing");
+	} else {
+		// reply only when message is on disk
+		cli->wait_sync = 1;
+		return WAIT_SYNC;
+	}
+
+	count_message(cli, 0);
+	clear_sendmail_transaction(cli);
+	return NEXT_CMD;
+}
+
+FSM_CB(smtp, WAIT_SYNC, cli) {
+	if (cli->wait_sync)
+		return WAIT_SYNC;
+
+	if (cli->sync_status != 0) {
+		log_warn("Message with uidl %s was not synced", cli->uidl);
+		send_response(cli, ST_LOCAL_ERR, "Requested action aborted: local error in processing");
 	} else {
-		log_warn("Message with uidl %s was accepted", uidl);
-		send_response_f(cli->sock, ST_MAILING_OK, "OK, message accepted for delivery: queued as %s", uidl);
+		log_warn("Message with uidl %s was accepted", cli->uidl);
+		send_response_f(cli, ST_MAILING_OK, "OK, message accepted for delivery: queued as %s", cli->uidl);
 	}
 
+	count_message(cli, cli->sync_status == 0);
 	clear_sendmail_transaction(cli);
 	return NEXT_CMD;
 }
@@ -585,44 +821,25 @@ FSM_CB(smtp, SERVER_ERROR, cli) {
 FSM_CB(smtp, EHLO_CAME, cli) {
 	log_debug("EHLO command came");
 
-#define add_to_resp(fmt, ...) ({ \
-	int _pr = snprintf(resp + printed, sizeof(resp) - printed, fmt "\r\n", ##__VA_ARGS__); \
-	if (_pr < 0 || (size_t)_pr > sizeof(resp) - printed) { \
-		log_error("Can't snprintf: %s", strerror(errno)); \
-		return SERVER_ERROR; \
-	} \
-	printed += (unsigned)_pr; \
-})
-
 	int ret = set_client_domain(cli);
 	if (ret > 0)
 		return SYNTAX_ERR;
 	if (ret == 0) {
-		char resp[4096];
-		unsigned printed = 0;
-
-		add_to_resp("%d-%s ready to serve", ST_MAILING_OK, get_opt_hostname());
-		add_to_resp("%d-8BITMIME", ST_MAILING_OK);
-		add_to_resp("%d SIZE %lu", ST_MAILING_OK, MESSAGE_MAX_SIZE);
-
-		send_response_ex(cli->sock, resp, printed);
+		send_response_cont_f(cli, ST_MAILING_OK, "%s ready to serve", get_opt_hostname());
+		send_response_cont_f(cli, ST_MAILING_OK, "8BITMIME");
+		send_response_cont_f(cli, ST_MAILING_OK, "PIPELINING");
+		send_response_f(cli, ST_MAILING_OK, "SIZE %lu", MESSAGE_MAX_SIZE);
 	}
 
-#undef add_to_resp
-
 	return NEXT_CMD;
 }
 
-FSM_CB(smtp, RSET_CAME_AFTER, cli) {
-	cli->next_state = NEXT_CMD;
-	send_response(cli->sock, ST_MAILING_OK, "Ok");
-
-	return INIT;
-}
-
 FSM_CB(smtp, RSET_CAME, cli) {
-	cli->next_state = RSET_CAME_AFTER;
-	return FREE_MEM;
+	// input buffer should be kept: pipelined commands could be there
+	clear_sendmail_transaction(cli);
+
+	send_response(cli, ST_MAILING_OK, "Ok");
+	return NEXT_CMD;
 }
 
 FSM_CB(smtp, NEXT_CMD, cli) {
@@ -631,6 +848,17 @@ FSM_CB(smtp, NEXT_CMD, cli) {
 }
 
 FSM_CB(smtp, WAIT_DATA, cli) {
+	if (cli->out.used)
+		return cli->writable ? SEND_REPLIES : WAIT_DATA;
+
+	if (cli->loop) {
+		// edge-triggered socket: read until EAGAIN before going to sleep
+		if (cli->readable)
+			return READ_DATA;
+
+		return WAIT_DATA;
+	}
+
 	fd_set read_set, err_set;
 
 	FD_ZERO(&read_set);
@@ -642,13 +870,13 @@ FSM_CB(smtp, WAIT_DATA, cli) {
 	int ret = select(FD_SETSIZE, &read_set, NULL, &err_set, NULL);
 	if (ret < 0) {
 		log_error("select failed: %s", strerror(errno));
-		close(cli->sock);
+		close_client_sock(cli);
 		return FREE_MEM;
 	}
 
 	if (FD_ISSET(cli->sock, &err_set)) {
 		log_info("Client %d was gone. Close connection", cli->sock);
-		close(cli->sock);
+		close_client_sock(cli);
 		return FREE_MEM;
 	}
 
@@ -662,21 +890,32 @@ FSM_CB(smtp, WAIT_DATA, cli) {
 
 FSM_CB(smtp, READ_DATA, cli) {
 	struct buffer_t *buf = &cli->buffer;
-	while (buf->allocated < buf->used + BLOCK_SIZE)
-		expand_buffer(buf);
+	if (reserve_buffer(buf, buf->used + cli->read_size) != 0) {
+		cli->cli_error.msg = "Local error in processing";
+		cli->cli_error.status = ST_LOCAL_ERR;
+		return SHOW_ERROR_AND_CLOSE;
+	}
+
+	ssize_t received = 0;
+	do {
+		// data is already queued, so no new edge would come for it
+		received = read(cli->sock, buf->buf + buf->used, cli->read_size);
+	} while (received < 0 && errno == EINTR);
 
-	ssize_t received = read(cli->sock, buf->buf + buf->used, buf->allocated - buf->used);
 	if (received == 0) {
 		log_info("Client %d was gone. Close connection", cli->sock);
-		close(cli->sock);
+		close_client_sock(cli);
 
 		cli->next_state = NULL;
 		return FREE_MEM;
 	}
 	if (received < 0) {
-		log_info("Error happen on read(): %s", strerror(errno));
-		if (errno == EAGAIN)
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			cli->readable = 0;
 			return WAIT_DATA;
+		}
+
+		log_info("Error happen on read(): %s", strerror(errno));
 		log_info("Can't process error happened. Close connection %d", cli->sock);
 
 		cli->cli_error.msg = "can't read";
@@ -685,33 +924,83 @@ FSM_CB(smtp, READ_DATA, cli) {
 	}
 
 	buf->used += (size_t)received;
+	log_trace("%zd bytes received from %d", received, cli->sock);
+	metrics_add(bytes_in, (uint64_t)received);
 
-	if (buf->used > MESSAGE_MAX_SIZE) {
-		log_warn("Too large chunk found in request. Abort");
-		int status = ST_NO_LOCAL_STORAGE;
-		const char *msg = "Requested action not taken: insufficient system storage. Transaction aborted";
-		if (cli->next_state && cli->next_state == PROCESS_DATA) {
-			status = ST_NO_MAIL_STORAGE;
-			msg = "Requested mail action aborted: exceeded storage allocation";
-		}
+	// whole window was filled: client sends faster than we read, read more next time
+	if ((size_t)received == cli->read_size && cli->read_size < READ_MAX_SIZE)
+		cli->read_size *= 2;
 
-		send_response(cli->sock, status, msg);
-		clear_sendmail_transaction(cli);
+	return PARSE_DATA;
+}
 
-		return NEXT_CMD;
+static void store_message_data(struct client_t *cli, const char *data, size_t size) {
+	if (!cli->message)
+		return; // message was rejected, skip data until the end
+
+	cli->message_size += size;
+
+	int ret = 1;
+	if (cli->message_size > MESSAGE_MAX_SIZE)
+		log_warn("Too large message came. Abort");
+	else if ((ret = message_write(cli->message, data, size)) == 0)
+		return;
+
+	if (ret > 0) {
+		cli->data_error.status = ST_NO_MAIL_STORAGE;
+		cli->data_error.msg = "Requested mail action aborted: exceeded storage allocation";
+	} else {
+		cli->data_error.status = ST_LOCAL_ERR;
+		cli->data_error.msg = "Requested action aborted: local error in processing";
 	}
 
-	char *delimiter_ptr = (char *)memmem(buf->buf, buf->used, cli->delimiter, cli->delimiter_size);
+	message_abort(cli->message);
+	cli->message = NULL;
+}
+
+// Message is written to the spool as it comes. Only the tail, which can't be recognized without the next chunk
+// (2 bytes at most, see scan_data()), is kept in the buffer
+FSM_CB(smtp, PARSE_MESSAGE, cli) {
+	struct buffer_t *buf = &cli->buffer;
+
+	size_t data_len = 0;
+	int end = 0;
+	size_t consumed = scan_data(&cli->scanner, buf->buf, buf->used, &data_len, &end);
+
+	if (data_len)
+		store_message_data(cli, buf->buf, data_len);
+
+	buf->used -= consumed;
+	memmove(buf->buf, buf->buf + consumed, buf->used);
+
+	if (!end)
+		return SEND_REPLIES;
+
+	cli->next_state = NULL;
+	return PROCESS_DATA;
+}
+
+FSM_CB(smtp, PARSE_DATA, cli) {
+	if (cli->next_state == PROCESS_DATA)
+		return PARSE_MESSAGE;
+
+	struct buffer_t *buf = &cli->buffer;
+
+	const char *delimiter_ptr = scan_crlf(buf->buf, buf->used);
 	if (delimiter_ptr) {
 		struct buffer_t *cli_buf = &cli->cli_data;
-		while (delimiter_ptr - buf->buf >= cli_buf->allocated)
-			expand_buffer(buf);
+		cli_buf->used = 0;
+		if (reserve_buffer(cli_buf, (size_t)(delimiter_ptr - buf->buf)) != 0) {
+			cli->cli_error.msg = "Local error in processing";
+			cli->cli_error.status = ST_LOCAL_ERR;
+			return SHOW_ERROR_AND_CLOSE;
+		}
 
 		cli_buf->used = (size_t)(delimiter_ptr - buf->buf);
 		memcpy(cli_buf->buf, buf->buf, cli_buf->used);
 
-		buf->used -= cli_buf->used + cli->delimiter_size;
-		memmove(buf->buf, delimiter_ptr + cli->delimiter_size, buf->used);
+		buf->used -= cli_buf->used + 2;
+		memmove(buf->buf, delimiter_ptr + 2, buf->used);
 
 		FSM_STATE_TYPE(smtp) next_state = cli->next_state;
 		cli->next_state = NULL;
@@ -721,6 +1010,40 @@ FSM_CB(smtp, READ_DATA, cli) {
 		return next_state;
 	}
 
+	// message data never stays in the buffer, so only a part of the command line could be here
+	if (buf->used >= COMMAND_LINE_MAX_SIZE) {
+		log_warn("Too long command line came from %d. Abort", cli->sock);
+		cli->cli_error.msg = "Line too long";
+		cli->cli_error.status = ST_SYNTAX_ERR;
+		return SHOW_ERROR_AND_CLOSE;
+	}
+
+	// all pipelined commands were processed: send replies before waiting for next ones
+	return SEND_REPLIES;
+}
+
+FSM_CB(smtp, SEND_REPLIES, cli) {
+	int ret = flush_responses(cli);
+	if (ret < 0) {
+		close_client_sock(cli);
+		cli->next_state = NULL;
+		return FREE_MEM;
+	}
+
+	if (ret > 0 && cli->loop) {
+		// wait until client reads replies. New commands are not read meanwhile
+		cli->writable = 0;
+		if (!cli->wait_writable && event_loop_mod(cli->loop, cli->sock, EV_READ | EV_WRITE | EV_EDGE) != 0) {
+			close_client_sock(cli);
+			cli->next_state = NULL;
+			return FREE_MEM;
+		}
+		cli->wait_writable = 1;
+	} else if (ret == 0 && cli->wait_writable) {
+		cli->wait_writable = 0;
+		event_loop_mod(cli->loop, cli->sock, EV_READ | EV_EDGE);
+	}
+
 	return WAIT_DATA;
 }
 
@@ -730,17 +1053,20 @@ FSM_CB(smtp, FREE_MEM, cli) {
 	struct buffer_t *buffers[] = {
 		&cli->buffer,
 		&cli->cli_data,
-		&cli->cli_info.cli_recipients,
+		&cli->out,
 	};
 
 	int i = 0;
-	for (; i < VSIZE(buffers); ++i) {
-		safe_free(buffers[i]->buf);
-		buffers[i]->used = 0;
-		buffers[i]->allocated = 0;
-	}
+	for (; i < VSIZE(buffers); ++i)
+		release_buffer(buffers[i]);
 
 	clear_sendmail_transaction(cli);
+	arena_free(&cli->arena);
+
+	if (cli->wait_sync) {
+		spool_cancel(&cli->spool_waiter);
+		cli->wait_sync = 0;
+	}
 
 	FSM_STATE_TYPE(smtp) next_state = cli->next_state;
 	cli->next_state = NULL;
@@ -751,21 +1077,30 @@ FSM_CB(smtp, FREE_MEM, cli) {
 }
 
 FSM_CB(smtp, CLOSE_CLIENT, cli) {
-	send_response(cli->sock, ST_BYE, "Bye");
-	shutdown(cli->sock, SHUT_WR);
-	return WAIT_DATA;
+	send_response(cli, ST_BYE, "Bye");
+	if (flush_responses(cli) > 0)
+		log_info("Client %d will not get all responses", cli->sock);
+
+	// don't wait for the client: rejected clients are served by master process
+	close_client_sock(cli);
+	cli->next_state = NULL;
+
+	return FREE_MEM;
 }
 
 FSM_CB(smtp, INIT, cli) {
-	cli->delimiter = "\r\n";
-	cli->delimiter_size = 2;
-	init_buffer(&cli->buffer);
-	init_buffer(&cli->cli_data);
-	init_buffer(&cli->cli_info.cli_recipients);
+	if (init_buffer(&cli->buffer) != 0 || init_buffer(&cli->cli_data) != 0 || init_buffer(&cli->out) != 0) {
+		close_client_sock(cli);
+		cli->next_state = NULL;
+		return FREE_MEM;
+	}
+
+	cli->read_size = BLOCK_SIZE;
+	arena_init(&cli->arena, TRANSACTION_ARENA_SIZE);
+	recipients_init(&cli->cli_info.cli_recipients, &cli->arena);
 
-	cli->cur_transaction = NULL;
-	cli->cur_command = NULL;
-	cli->transaction_flags = 0;
+	cli->seq = SEQ_IDLE;
+	metrics_add(connections, 1);
 
 	FSM_STATE_TYPE(smtp) next_state = cli->next_state;
 	cli->next_state = NULL;
@@ -779,6 +1114,7 @@ static void init_cli(struct client_t *cli, int sock) {
 	memset(cli, 0, sizeof(*cli));
 
 	cli->sock = sock;
+	cli->writable = 1;
 }
 
 void smtp_reject_client(int sock, const char *msg) {
@@ -793,11 +1129,58 @@ void smtp_reject_client(int sock, const char *msg) {
 	FSM_RUN(smtp, &cli);
 }
 
-void smtp_communicate_with_client(int sock) {
-	struct client_t cli;
-	init_cli(&cli, sock);
+static void run_session(struct client_t *cli) {
+	while (!FSM_STEP(smtp, &cli->state, cli)) {
+		// session yielded: sleep until next event if socket can't be read or written
+		if (cli->wait_sync || (cli->out.used ? !cli->writable : !cli->readable))
+			return;
+	}
+
+	log_debug("Session finished");
+
+	if (cli->on_done)
+		cli->on_done(cli->on_done_arg);
+	free(cli);
+}
+
+static void on_client_event(struct event_loop_t *loop, int fd, uint32_t events, void *arg) {
+	struct client_t *cli = (struct client_t *)arg;
+
+	// errors and hangups are reported by read() and send()
+	if (events & (EV_READ | EV_ERROR))
+		cli->readable = 1;
+	if (events & (EV_WRITE | EV_ERROR))
+		cli->writable = 1;
+
+	run_session(cli);
+}
+
+int smtp_start_session(struct event_loop_t *loop, int sock, void (*on_done)(void *arg), void *arg) {
+	if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) != 0) {
+		log_error("Can't make client socket %d non-block: %s", sock, strerror(errno));
+		return -1;
+	}
+
+	struct client_t *cli = (struct client_t *)malloc(sizeof(*cli));
+	if (!cli) {
+		log_error("Can't allocate session for client %d", sock);
+		return -1;
+	}
+
+	init_cli(cli, sock);
+	cli->loop = loop;
+	cli->state = FSM_CURSOR_INIT(smtp);
+	cli->readable = 1; // data could come before socket was added into the loop
+	cli->on_done = on_done;
+	cli->on_done_arg = arg;
+
+	if (event_loop_add(loop, sock, EV_READ | EV_EDGE, on_client_event, cli) != 0) {
+		free(cli);
+		return -1;
+	}
 
 	log_info("Starting communication with client");
 
-	FSM_RUN(smtp, &cli);
+	run_session(cli);
+	return 0;
 }
@@ -0,0 +1,118 @@
+#include "recipients.h"
+#include "common.h"
+#include "logger.h"
+
+#include <ctype.h>
+#include <strings.h>
+
+#define RECIPIENTS_MIN_SIZE 8
+
+void recipients_init(struct recipients_t *rcpts, struct arena_t *arena) {
+	memset(rcpts, 0, sizeof(*rcpts));
+	rcpts->arena = arena;
+}
+
+void recipients_clear(struct recipients_t *rcpts) {
+	recipients_init(rcpts, rcpts->arena);
+}
+
+// domain (or the whole "Postmaster") is case-insensitive
+static size_t local_part_len(const char *addr, size_t len) {
+	const char *at = rscan_byte(addr, len, '@');
+	return at ? (size_t)(at - addr) : 0;
+}
+
+// FNV-1a
+static uint32_t addr_hash(const char *addr, size_t len) {
+	size_t local_len = local_part_len(addr, len);
+	uint32_t hash = 2166136261u;
+
+	size_t i = 0;
+	for (; i < len; ++i) {
+		unsigned char c = (unsigned char)addr[i];
+		if (i >= local_len)
+			c = (unsigned char)tolower(c);
+		hash = (hash ^ c) * 16777619u;
+	}
+
+	return hash;
+}
+
+static int addr_equal(const struct recipient_t *rcpt, const char *addr, size_t len) {
+	if (rcpt->len != len)
+		return 0;
+
+	size_t local_len = local_part_len(addr, len);
+	return memcmp(rcpt->addr, addr, local_len) == 0
+		&& strncasecmp(rcpt->addr + local_len, addr + local_len, len - local_len) == 0;
+}
+
+static void set_insert(struct recipients_t *rcpts, size_t index) {
+	size_t mask = rcpts->set_size - 1;
+	size_t slot = rcpts->items[index].hash & mask;
+	while (rcpts->set[slot])
+		slot = (slot + 1) & mask;
+
+	rcpts->set[slot] = (uint32_t)index + 1;
+}
+
+// list and set are moved into new arrays, old ones are freed with the arena
+static int grow(struct recipients_t *rcpts) {
+	size_t allocated = rcpts->allocated ? rcpts->allocated * 2 : RECIPIENTS_MIN_SIZE;
+
+	// set is kept half empty
+	struct recipient_t *items = (struct recipient_t *)arena_alloc(rcpts->arena, allocated * sizeof(*items));
+	uint32_t *set = (uint32_t *)arena_alloc(rcpts->arena, 2 * allocated * sizeof(*set));
+	if (!items || !set)
+		return -1;
+
+	if (rcpts->n_items)
+		memcpy(items, rcpts->items, rcpts->n_items * sizeof(*items));
+	memset(set, 0, 2 * allocated * sizeof(*set));
+
+	rcpts->items = items;
+	rcpts->allocated = allocated;
+	rcpts->set = set;
+	rcpts->set_size = 2 * allocated;
+
+	size_t i = 0;
+	for (; i < rcpts->n_items; ++i)
+		set_insert(rcpts, i);
+
+	return 0;
+}
+
+int recipients_add(struct recipients_t *rcpts, const char *addr, size_t len) {
+	uint32_t hash = addr_hash(addr, len);
+
+	if (rcpts->set_size) {
+		size_t mask = rcpts->set_size - 1;
+		size_t slot = hash & mask;
+		for (; rcpts->set[slot]; slot = (slot + 1) & mask) {
+			const struct recipient_t *rcpt = rcpts->items + rcpts->set[slot] - 1;
+			if (rcpt->hash == hash && addr_equal(rcpt, addr, len)) {
+				log_debug("Recipient %.*s is already added", (int)len, addr);
+				return 1;
+			}
+		}
+	}
+
+	if (rcpts->n_items == rcpts->allocated && grow(rcpts) != 0)
+		return -1;
+
+	char *copy = (char *)arena_alloc(rcpts->arena, len + 1);
+	if (!copy)
+		return -1;
+
+	memcpy(copy, addr, len);
+	copy[len] = '\0';
+
+	struct recipient_t *rcpt = rcpts->items + rcpts->n_items;
+	rcpt->addr = copy;
+	rcpt->len = len;
+	rcpt->hash = hash;
+
+	set_insert(rcpts, rcpts->n_items++);
+
+	return 0;
+}
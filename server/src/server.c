@@ -4,6 +4,9 @@
 #include "worker.h"
 #include "proto.h"
 #include "fsm.h"
+#include "event_loop.h"
+#include "spool.h"
+#include "metrics.h"
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -18,6 +21,11 @@
 #include <arpa/inet.h>
 #include <signal.h>
 
+// accept() is retried with this interval while process is out of descriptors
+#ifndef ACCEPT_RETRY_INTERVAL_MS
+#	define ACCEPT_RETRY_INTERVAL_MS 100
+#endif
+
 static int hostname_to_ip(const char *hostname, char ip[32])
 {
 	struct hostent *he = NULL;
@@ -42,7 +50,7 @@ static int hostname_to_ip(const char *hostname, char ip[32])
 	return -1;
 }
 
-static void handle_sigchld(int sig) {
+static void handle_sigchld(struct event_loop_t *loop, int sig, void *arg) {
 	pid_t child_pid = 0;
 	int status = 0;
 	while ((child_pid = waitpid(-1, &status, WNOHANG)) > 0) {
@@ -65,6 +73,12 @@ static void handle_sigchld(int sig) {
 	}
 }
 
+// dumps FSM profiles of master and all workers into the log
+static void handle_sigusr1(struct event_loop_t *loop, int sig, void *arg) {
+	fsm_profile_dump();
+	signal_workers(SIGUSR1);
+}
+
 static int mk_server() {
 	char ip_addr[32] = "";
 	if (hostname_to_ip(get_opt_listen_host(), ip_addr) != 0)
@@ -104,6 +118,12 @@ static int mk_server() {
 		return -1;
 	}
 
+	// control socket lives outside of root_dir
+	if (metrics_listen(get_opt_control_socket()) != 0) {
+		close(sock);
+		return -1;
+	}
+
 	const char *dirs[] = {
 		get_opt_root_dir(),
 		get_opt_queue_dir(),
@@ -116,23 +136,12 @@ static int mk_server() {
 		return -1;
 	}
 
-	// XXX: backlog is hardcoded
-	if (listen(sock, 3) != 0) {
+	if (listen(sock, SOMAXCONN) != 0) {
 		log_error("Can't start listen on %s:%d: %s", get_opt_listen_host(), get_opt_listen_port(), strerror(errno));
 		close(sock);
 		return -1;
 	}
 
-	struct sigaction sa;
-	sa.sa_handler = &handle_sigchld;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-	if (sigaction(SIGCHLD, &sa, NULL) != 0) {
-		log_error("Can't set sigaction: %s", strerror(errno));
-		close(sock);
-		return -1;
-	}
-
 	// where socketfd is the socket you want to make non-blocking
 	int status = fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
 
@@ -165,47 +174,68 @@ struct server_error_info_t {
 
 struct server_status_t {
 	int server_socket;
-	uint8_t initialized;
+	uint8_t accept_pending;
+	uint8_t accept_paused; // out of descriptors, accept_timer will resume accepting
+	int accept_timer;
 
-	fd_set active_fd_set;
+	struct event_loop_t *loop;
 
 	struct server_error_info_t error_info;
 };
 
 FSM_CB(server, WAIT_CONN, server_status) {
-	if (select(FD_SETSIZE, &server_status->active_fd_set, NULL, NULL, NULL) < 0) {
-		if (errno == EINTR) {
-			// reinit fd sets
-			return INIT;
-		}
-
-		log_error("Select failed: %s", strerror(errno));
+	if (event_loop_run_once(server_status->loop) < 0) {
+		log_error("Event loop failed");
 		return ERROR;
 	}
 
-	server_status->initialized = 0;
+	if (server_status->accept_pending && !server_status->accept_paused)
+		return PROCESS_SERVER_FD;
 
-	return PROCESS_SERVER_FD;
+	return WAIT_CONN;
 }
 
-FSM_CB(server, PROCESS_SERVER_FD, server_status) {
-	if (!FD_ISSET(server_status->server_socket, &server_status->active_fd_set))
-		return WAIT_CONN;
+static void on_accept_timer(struct event_loop_t *loop, void *arg) {
+	struct server_status_t *server_status = (struct server_status_t *)arg;
+
+	event_loop_del_timer(loop, server_status->accept_timer);
+	server_status->accept_paused = 0;
+}
 
+FSM_CB(server, PROCESS_SERVER_FD, server_status) {
 	// Establish connection with client
 	struct sockaddr_in clientname;
 	socklen_t size = sizeof(clientname);
 
+	// server socket is edge-triggered: accept() all pending connections until EAGAIN
 	int new = accept(server_status->server_socket, (struct sockaddr *) &clientname, &size);
 	if (new < 0) {
-		log_error("Can't accept new client: %s", strerror(errno));
+		if (errno == EINTR || errno == ECONNABORTED)
+			return PROCESS_SERVER_FD;
+
+		// no new edge would come for connections, which are already queued: accept them later
+		if (errno == EMFILE || errno == ENFILE) {
+			log_warn("Can't accept new client: %s. Retry in %d ms", strerror(errno), ACCEPT_RETRY_INTERVAL_MS);
+
+			int timer = event_loop_add_timer(server_status->loop, ACCEPT_RETRY_INTERVAL_MS, on_accept_timer, server_status);
+			if (timer >= 0) {
+				server_status->accept_timer = timer;
+				server_status->accept_paused = 1;
+				return WAIT_CONN;
+			}
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			log_error("Can't accept new client: %s", strerror(errno));
+		}
+
+		server_status->accept_pending = 0;
 		return WAIT_CONN;
 	}
 
 	log_info("Connection with %s:%d was established", inet_ntoa(clientname.sin_addr), ntohs(clientname.sin_port));
-	if (mk_worker(new) != 0) {
+	if (pass_to_worker(new) != 0) {
 		struct server_error_info_t *error_info = &server_status->error_info;
 		error_info->error_socket = new;
+		error_info->next_state = PROCESS_SERVER_FD;
 		snprintf(error_info->err_msg, sizeof(error_info->err_msg), "no more workers");
 
 		log_error("Can't start worker for %s:%d, send error message and destroy connection",
@@ -214,7 +244,7 @@ FSM_CB(server, PROCESS_SERVER_FD, server_status) {
 		return ERROR;
 	}
 
-	return WAIT_CONN;
+	return PROCESS_SERVER_FD;
 }
 
 FSM_CB(server, ERROR, server_status) {
@@ -231,25 +261,45 @@ FSM_CB(server, ERROR, server_status) {
 
 		smtp_reject_client(error_info->error_socket, error_info->err_msg);
 
+		FSM_STATE_TYPE(server) next_state = error_info->next_state ? error_info->next_state : WAIT_CONN;
 		memset(error_info, 0, sizeof(*error_info));
-		return WAIT_CONN;
+		return next_state;
 	}
 
 	log_error("Error happen in server loop. Shutdown server");
 	return STOP_SERVER;
 }
 
+static void on_server_socket(struct event_loop_t *loop, int fd, uint32_t events, void *arg) {
+	struct server_status_t *server_status = (struct server_status_t *)arg;
+	server_status->accept_pending = 1;
+}
+
 FSM_CB(server, INIT, server_status) {
-	if (server_status->initialized) {
-		log_error("Error happens in select() loop. Shutdown");
+	if (server_status->loop) {
+		log_error("Error happens in event loop. Shutdown");
+		return STOP_SERVER;
+	}
+
+	server_status->loop = event_loop_create();
+	if (!server_status->loop)
+		return STOP_SERVER;
+
+	if (event_loop_add(server_status->loop, server_status->server_socket, EV_READ | EV_EDGE, on_server_socket, server_status) != 0
+		|| event_loop_add_signal(server_status->loop, SIGCHLD, handle_sigchld, server_status) != 0
+		|| event_loop_add_signal(server_status->loop, SIGUSR1, handle_sigusr1, server_status) != 0
+		|| metrics_serve(server_status->loop) != 0) {
+		log_error("Can't initialize event loop. Shutdown");
 		return STOP_SERVER;
 	}
 
-	FD_ZERO(&server_status->active_fd_set);
-	FD_SET(server_status->server_socket, &server_status->active_fd_set);
+	if (init_workers(server_status->loop) != 0) {
+		log_error("Can't start workers. Shutdown");
+		return STOP_SERVER;
+	}
 
-	// flag should be reset into WAIT_CONN after success select() call to prevent recursion
-	server_status->initialized = 1;
+	// connections could come before the socket was added into the loop
+	server_status->accept_pending = 1;
 
 	return WAIT_CONN;
 }
@@ -261,6 +311,8 @@ static void run_loop(int server_socket) {
 	server_status.server_socket = server_socket;
 
 	FSM_RUN(server, &server_status);
+
+	event_loop_destroy(server_status.loop);
 }
 
 void run_server(const char *logpath) {
@@ -273,5 +325,8 @@ void run_server(const char *logpath) {
 	if (init_logger(get_opt_n_workers(), logpath, get_opt_user(), get_opt_group()) < 0)
 		return;
 
+	if (spool_init() != 0 || metrics_init(get_opt_n_workers()) != 0)
+		return;
+
 	run_loop(server_socket);
 }
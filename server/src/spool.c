@@ -0,0 +1,246 @@
+#include "spool.h"
+#include "common.h"
+#include "config.h"
+#include "logger.h"
+#include "coarse_clock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#ifdef __MACH__
+#	define fdatasync fsync // XXX: fdatasync() is not declared on Mac OS, file is fully synced there
+#endif
+
+#ifndef SPOOL_SYNC_INTERVAL_MS
+// messages committed during this interval share a single fsync of queue_dir
+#	define SPOOL_SYNC_INTERVAL_MS 2
+#endif
+
+// shared by all workers
+struct spool_shared_t {
+	volatile uint64_t committed; // number of files renamed into queue_dir
+	volatile uint64_t synced; // files with tickets up to this one are on disk
+	volatile pid_t syncer; // process, which syncs queue_dir right now
+};
+
+static struct spool_shared_t *shared = NULL;
+
+// following fields are owned by a worker
+static int queue_dir_fd = -1;
+static struct spool_waiter_t *waiters = NULL;
+static struct event_loop_t *timer_loop = NULL;
+static int timer_id = -1;
+
+int spool_init() {
+	assert(!shared);
+
+	void *mem = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		log_error("Can't allocate shared memory for spool: %s", strerror(errno));
+		return -1;
+	}
+
+	shared = (struct spool_shared_t *)mem;
+	memset(shared, 0, sizeof(*shared));
+
+	return 0;
+}
+
+static void mk_path(char *path, size_t size, const char *dir, const struct spool_file_t *file) {
+	snprintf(path, size, "%s/%s", dir, file->name);
+}
+
+int spool_open(struct spool_file_t *file) {
+	char path[256];
+
+	snprintf(file->name, sizeof(file->name), "%ld-%s-%d-%d", coarse_clock_now(), get_opt_hostname(), getpid(), rand());
+	mk_path(path, sizeof(path), get_opt_tmp_dir(), file);
+
+	log_info("Saving message to %s/%s", get_opt_root_dir(), path);
+
+	file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file->fd < 0) {
+		log_error("Can't open message %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int spool_commit(struct spool_file_t *file, uint64_t *ticket) {
+	assert(shared);
+
+	char tmp_path[256];
+	char queue_path[256];
+
+	mk_path(tmp_path, sizeof(tmp_path), get_opt_tmp_dir(), file);
+	mk_path(queue_path, sizeof(queue_path), get_opt_queue_dir(), file);
+
+	int fd = file->fd;
+	file->fd = -1;
+
+	// XXX: size of a new file is synced by fdatasync() too, other metadata is not needed
+	if (fdatasync(fd) != 0) {
+		log_error("Can't sync message %s: %s", tmp_path, strerror(errno));
+		close(fd);
+		unlink(tmp_path);
+		return -1;
+	}
+
+	if (close(fd) != 0) {
+		log_error("Can't save message %s: %s", tmp_path, strerror(errno));
+		unlink(tmp_path);
+		return -1;
+	}
+
+	if (rename(tmp_path, queue_path) != 0) {
+		log_error("Can't move message %s into %s: %s", tmp_path, get_opt_queue_dir(), strerror(errno));
+		unlink(tmp_path);
+		return -1;
+	}
+
+	// ticket is taken after rename: directory synced after the ticket was seen contains the file
+	*ticket = __sync_add_and_fetch(&shared->committed, 1);
+	log_debug("Message %s was moved into %s, ticket %llu", file->name, get_opt_queue_dir(), (unsigned long long)*ticket);
+
+	return 0;
+}
+
+void spool_discard(struct spool_file_t *file) {
+	char path[256];
+	mk_path(path, sizeof(path), get_opt_tmp_dir(), file);
+
+	log_info("Message %s is discarded", path);
+
+	if (file->fd >= 0)
+		close(file->fd);
+	file->fd = -1;
+
+	unlink(path);
+}
+
+// will return 0 on success (or when other process syncs queue_dir now) and -1 on error
+static int sync_queue_dir(uint64_t committed) {
+	if (queue_dir_fd < 0) {
+		queue_dir_fd = open(get_opt_queue_dir(), O_RDONLY | O_DIRECTORY);
+		if (queue_dir_fd < 0) {
+			log_error("Can't open %s: %s", get_opt_queue_dir(), strerror(errno));
+			return -1;
+		}
+	}
+
+	// XXX: syncer could die with the flag set, don't wait for it forever
+	pid_t syncer = shared->syncer;
+	if (syncer && (kill(syncer, 0) == 0 || errno != ESRCH))
+		return 0;
+
+	if (!__sync_bool_compare_and_swap(&shared->syncer, syncer, getpid()))
+		return 0;
+
+	int ret = fsync(queue_dir_fd);
+	if (ret != 0) {
+		log_error("Can't sync %s: %s", get_opt_queue_dir(), strerror(errno));
+	} else {
+		uint64_t synced = shared->synced;
+		while (synced < committed && !__sync_bool_compare_and_swap(&shared->synced, synced, committed))
+			synced = shared->synced;
+
+		log_trace("%s was synced up to ticket %llu", get_opt_queue_dir(), (unsigned long long)committed);
+	}
+
+	__sync_lock_release(&shared->syncer);
+
+	return ret == 0 ? 0 : -1;
+}
+
+static void stop_timer() {
+	if (timer_id < 0)
+		return;
+
+	event_loop_del_timer(timer_loop, timer_id);
+	timer_id = -1;
+	timer_loop = NULL;
+}
+
+static void on_sync_timer(struct event_loop_t *loop, void *arg) {
+	uint64_t max_ticket = 0;
+	struct spool_waiter_t *waiter = waiters;
+	for (; waiter; waiter = waiter->next)
+		if (waiter->ticket > max_ticket)
+			max_ticket = waiter->ticket;
+
+	uint64_t failed = 0; // waiters up to this ticket will not be synced
+	if (shared->synced < max_ticket) {
+		uint64_t committed = shared->committed;
+		if (sync_queue_dir(committed) != 0)
+			failed = committed;
+	}
+
+	uint64_t synced = shared->synced;
+
+	// detach finished waiters first: callbacks could add new ones
+	struct spool_waiter_t *done = NULL;
+	struct spool_waiter_t **done_tail = &done;
+	struct spool_waiter_t **ptr = &waiters;
+	while (*ptr) {
+		waiter = *ptr;
+		if (waiter->ticket > synced && waiter->ticket > failed) {
+			ptr = &waiter->next;
+			continue;
+		}
+
+		*ptr = waiter->next;
+		waiter->next = NULL;
+		*done_tail = waiter;
+		done_tail = &waiter->next;
+	}
+
+	if (!waiters)
+		stop_timer();
+
+	while (done) {
+		waiter = done;
+		done = waiter->next;
+		waiter->cb(waiter->arg, waiter->ticket <= synced ? 0 : -1);
+	}
+}
+
+int spool_wait(struct event_loop_t *loop, struct spool_waiter_t *waiter, uint64_t ticket, spool_cb_t cb, void *arg) {
+	if (timer_id < 0) {
+		timer_id = event_loop_add_timer(loop, SPOOL_SYNC_INTERVAL_MS, on_sync_timer, NULL);
+		if (timer_id < 0)
+			return -1;
+
+		timer_loop = loop;
+	}
+
+	assert(timer_loop == loop);
+
+	waiter->ticket = ticket;
+	waiter->cb = cb;
+	waiter->arg = arg;
+	waiter->next = waiters;
+	waiters = waiter;
+
+	return 0;
+}
+
+void spool_cancel(struct spool_waiter_t *waiter) {
+	struct spool_waiter_t **ptr = &waiters;
+	for (; *ptr; ptr = &(*ptr)->next) {
+		if (*ptr == waiter) {
+			*ptr = waiter->next;
+			break;
+		}
+	}
+
+	if (!waiters)
+		stop_timer();
+}
@@ -3,39 +3,40 @@
 #include "config.h"
 #include "logger.h"
 #include "proto.h"
+#include "event_loop.h"
+#include "buffer_pool.h"
+#include "metrics.h"
+#include "fsm.h"
 
 #include <stdlib.h>
 #include <assert.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <errno.h>
 
+#ifndef WORKER_MAX_SESSIONS
+// number of sessions served by a single worker at once
+#	define WORKER_MAX_SESSIONS 4096
+#endif
+
 struct worker_t {
 	pid_t pid;
-	int sock;
-	uint8_t busy;
+	int sock; // master's end of the channel, -1 if worker is not running
 	int index;
-};
-
-static struct worker_t *workers = NULL;
-
-static void init_workers() {
-	if (workers)
-		return;
 
-	log_trace("Trying to initialize workers list");
-
-	// number of workers was checked in main()
-	workers = (struct worker_t *)malloc((unsigned)get_opt_n_workers() * sizeof(struct worker_t));
-	assert(workers);
+	unsigned active; // number of sessions served right now
+	unsigned served; // number of sessions passed since worker was started
+	uint8_t retiring; // worker will be restarted after all active sessions are done
 
-	memset(workers, 0, (unsigned)get_opt_n_workers() * sizeof(struct worker_t));
+	struct event_loop_t *loop; // worker's own loop, used only by worker process
+};
 
-	int i = 0;
-	for (; i < get_opt_n_workers(); ++i) {
-		workers[i].index = i;
-	}
-}
+static struct worker_t *workers = NULL;
+static struct event_loop_t *master_loop = NULL;
 
 static __attribute__((destructor))
 void deinit_workers() {
@@ -75,20 +76,98 @@ static void close_opened_descriptors(int *except, int except_count) {
 	}
 }
 
-static struct worker_t *get_worker(int sock) {
-	int i = 0;
-	struct worker_t *worker = NULL;
-	for (; !worker && i < get_opt_n_workers(); ++i) {
-		if (!workers[i].busy)
-			worker = workers + i;
+static int send_client(int chan, int client_sock) {
+	char dummy = 0;
+	struct iovec iov = { .iov_base = &dummy, .iov_len = sizeof(dummy), };
+
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg_buf;
+	memset(&cmsg_buf, 0, sizeof(cmsg_buf));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg_buf.buf;
+	msg.msg_controllen = sizeof(cmsg_buf.buf);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &client_sock, sizeof(int));
+
+	if (sendmsg(chan, &msg, 0) != sizeof(dummy)) {
+		log_error("Can't pass client %d into worker: %s", client_sock, strerror(errno));
+		return -1;
 	}
 
-	if (worker) {
-		worker->busy = 1;
-		worker->sock = sock;
+	return 0;
+}
+
+// will return 0 on success, 1 if there is no clients to receive, 2 if descriptor of client was lost
+// and -1 if master closed the channel
+static int recv_client(int chan, int *client_sock) {
+	char dummy = 0;
+	struct iovec iov = { .iov_base = &dummy, .iov_len = sizeof(dummy), };
+
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg_buf;
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg_buf.buf;
+	msg.msg_controllen = sizeof(cmsg_buf.buf);
+
+	ssize_t received = 0;
+	do {
+		received = recvmsg(chan, &msg, 0);
+	} while (received < 0 && errno == EINTR);
+
+	if (received == 0) {
+		log_info("Master closed the channel");
+		return -1;
 	}
 
-	return worker;
+	if (received < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 1;
+
+		log_error("Can't receive client from master: %s", strerror(errno));
+		return -1;
+	}
+
+	// kernel drops descriptor, which doesn't fit into RLIMIT_NOFILE, and sets MSG_CTRUNC
+	if (msg.msg_flags & MSG_CTRUNC) {
+		log_error("Descriptor of client was lost: too many open files");
+		return 2;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		log_error("Message without descriptor came from master");
+		return 2;
+	}
+
+	memcpy(client_sock, CMSG_DATA(cmsg), sizeof(int));
+
+	return 0;
+}
+
+static void raise_fds_limit() {
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == rl.rlim_max)
+		return;
+
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+		log_warn("Can't raise number of file descriptors: %s", strerror(errno));
 }
 
 static int init_worker(struct worker_t *worker) {
@@ -102,65 +181,282 @@ static int init_worker(struct worker_t *worker) {
 		return -1;
 	}
 
-	int except[] = { worker->sock, logger_sock() };
+	metrics_attach(worker->index);
+
+	// states passed by master before fork are not interesting
+	fsm_profile_reset();
+
+	// forget master's descriptors and signal handlers
+	event_loop_destroy(master_loop);
+	master_loop = NULL;
+
+	int except[] = { worker->sock };
 	close_opened_descriptors(except, sizeof(except) / sizeof(*except));
 
+	// each session holds a descriptor
+	raise_fds_limit();
+
+	worker->active = 0;
+	worker->retiring = 0;
+	worker->loop = event_loop_create();
+	if (!worker->loop)
+		return -1;
+
 	return 0;
 }
 
+static void on_session_done(void *arg) {
+	struct worker_t *worker = (struct worker_t *)arg;
+	--worker->active;
+
+	// notify master that session is done
+	char done = 0;
+	if (!worker->retiring && write(worker->sock, &done, sizeof(done)) != sizeof(done))
+		log_error("Can't notify master: %s", strerror(errno));
+}
+
+static void on_master_channel(struct event_loop_t *loop, int fd, uint32_t events, void *arg) {
+	struct worker_t *worker = (struct worker_t *)arg;
+
+	int client_sock = -1;
+	int ret = 0;
+	while ((ret = recv_client(fd, &client_sock)) == 0 || ret == 2) {
+		++worker->active;
+
+		// master counts the client as active one, so it should get the done byte anyway
+		if (ret == 2) {
+			on_session_done(worker);
+			continue;
+		}
+
+		if (smtp_start_session(loop, client_sock, on_session_done, worker) != 0) {
+			log_error("Can't start session with client %d", client_sock);
+			close(client_sock);
+			on_session_done(worker);
+		}
+	}
+
+	if (ret < 0) {
+		// no more clients will come, finish active sessions and exit
+		worker->retiring = 1;
+		event_loop_del(loop, fd);
+	}
+}
+
+static void on_dump_signal(struct event_loop_t *loop, int signo, void *arg) {
+	struct worker_t *worker = (struct worker_t *)arg;
+
+	log_info("Worker #%d: %u sessions are active", worker->index, worker->active);
+	fsm_profile_dump();
+}
+
 static void run_worker(struct worker_t *worker) {
-	smtp_communicate_with_client(worker->sock);
+	if (fcntl(worker->sock, F_SETFL, fcntl(worker->sock, F_GETFL, 0) | O_NONBLOCK) != 0
+		|| event_loop_add(worker->loop, worker->sock, EV_READ | EV_EDGE, on_master_channel, worker) != 0
+		|| event_loop_add_signal(worker->loop, SIGUSR1, on_dump_signal, worker) != 0) {
+		log_error("Can't listen channel with master");
+		return;
+	}
+
+	while (!worker->retiring || worker->active) {
+		if (event_loop_run_once(worker->loop) < 0) {
+			log_error("Event loop failed in worker #%d", worker->index);
+			break;
+		}
+	}
+
+	struct buffer_pool_stats_t stats;
+	buffer_pool_stats(&stats);
+
+	uint64_t total = stats.hits + stats.misses;
+	log_info("Worker #%d is going to exit. Buffer pool: %llu hits, %llu misses (%.1f%% hit rate), %zu bytes cached",
+			worker->index, (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+			total ? 100.0 * (double)stats.hits / (double)total : 0.0, stats.cached);
+
+#ifdef FSM_PROFILE
+	// without profiling this would only repeat the SIGUSR1 hint on every exit
+	fsm_profile_dump();
+#endif
 }
 
-static int destroy_worker_impl(struct worker_t *worker) {
-	memset(worker, 0, sizeof(*worker));
-	return 0;
+static void stop_worker_channel(struct worker_t *worker) {
+	if (worker->sock < 0)
+		return;
+
+	event_loop_del(master_loop, worker->sock);
+	close(worker->sock);
+	worker->sock = -1;
+}
+
+static void on_worker_channel(struct event_loop_t *loop, int fd, uint32_t events, void *arg) {
+	struct worker_t *worker = (struct worker_t *)arg;
+
+	char done[64];
+	ssize_t received = 0;
+	while ((received = read(fd, done, sizeof(done))) > 0) {
+		log_trace("Worker #%d finished %zd sessions", worker->index, received);
+		worker->active -= (unsigned)received > worker->active ? worker->active : (unsigned)received;
+	}
+
+	if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+		log_warn("Channel with worker #%d (pid %d) was closed", worker->index, worker->pid);
+		stop_worker_channel(worker);
+		return;
+	}
+
+	if (worker->retiring && worker->active == 0) {
+		log_info("Worker #%d served %u sessions, restart it", worker->index, worker->served);
+		stop_worker_channel(worker);
+	}
 }
 
 static int mk_worker_impl(struct worker_t *worker) {
+	int chan[2] = { -1, -1 };
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, chan) != 0) {
+		log_error("Can't create channel for worker #%d: %s", worker->index, strerror(errno));
+		return -1;
+	}
+
+	worker->sock = chan[1];
+	worker->active = 0;
+	worker->served = 0;
+	worker->retiring = 0;
+
 	pid_t pid = fork();
 	srand((unsigned)rand());
 
 	if (pid == 0) {
 		// child created
+		close(chan[0]);
+
 		if (init_worker(worker) == 0) {
 			run_worker(worker);
 
 			log_info("Worker finish its work");
 
-			// TODO: don't destroy process at end.
 			exit(0);
 			return 0; // just in case
 		}
 
 		log_error("Can't init worker");
-	} else if (pid) {
-		worker->pid = pid;
-		log_info("New worker created, pid = %d, close connection to %d", pid, worker->sock);
+		exit(-1);
+	}
 
-		close(worker->sock);
+	close(chan[1]);
+	worker->sock = -1;
 
-		return 0;
-	} else
+	if (pid < 0) {
 		log_error("Can't fork: %s", strerror(errno));
+		close(chan[0]);
+		return -1;
+	}
 
-	destroy_worker_impl(worker);
-	return -1;
+	worker->pid = pid;
+	worker->sock = chan[0];
+	log_info("New worker #%d created, pid = %d", worker->index, pid);
+
+	if (fcntl(worker->sock, F_SETFL, fcntl(worker->sock, F_GETFL, 0) | O_NONBLOCK) != 0
+		|| event_loop_add(master_loop, worker->sock, EV_READ, on_worker_channel, worker) != 0) {
+		log_error("Can't listen channel of worker #%d", worker->index);
+		close(worker->sock);
+		worker->sock = -1;
+		return -1;
+	}
+
+	return 0;
 }
 
-int mk_worker(int client_sock) {
-	if (!workers)
-		init_workers();
+int init_workers(struct event_loop_t *loop) {
+	assert(!workers);
+
+	log_trace("Trying to initialize workers list");
+
+	master_loop = loop;
 
-	log_info("Trying to create a worker for connection %d", client_sock);
+	// number of workers was checked in main()
+	workers = (struct worker_t *)malloc((unsigned)get_opt_n_workers() * sizeof(struct worker_t));
+	assert(workers);
+
+	memset(workers, 0, (unsigned)get_opt_n_workers() * sizeof(struct worker_t));
+
+	int i = 0;
+	for (; i < get_opt_n_workers(); ++i) {
+		workers[i].index = i;
+		workers[i].sock = -1;
+
+		if (mk_worker_impl(workers + i) != 0) {
+			log_error("Can't start worker #%d", i);
+			return -1;
+		}
+	}
 
-	struct worker_t *worker = get_worker(client_sock);
+	return 0;
+}
+
+static struct worker_t *get_worker() {
+	int i = 0;
+	struct worker_t *worker = NULL;
+	for (; i < get_opt_n_workers(); ++i) {
+		struct worker_t *cur = workers + i;
+		if (cur->sock < 0 || cur->retiring || cur->active >= WORKER_MAX_SESSIONS)
+			continue;
+
+		if (!worker || cur->active < worker->active)
+			worker = cur;
+	}
+
+	return worker;
+}
+
+static int should_retire(const struct worker_t *worker) {
+	if (get_opt_worker_max_sessions() <= 0 || worker->served < (unsigned)get_opt_worker_max_sessions())
+		return 0;
+
+	// restart workers one by one, so pool is able to serve clients all the time
+	int i = 0;
+	for (; i < get_opt_n_workers(); ++i) {
+		const struct worker_t *cur = workers + i;
+		if (cur != worker && (cur->retiring || cur->sock < 0))
+			return 0;
+	}
+
+	return 1;
+}
+
+int pass_to_worker(int client_sock) {
+	assert(workers);
+
+	struct worker_t *worker = get_worker();
 	if (!worker) {
 		log_error("Too many clients accepted. Decline client %d", client_sock);
 		return -1;
 	}
 
-	return mk_worker_impl(worker);
+	if (send_client(worker->sock, client_sock) != 0)
+		return -1;
+
+	log_info("Connection %d was passed to worker #%d (pid = %d)", client_sock, worker->index, worker->pid);
+	close(client_sock);
+
+	++worker->active;
+	++worker->served;
+
+	if (should_retire(worker)) {
+		log_debug("Worker #%d reached sessions limit, it will be restarted", worker->index);
+		worker->retiring = 1;
+	}
+
+	return 0;
+}
+
+void signal_workers(int signo) {
+	assert(workers);
+
+	int i = 0;
+	for (; i < get_opt_n_workers(); ++i) {
+		if (workers[i].pid > 0 && kill(workers[i].pid, signo) != 0)
+			log_warn("Can't send signal %d to worker #%d (pid %d): %s", signo, i, workers[i].pid, strerror(errno));
+	}
 }
 
 int destroy_worker(int pid) {
@@ -168,9 +464,14 @@ int destroy_worker(int pid) {
 
 	int i = 0;
 	for (; i < get_opt_n_workers(); ++i) {
-		if (workers[i].pid == pid && workers[i].busy == 1) {
-			log_trace("Found worker #%d with pid %d to destroy", i, pid);
-			return destroy_worker_impl(workers + i);
+		struct worker_t *worker = workers + i;
+		if (worker->pid == pid) {
+			log_trace("Found worker #%d with pid %d to restart", i, pid);
+
+			stop_worker_channel(worker);
+			worker->pid = 0;
+
+			return mk_worker_impl(worker);
 		}
 	}
 
@@ -0,0 +1,80 @@
+#!/bin/sh
+# Starts server against a temporary root and runs standard load scenarios with loadgen.
+# Should be run by root: server chroots into its root_dir and drops privileges to nobody.
+#
+# Environment: PORT (2525), WORKERS (4), SERVER, LOADGEN and MKRCPTDB paths, KEEP_ROOT=1 to keep the root
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+
+PORT=${PORT:-2525}
+WORKERS=${WORKERS:-4}
+SERVER=${SERVER:-$DIR/../server/server}
+LOADGEN=${LOADGEN:-$DIR/loadgen}
+MKRCPTDB=${MKRCPTDB:-$DIR/../tools/mkrcptdb}
+
+USER=nobody
+GROUP=$(id -gn $USER)
+
+ROOT=$(mktemp -d /tmp/smtp_bench.XXXXXX) || exit 1
+# server processes work as USER inside of it
+chmod 755 "$ROOT"
+SERVER_PID=
+
+cleanup() {
+	# server runs in its own process group: master, workers and logger are stopped together
+	[ -n "$SERVER_PID" ] && kill -TERM -$SERVER_PID 2>/dev/null
+	[ -z "$KEEP_ROOT" ] && rm -rf "$ROOT"
+}
+trap cleanup EXIT INT TERM
+
+cat > "$ROOT/server.cfg" <<CFG
+user = "$USER";
+group = "$GROUP";
+listen_host = "127.0.0.1";
+listen_port = $PORT;
+root_dir = "$ROOT";
+queue_dir = "queue";
+tmp_dir = "tmp";
+n_workers = $WORKERS;
+worker_max_sessions = 0;
+max_recipients = 100;
+recipients_db = "recipients.db";
+hostname = "bench.local";
+control_socket = "$ROOT/control.sock";
+CFG
+
+echo "@example.com" > "$ROOT/recipients.txt"
+"$MKRCPTDB" "$ROOT/recipients.txt" "$ROOT/recipients.db" > /dev/null || exit 1
+
+touch "$ROOT/log.txt"
+chmod 666 "$ROOT/log.txt"
+
+setsid "$SERVER" -c "$ROOT/server.cfg" -l 1 -o /log.txt &
+SERVER_PID=$!
+
+# the first message is sent as soon as server accepts connections
+i=0
+until "$LOADGEN" -p $PORT -c 1 -n 1 -t 1 > /dev/null 2>&1; do
+	i=$((i + 1))
+	if [ $i -ge 50 ] || ! kill -0 $SERVER_PID 2>/dev/null; then
+		echo "Server was not started, see $ROOT/log.txt"
+		KEEP_ROOT=1
+		exit 1
+	fi
+	sleep 0.1
+done
+
+status=0
+
+run() {
+	"$LOADGEN" -p $PORT "$@" || status=1
+	echo
+}
+
+run -N small -c 16 -n 5000 -s fixed:2k
+run -N pipelined -c 16 -n 5000 -s fixed:2k -P 1
+run -N recipients -c 16 -n 2000 -r 10 -s fixed:4k -P 1
+run -N mixed -c 32 -n 2000 -s mix:2k,2k,2k,16k,64k,256k -P 1
+run -N large -c 4 -n 200 -s fixed:1m
+
+exit $status
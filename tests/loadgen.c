@@ -0,0 +1,704 @@
+// SMTP load generator: keeps N concurrent sessions busy with mail transactions and reports throughput
+// and reply latency of every verb.
+//
+// Usage: loadgen -c 16 -n 10000 -r 2 -s uniform:1k-64k -P 1
+//
+// Each session sends EHLO, then up to --per-session transactions MAIL, RCPT x --recipients, DATA and QUIT.
+// Session is reconnected while there are messages to send. With --pipelining MAIL, RCPTs and DATA are sent
+// at once. Message sizes (--size):
+//	fixed:4k	every message is 4096 bytes
+//	uniform:1k-64k	random size in range
+//	mix:2k,2k,16k,1m	random size from list
+// Latency is time from the moment command was queued (connect() for greeting, the last byte of data
+// for the final dot) to its reply.
+
+#include "command_line_options_parser.h"
+#include "event_loop.h"
+#include "logger.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_RECIPIENTS 256
+#define MAX_PENDING (MAX_RECIPIENTS + 4) // replies waited by a session
+#define MAX_SIZES 32
+#define MAX_MESSAGE_SIZE (10 * 1024 * 1024)
+#define LINE_LEN 78 // text line of message body without CRLF
+#define TICK_MS 100
+
+#define VERBS(_) \
+	_(CONNECT) \
+	_(EHLO) \
+	_(MAIL) \
+	_(RCPT) \
+	_(DATA) \
+	_(DOT) \
+	_(QUIT) \
+
+#define MK_VERB_ENUM(name) VERB_## name,
+#define MK_VERB_NAME(name) [VERB_## name] = #name,
+
+enum verb_t {
+	VERBS(MK_VERB_ENUM)
+	VERB_MAX,
+};
+
+static const char *verb_names[VERB_MAX] = {
+	VERBS(MK_VERB_NAME)
+};
+
+#undef MK_VERB_ENUM
+#undef MK_VERB_NAME
+
+enum {
+	OPT_HOST = 0,
+	OPT_PORT,
+	OPT_CONCURRENCY,
+	OPT_MESSAGES,
+	OPT_PER_SESSION,
+	OPT_RECIPIENTS,
+	OPT_SIZE,
+	OPT_PIPELINING,
+	OPT_TIMEOUT,
+	OPT_FROM,
+	OPT_DOMAIN,
+	OPT_NAME,
+	OPT_HELP,
+};
+
+static struct cmd_line_opt_t opts[] = {
+	[OPT_HOST] =		{ .name = { "-H", "--host" },		.descr = "server address (127.0.0.1)",	.opt_type = OPT_TYPE_STR, },
+	[OPT_PORT] =		{ .name = { "-p", "--port" },		.descr = "server port (25)",		.opt_type = OPT_TYPE_INT, },
+	[OPT_CONCURRENCY] =	{ .name = { "-c", "--concurrency" },	.descr = "concurrent sessions (16)",	.opt_type = OPT_TYPE_INT, },
+	[OPT_MESSAGES] =	{ .name = { "-n", "--messages" },	.descr = "messages to send (1000)",	.opt_type = OPT_TYPE_INT, },
+	[OPT_PER_SESSION] =	{ .name = { "-m", "--per-session" },	.descr = "messages per session (10)",	.opt_type = OPT_TYPE_INT, },
+	[OPT_RECIPIENTS] =	{ .name = { "-r", "--recipients" },	.descr = "recipients per message (1)",	.opt_type = OPT_TYPE_INT, },
+	[OPT_SIZE] =		{ .name = { "-s", "--size" },		.descr = "message sizes (fixed:4k)",	.opt_type = OPT_TYPE_STR, },
+	[OPT_PIPELINING] =	{ .name = { "-P", "--pipelining" },	.descr = "pipeline commands, 0 or 1",	.opt_type = OPT_TYPE_INT, },
+	[OPT_TIMEOUT] =		{ .name = { "-t", "--timeout" },	.descr = "stop after seconds (60)",	.opt_type = OPT_TYPE_INT, },
+	[OPT_FROM] =		{ .name = { "-f", "--from" },		.descr = "sender (loadgen@example.com)",	.opt_type = OPT_TYPE_STR, },
+	[OPT_DOMAIN] =		{ .name = { "-d", "--domain" },		.descr = "domain of recipients (example.com)",	.opt_type = OPT_TYPE_STR, },
+	[OPT_NAME] =		{ .name = { "-N", "--name" },		.descr = "scenario name for report",	.opt_type = OPT_TYPE_STR, },
+	[OPT_HELP] =		{ .name = { "-h", "--help" },		.descr = "show this help",		.opt_type = OPT_TYPE_HELP, },
+};
+
+struct pending_t {
+	enum verb_t verb;
+	uint64_t start;
+};
+
+struct session_t {
+	int fd;
+	uint8_t active;
+	uint8_t connected;
+	int messages_left; // in this session
+	int rcpt_sent;
+	size_t message_size;
+	uint8_t dot_queued; // reply to the message is waited from the moment its last byte was sent
+
+	char *out;
+	size_t out_used;
+	size_t out_sent;
+	size_t out_allocated;
+
+	char in[4096];
+	size_t in_used;
+
+	// replies are expected in order of commands
+	struct pending_t pending[MAX_PENDING];
+	unsigned pending_head;
+	unsigned n_pending;
+};
+
+struct samples_t {
+	uint32_t *items;
+	size_t n_items;
+	size_t allocated;
+};
+
+static struct {
+	struct sockaddr_in addr;
+	int concurrency;
+	int messages;
+	int per_session;
+	int recipients;
+	int pipelining;
+	int timeout;
+	const char *from;
+	const char *domain;
+
+	size_t sizes[MAX_SIZES];
+	int n_sizes;
+	uint8_t uniform; // sizes[0]..sizes[1]
+} cfg;
+
+static struct {
+	int started; // messages taken by sessions
+	uint64_t accepted;
+	uint64_t failed;
+	uint64_t bytes;
+	uint64_t sessions;
+	uint64_t errors;
+
+	uint64_t start;
+	uint64_t finish;
+	uint8_t stopping;
+	int active;
+
+	struct samples_t latency[VERB_MAX];
+} stats;
+
+static struct event_loop_t *loop = NULL;
+static struct session_t *sessions = NULL;
+static char *text = NULL; // body lines, messages are cut from it
+
+static uint64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void add_sample(enum verb_t verb, uint64_t usec) {
+	struct samples_t *s = stats.latency + verb;
+	if (s->n_items == s->allocated) {
+		s->allocated = s->allocated ? s->allocated * 2 : 1024;
+		s->items = (uint32_t *)realloc(s->items, s->allocated * sizeof(*s->items));
+		if (!s->items) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+
+	s->items[s->n_items++] = usec > UINT32_MAX ? UINT32_MAX : (uint32_t)usec;
+}
+
+// "4096", "4k", "1m"
+static int parse_size(const char *str, size_t *size) {
+	char *end = NULL;
+	unsigned long val = strtoul(str, &end, 10);
+	if (end == str)
+		return -1;
+
+	if (*end == 'k' || *end == 'K')
+		val *= 1024, ++end;
+	else if (*end == 'm' || *end == 'M')
+		val *= 1024 * 1024, ++end;
+
+	if (*end && *end != ',' && *end != '-')
+		return -1;
+
+	if (!val || val > MAX_MESSAGE_SIZE)
+		return -1;
+
+	*size = (size_t)val;
+	return 0;
+}
+
+static int parse_sizes(const char *spec) {
+	const char *list = NULL;
+	if (strncmp(spec, "fixed:", 6) == 0) {
+		cfg.n_sizes = 1;
+		return parse_size(spec + 6, cfg.sizes);
+	}
+
+	if (strncmp(spec, "uniform:", 8) == 0) {
+		const char *dash = strchr(spec, '-');
+		cfg.uniform = 1;
+		cfg.n_sizes = 2;
+		return !dash || parse_size(spec + 8, cfg.sizes) != 0 || parse_size(dash + 1, cfg.sizes + 1) != 0
+			|| cfg.sizes[0] > cfg.sizes[1] ? -1 : 0;
+	}
+
+	if (strncmp(spec, "mix:", 4) != 0)
+		return -1;
+
+	list = spec + 4;
+	while (list) {
+		if (cfg.n_sizes == MAX_SIZES || parse_size(list, cfg.sizes + cfg.n_sizes++) != 0)
+			return -1;
+
+		list = strchr(list, ',');
+		if (list)
+			++list;
+	}
+
+	return 0;
+}
+
+static size_t next_size() {
+	if (cfg.uniform)
+		return cfg.sizes[0] + (size_t)rand() % (cfg.sizes[1] - cfg.sizes[0] + 1);
+
+	return cfg.sizes[rand() % cfg.n_sizes];
+}
+
+static int init_text() {
+	size_t max_size = cfg.sizes[0];
+	int i = 1;
+	for (; i < cfg.n_sizes; ++i)
+		if (cfg.sizes[i] > max_size)
+			max_size = cfg.sizes[i];
+
+	text = (char *)malloc(max_size + LINE_LEN + 2);
+	if (!text)
+		return -1;
+
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ";
+
+	size_t pos = 0;
+	while (pos < max_size) {
+		for (i = 0; i < LINE_LEN; ++i)
+			text[pos++] = alphabet[(size_t)rand() % (sizeof(alphabet) - 1)];
+		text[pos++] = '\r';
+		text[pos++] = '\n';
+	}
+
+	return 0;
+}
+
+static int reserve_out(struct session_t *s, size_t size) {
+	if (s->out_allocated - s->out_used >= size)
+		return 0;
+
+	size_t new_size = s->out_allocated ? s->out_allocated * 2 : 4096;
+	while (new_size - s->out_used < size)
+		new_size *= 2;
+
+	char *out = (char *)realloc(s->out, new_size);
+	if (!out)
+		return -1;
+
+	s->out = out;
+	s->out_allocated = new_size;
+	return 0;
+}
+
+static void expect_reply(struct session_t *s, enum verb_t verb) {
+	struct pending_t *p = s->pending + (s->pending_head + s->n_pending++) % MAX_PENDING;
+	p->verb = verb;
+	p->start = now_us();
+}
+
+static void queue_command(struct session_t *s, enum verb_t verb, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static void queue_command(struct session_t *s, enum verb_t verb, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	char line[1024];
+	int len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	// truncated command would lose its CRLF and desync replies
+	if (len < 0 || (size_t)len >= sizeof(line)) {
+		fprintf(stderr, "Command is too long\n");
+		exit(1);
+	}
+
+	if (reserve_out(s, (size_t)len) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	memcpy(s->out + s->out_used, line, (size_t)len);
+	s->out_used += (size_t)len;
+
+	expect_reply(s, verb);
+}
+
+// body is cut from text by whole lines, so it never contains a line started with a dot
+static void queue_message(struct session_t *s) {
+	size_t size = next_size();
+	size_t body = size - size % (LINE_LEN + 2);
+	if (!body)
+		body = LINE_LEN + 2;
+
+	char headers[512];
+	int len = snprintf(headers, sizeof(headers), "From: <%s>\r\nTo: <rcpt0@%s>\r\nSubject: loadgen\r\n\r\n",
+			cfg.from, cfg.domain);
+
+	if (reserve_out(s, (size_t)len + body + 3) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	s->message_size = (size_t)len + body;
+
+	memcpy(s->out + s->out_used, headers, (size_t)len);
+	memcpy(s->out + s->out_used + (size_t)len, text, body);
+	memcpy(s->out + s->out_used + s->message_size, ".\r\n", 3);
+	s->out_used += s->message_size + 3;
+
+	expect_reply(s, VERB_DOT);
+	s->dot_queued = 1;
+}
+
+static void queue_rcpt(struct session_t *s) {
+	queue_command(s, VERB_RCPT, "RCPT TO:<rcpt%d@%s>\r\n", s->rcpt_sent++, cfg.domain);
+}
+
+static void start_transaction(struct session_t *s) {
+	if (stats.stopping || !s->messages_left || stats.started >= cfg.messages) {
+		queue_command(s, VERB_QUIT, "QUIT\r\n");
+		return;
+	}
+
+	++stats.started;
+	--s->messages_left;
+	s->rcpt_sent = 0;
+
+	queue_command(s, VERB_MAIL, "MAIL FROM:<%s>\r\n", cfg.from);
+	if (!cfg.pipelining)
+		return;
+
+	while (s->rcpt_sent < cfg.recipients)
+		queue_rcpt(s);
+	queue_command(s, VERB_DATA, "DATA\r\n");
+}
+
+static void start_session(struct session_t *s);
+
+static void close_session(struct session_t *s) {
+	event_loop_del(loop, s->fd);
+	close(s->fd);
+
+	s->fd = -1;
+	s->active = 0;
+	--stats.active;
+
+	if (!stats.stopping && stats.started < cfg.messages)
+		start_session(s);
+}
+
+// session is closed without QUIT, transaction in progress is counted as failed
+static void fail_session(struct session_t *s, const char *reason) {
+	++stats.errors;
+
+	unsigned i = 0;
+	for (; i < s->n_pending; ++i) {
+		enum verb_t verb = s->pending[(s->pending_head + i) % MAX_PENDING].verb;
+		if (verb == VERB_DOT || verb == VERB_MAIL) {
+			++stats.failed;
+			break;
+		}
+	}
+
+	if (stats.errors <= 10)
+		fprintf(stderr, "Session failed: %s\n", reason);
+
+	// server is not available, don't reconnect
+	if (s->n_pending && s->pending[s->pending_head].verb == VERB_CONNECT)
+		stats.stopping = 1;
+
+	close_session(s);
+}
+
+// will return 0 if session goes on
+static int on_reply(struct session_t *s, int code, const char *line, size_t len) {
+	if (!s->n_pending) {
+		fail_session(s, "unexpected reply");
+		return -1;
+	}
+
+	struct pending_t *p = s->pending + s->pending_head;
+	s->pending_head = (s->pending_head + 1) % MAX_PENDING;
+	--s->n_pending;
+
+	uint64_t now = now_us();
+	add_sample(p->verb, now - p->start);
+
+	int expected = p->verb == VERB_CONNECT ? 220 : p->verb == VERB_DATA ? 354 : p->verb == VERB_QUIT ? 221 : 250;
+	if (code != expected) {
+		char reason[256];
+		snprintf(reason, sizeof(reason), "%s got '%.*s'", verb_names[p->verb], (int)len, line);
+		fail_session(s, reason);
+		return -1;
+	}
+
+	switch (p->verb) {
+		case VERB_CONNECT:
+			queue_command(s, VERB_EHLO, "EHLO loadgen.local\r\n");
+			break;
+		case VERB_EHLO:
+			start_transaction(s);
+			break;
+		case VERB_MAIL:
+		case VERB_RCPT:
+			if (cfg.pipelining)
+				break;
+			if (s->rcpt_sent < cfg.recipients)
+				queue_rcpt(s);
+			else
+				queue_command(s, VERB_DATA, "DATA\r\n");
+			break;
+		case VERB_DATA:
+			queue_message(s);
+			break;
+		case VERB_DOT:
+			++stats.accepted;
+			stats.bytes += s->message_size;
+			stats.finish = now;
+			start_transaction(s);
+			break;
+		case VERB_QUIT:
+			close_session(s);
+			return -1;
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+// will return 0 if session goes on
+static int flush_session(struct session_t *s) {
+	while (s->out_sent < s->out_used) {
+		ssize_t sent = send(s->fd, s->out + s->out_sent, s->out_used - s->out_sent, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			fail_session(s, strerror(errno));
+			return -1;
+		}
+
+		s->out_sent += (size_t)sent;
+	}
+
+	if (s->dot_queued) {
+		s->pending[(s->pending_head + s->n_pending - 1) % MAX_PENDING].start = now_us();
+		s->dot_queued = 0;
+	}
+
+	s->out_used = s->out_sent = 0;
+	return 0;
+}
+
+// will return 0 if session goes on
+static int read_replies(struct session_t *s) {
+	while (1) {
+		ssize_t received = read(s->fd, s->in + s->in_used, sizeof(s->in) - s->in_used);
+		if (received == 0) {
+			fail_session(s, "connection closed by server");
+			return -1;
+		}
+
+		if (received < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			fail_session(s, strerror(errno));
+			return -1;
+		}
+
+		s->in_used += (size_t)received;
+
+		char *line = s->in;
+		char *end = NULL;
+		while ((end = memchr(line, '\n', s->in_used - (size_t)(line - s->in)))) {
+			size_t len = (size_t)(end - line);
+			if (len && line[len - 1] == '\r')
+				--len;
+
+			// only the last line of multiline reply is counted
+			if (len >= 3 && (len == 3 || line[3] == ' ')
+					&& on_reply(s, atoi(line), line, len) != 0)
+				return -1;
+
+			line = end + 1;
+		}
+
+		s->in_used -= (size_t)(line - s->in);
+		memmove(s->in, line, s->in_used);
+
+		if (s->in_used == sizeof(s->in)) {
+			fail_session(s, "too long reply");
+			return -1;
+		}
+
+		if (s->out_used && flush_session(s) != 0)
+			return -1;
+	}
+}
+
+static void on_session_event(struct event_loop_t *loop, int fd, uint32_t events, void *arg) {
+	struct session_t *s = (struct session_t *)arg;
+
+	if (!s->connected) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err) {
+			fail_session(s, strerror(err ? err : errno));
+			return;
+		}
+
+		if (!(events & EV_WRITE))
+			return;
+
+		s->connected = 1;
+	}
+
+	if ((events & EV_READ) && read_replies(s) != 0)
+		return;
+
+	if (s->out_used)
+		flush_session(s);
+}
+
+static void start_session(struct session_t *s) {
+	s->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (s->fd < 0 || fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL, 0) | O_NONBLOCK) != 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	s->active = 1;
+	s->connected = 0;
+	s->messages_left = cfg.per_session;
+	s->out_used = s->out_sent = 0;
+	s->in_used = 0;
+	s->pending_head = s->n_pending = 0;
+	s->message_size = 0;
+	s->dot_queued = 0;
+
+	++stats.active;
+	++stats.sessions;
+
+	expect_reply(s, VERB_CONNECT);
+
+	if (event_loop_add(loop, s->fd, EV_READ | EV_WRITE | EV_EDGE, on_session_event, s) != 0) {
+		fprintf(stderr, "Can't add session into loop\n");
+		exit(1);
+	}
+
+	if (connect(s->fd, (struct sockaddr *)&cfg.addr, sizeof(cfg.addr)) != 0 && errno != EINPROGRESS)
+		fail_session(s, strerror(errno));
+}
+
+static void on_tick(struct event_loop_t *loop, void *arg) {
+	if (stats.stopping || now_us() - stats.start < (uint64_t)cfg.timeout * 1000000)
+		return;
+
+	fprintf(stderr, "Timeout, %llu messages were accepted\n", (unsigned long long)stats.accepted);
+	stats.stopping = 1;
+
+	int i = 0;
+	for (; i < cfg.concurrency; ++i)
+		if (sessions[i].active)
+			fail_session(sessions + i, "timeout");
+}
+
+static int cmp_samples(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const struct samples_t *s, double q) {
+	size_t i = (size_t)(q * (double)s->n_items);
+	return s->items[i < s->n_items ? i : s->n_items - 1];
+}
+
+static void report(const char *name, const char *size_spec) {
+	double elapsed = (double)((stats.finish > stats.start ? stats.finish : now_us()) - stats.start) / 1e6;
+
+	printf("== %s: %d sessions, %d recipients, size %s, pipelining %s\n", name, cfg.concurrency, cfg.recipients,
+			size_spec, cfg.pipelining ? "on" : "off");
+	printf("%-8s %llu accepted, %llu failed, %llu errors, %llu sessions in %.2f s\n", "messages",
+			(unsigned long long)stats.accepted, (unsigned long long)stats.failed,
+			(unsigned long long)stats.errors, (unsigned long long)stats.sessions, elapsed);
+	printf("%-8s %.1f msgs/s, %.2f MB/s\n", "rate", (double)stats.accepted / elapsed,
+			(double)stats.bytes / elapsed / (1024 * 1024));
+
+	printf("%-8s %10s %10s %10s %10s\n", "verb", "count", "p50 us", "p99 us", "p999 us");
+
+	int i = 0;
+	for (; i < VERB_MAX; ++i) {
+		struct samples_t *s = stats.latency + i;
+		if (!s->n_items)
+			continue;
+
+		qsort(s->items, s->n_items, sizeof(*s->items), cmp_samples);
+		printf("%-8s %10zu %10u %10u %10u\n", verb_names[i], s->n_items,
+				percentile(s, 0.5), percentile(s, 0.99), percentile(s, 0.999));
+	}
+}
+
+#define OPT_INT(opt, def) (opts[opt].i_val > 0 ? opts[opt].i_val : (def))
+#define OPT_STR(opt, def) (opts[opt].s_val ? opts[opt].s_val : (def))
+
+int main(int argc, const char **argv) {
+	set_log_level(LOG_ERROR);
+
+	if (parse_command_line_arguments(V_VSIZE(opts), argc, argv) != 0)
+		return 1;
+
+	const char *host = OPT_STR(OPT_HOST, "127.0.0.1");
+	const char *size_spec = OPT_STR(OPT_SIZE, "fixed:4k");
+
+	cfg.addr.sin_family = AF_INET;
+	cfg.addr.sin_port = htons((uint16_t)OPT_INT(OPT_PORT, 25));
+	if (inet_pton(AF_INET, host, &cfg.addr.sin_addr) != 1) {
+		fprintf(stderr, "Invalid address %s\n", host);
+		return 1;
+	}
+
+	cfg.concurrency = OPT_INT(OPT_CONCURRENCY, 16);
+	cfg.messages = OPT_INT(OPT_MESSAGES, 1000);
+	cfg.per_session = OPT_INT(OPT_PER_SESSION, 10);
+	cfg.recipients = OPT_INT(OPT_RECIPIENTS, 1);
+	cfg.pipelining = opts[OPT_PIPELINING].i_val;
+	cfg.timeout = OPT_INT(OPT_TIMEOUT, 60);
+	cfg.from = OPT_STR(OPT_FROM, "loadgen@example.com");
+	cfg.domain = OPT_STR(OPT_DOMAIN, "example.com");
+
+	if (cfg.recipients > MAX_RECIPIENTS) {
+		fprintf(stderr, "Too many recipients, max is %d\n", MAX_RECIPIENTS);
+		return 1;
+	}
+
+	if (parse_sizes(size_spec) != 0) {
+		fprintf(stderr, "Invalid size %s, expected fixed:N, uniform:A-B or mix:A,B,...\n", size_spec);
+		return 1;
+	}
+
+	srand((unsigned)time(NULL));
+	signal(SIGPIPE, SIG_IGN);
+
+	loop = event_loop_create();
+	sessions = (struct session_t *)calloc((size_t)cfg.concurrency, sizeof(*sessions));
+	if (!loop || !sessions || init_text() != 0 || event_loop_add_timer(loop, TICK_MS, on_tick, NULL) < 0) {
+		fprintf(stderr, "Can't initialize\n");
+		return 1;
+	}
+
+	stats.start = now_us();
+
+	int i = 0;
+	for (; i < cfg.concurrency && stats.started + i < cfg.messages; ++i)
+		start_session(sessions + i);
+
+	while (stats.active > 0) {
+		if (event_loop_run_once(loop) < 0) {
+			fprintf(stderr, "Event loop failed\n");
+			return 1;
+		}
+	}
+
+	report(OPT_STR(OPT_NAME, "loadgen"), size_spec);
+
+	return stats.failed || stats.errors || stats.accepted < (uint64_t)cfg.messages ? 1 : 0;
+}
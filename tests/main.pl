@@ -31,19 +31,23 @@ sub print_stat {
 	print "[ DONE ] $n_ok tests passed, $n_fail tests failed; $n_tests tests total\n";
 }
 
+sub read_reply {
+	my @lines;
+	my $line;
+	do {
+		$line = $sock->getline;
+		$line =~ s/\r?\n\z//;
+		push @lines, $line;
+	} while ($line =~ /^\d+-/);
+
+	return @lines;
+}
+
 sub test {
 	my ($input, $re, $name) = @_;
 	$sock->print("$input\r\n");
 
-	my @lines;
-	my $max_lines = 10;
-	my $done = 0;
-	do {
-		my $line = $sock->getline;
-		chomp $line;
-		push @lines, $line;
-		$done = 1 unless $line =~ /^\d+-/;
-	} while (!$done);
+	my @lines = read_reply();
 
 	my $line_no = 1;
 	for (@lines) {
@@ -52,6 +56,17 @@ sub test {
 	}
 }
 
+# all commands are sent in a single packet, replies are expected in the same order
+sub test_pipeline {
+	my ($name, @commands) = @_;
+	$sock->print(join "", map { "$_->[0]\r\n" } @commands);
+
+	for my $cmd (@commands) {
+		my ($input, $re) = @$cmd;
+		check_re($input, $_, $re, "$name: $input") for read_reply();
+	}
+}
+
 my $greet = $sock->getline;
 chomp $greet;
 check_re("", $greet, q/220.*Ready/, "Welcome message");
@@ -90,6 +105,46 @@ for (@valid_emails) {
 	++$i;
 }
 
+test("RSET", q/250 Ok/, "RSET before EHLO");
+
+$sock->print("EHLO test\r\n");
+check_re("EHLO test", join("\n", read_reply()), qr/^250-PIPELINING$/m, "PIPELINING is advertised");
+
+test_pipeline("Pipelining",
+	[ "MAIL FROM:<test\@mail.ru>", q/250 Sender <test\@mail.ru> Ok/ ],
+	[ "RCPT TO:<test0\@mail.ru>", q/250 Recipient <test0\@mail.ru> Ok/ ],
+	[ "RCPT TO:<test\@mail>", q/500 Syntax error/ ],
+	[ "RCPT TO:<test1\@mail.ru>", q/250 Recipient <test1\@mail.ru> Ok/ ],
+	[ "RSET", q/250 Ok/ ],
+	[ "MAIL FROM:<>", q/250 Sender <> Ok/ ],
+);
+
+test("RCPT TO:<test0\@mail.ru>", q/250 Recipient <test0\@mail.ru> Ok/, "RCPT before DATA");
+test("DATA", q/354 /, "DATA");
+test("Subject: test\r\n\r\n" . ("Message line\r\n" x 1000) . ".", q/250 OK, message accepted/, "Message larger than a read chunk");
+
+test("MAIL FROM:<test\@mail.ru> SIZE=100000000000", q/552 /, "MAIL with too large SIZE");
+test("MAIL FROM:<test\@mail.ru> SIZE=1000 BODY=8BITMIME", q/250 Sender <test\@mail.ru> Ok/, "MAIL with ESMTP parameters");
+test("RCPT TO:<test0\@mail.ru> NOTIFY=NEVER", q/555 /, "RCPT with unsupported parameter");
+test("RCPT TO:<Postmaster>", q/250 Recipient <Postmaster> Ok/, "RCPT to Postmaster");
+test("RCPT TO:<test0\@mail.ru>", q/250 Recipient <test0\@mail.ru> Ok$/, "RCPT after Postmaster");
+test("RCPT TO:<test0\@MAIL.RU>", q/250 Recipient <test0\@MAIL.RU> Ok, duplicate is ignored/, "Duplicate RCPT");
+test("RCPT TO:<nobody\@mail.ru>", q/550 No such user/, "RCPT to unknown user");
+test("RCPT TO:<test0\@unknown.ru>", q/550 No such user/, "RCPT to unknown domain");
+test("RCPT TO:<postmaster\@mail.ru>", q/250 Recipient <postmaster\@mail.ru> Ok/, "RCPT to postmaster of local domain");
+
+test_pipeline("Unknown recipient among valid ones",
+	[ "RSET", q/250 Ok/ ],
+	[ "MAIL FROM:<test\@mail.ru>", q/250 Sender <test\@mail.ru> Ok/ ],
+	[ "RCPT TO:<test0\@mail.ru>", q/250 Recipient <test0\@mail.ru> Ok/ ],
+	[ "RCPT TO:<nobody\@mail.ru>", q/550 No such user/ ],
+	[ "DATA", q/354 / ],
+);
+test("Subject: test\r\n\r\nMessage line\r\n.", q/250 OK, message accepted/, "Message to valid recipients only");
+
+# session is closed after it
+test("MAIL FROM:<" . ("x" x 600) . "\@mail.ru>", q/500 Line too long/, "Too long command line");
+
 $sock->close;
 
 print_stat();
@@ -0,0 +1,247 @@
+// Builds recipients database for the server (see rcpt_db.h).
+//
+// Usage: mkrcptdb <list> <database>
+//
+// list is a text file with a single entry per line:
+//	user@example.com	mailbox
+//	@example.org	any user of the domain
+//	# comment
+//
+// Database is written into a temporary file and is moved over the old one, so running server
+// picks it up on the next reload.
+
+#include "rcpt_db.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define MAX_KEY_LEN 255
+
+struct entry_t {
+	char *key;
+	size_t len;
+	uint8_t flags;
+};
+
+static struct entry_t *entries = NULL;
+static size_t n_entries = 0;
+static size_t allocated = 0;
+
+static int add_entry(const char *key, size_t len, uint8_t flags) {
+	if (n_entries == allocated) {
+		size_t size = allocated ? allocated * 2 : 1024;
+		struct entry_t *ptr = (struct entry_t *)realloc(entries, size * sizeof(*entries));
+		if (!ptr) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		entries = ptr;
+		allocated = size;
+	}
+
+	char *copy = strndup(key, len);
+	if (!copy) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	struct entry_t *e = entries + n_entries++;
+	e->key = copy;
+	e->len = len;
+	e->flags = flags;
+
+	return 0;
+}
+
+// will return 0 on success, 1 if line should be skipped and -1 on error
+static int parse_line(char *line, size_t line_no) {
+	char *ptr = line;
+	while (isspace((unsigned char)*ptr))
+		++ptr;
+
+	size_t len = 0;
+	while (ptr[len] && !isspace((unsigned char)ptr[len]))
+		++len;
+
+	if (!len || *ptr == '#')
+		return 1;
+
+	size_t i = 0;
+	for (; i < len; ++i)
+		ptr[i] = (char)tolower((unsigned char)ptr[i]);
+
+	char *at = memchr(ptr, '@', len);
+	if (!at || at == ptr + len - 1 || len > MAX_KEY_LEN || memchr(at + 1, '@', len - (size_t)(at - ptr) - 1)) {
+		fprintf(stderr, "Line %zu: invalid address %.*s\n", line_no, (int)len, ptr);
+		return -1;
+	}
+
+	// every domain of mailbox is known
+	size_t domain_len = len - (size_t)(at - ptr) - 1;
+	if (at == ptr)
+		return add_entry(at + 1, domain_len, RCPT_DB_DOMAIN | RCPT_DB_CATCH_ALL);
+
+	if (add_entry(ptr, len, RCPT_DB_MAILBOX) != 0)
+		return -1;
+
+	return add_entry(at + 1, domain_len, RCPT_DB_DOMAIN);
+}
+
+static int read_list(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	char line[1024];
+	size_t line_no = 0;
+	int ret = 0;
+	while (ret >= 0 && fgets(line, sizeof(line), f)) {
+		++line_no;
+		ret = parse_line(line, line_no);
+	}
+
+	fclose(f);
+	return ret < 0 ? -1 : 0;
+}
+
+static int cmp_entries(const void *a, const void *b) {
+	const struct entry_t *x = (const struct entry_t *)a;
+	const struct entry_t *y = (const struct entry_t *)b;
+	return strcmp(x->key, y->key);
+}
+
+// domains are repeated for each mailbox: keep a single entry with all flags
+static void merge_duplicates() {
+	if (!n_entries)
+		return;
+
+	qsort(entries, n_entries, sizeof(*entries), cmp_entries);
+
+	size_t n = 1;
+	size_t i = 1;
+	for (; i < n_entries; ++i) {
+		if (strcmp(entries[i].key, entries[n - 1].key) == 0) {
+			entries[n - 1].flags |= entries[i].flags;
+			free(entries[i].key);
+		} else {
+			entries[n++] = entries[i];
+		}
+	}
+
+	n_entries = n;
+}
+
+static size_t align4(size_t size) {
+	return (size + 3) & ~(size_t)3;
+}
+
+static int write_all(FILE *f, const void *data, size_t size) {
+	return fwrite(data, 1, size, f) == size ? 0 : -1;
+}
+
+static int write_db(FILE *f) {
+	// table is kept half empty
+	uint32_t n_slots = 16;
+	while (n_slots < 2 * n_entries)
+		n_slots *= 2;
+
+	struct rcpt_db_slot_t *slots = (struct rcpt_db_slot_t *)calloc(n_slots, sizeof(*slots));
+	if (!slots) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	size_t offset = sizeof(struct rcpt_db_header_t) + n_slots * sizeof(*slots);
+
+	size_t i = 0;
+	for (; i < n_entries; ++i) {
+		uint32_t hash = rcpt_db_hash(entries[i].key, entries[i].len);
+		uint32_t slot = hash & (n_slots - 1);
+		while (slots[slot].offset)
+			slot = (slot + 1) & (n_slots - 1);
+
+		if (offset > UINT32_MAX) {
+			fprintf(stderr, "Too many records\n");
+			free(slots);
+			return -1;
+		}
+
+		slots[slot].hash = hash;
+		slots[slot].offset = (uint32_t)offset;
+		offset += align4(sizeof(struct rcpt_db_record_t) + entries[i].len);
+	}
+
+	struct rcpt_db_header_t hdr = {
+		.magic = RCPT_DB_MAGIC,
+		.version = RCPT_DB_VERSION,
+		.n_slots = n_slots,
+		.n_records = (uint32_t)n_entries,
+		.size = offset,
+	};
+
+	int ret = write_all(f, &hdr, sizeof(hdr));
+	if (ret == 0)
+		ret = write_all(f, slots, n_slots * sizeof(*slots));
+
+	free(slots);
+
+	static const char padding[4] = "";
+	for (i = 0; ret == 0 && i < n_entries; ++i) {
+		struct rcpt_db_record_t rec = { .len = (uint16_t)entries[i].len, .flags = entries[i].flags, };
+		size_t rec_size = sizeof(rec) + entries[i].len;
+
+		ret = write_all(f, &rec, sizeof(rec));
+		if (ret == 0)
+			ret = write_all(f, entries[i].key, entries[i].len);
+		if (ret == 0)
+			ret = write_all(f, padding, align4(rec_size) - rec_size);
+	}
+
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <list> <database>\n", argv[0]);
+		return 1;
+	}
+
+	if (read_list(argv[1]) != 0)
+		return 1;
+
+	merge_duplicates();
+
+	char tmp_path[4096];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", argv[2], (int)getpid());
+
+	FILE *f = fopen(tmp_path, "w");
+	if (!f) {
+		fprintf(stderr, "Can't create %s: %s\n", tmp_path, strerror(errno));
+		return 1;
+	}
+
+	int ret = write_db(f);
+	if (ret == 0)
+		ret = fflush(f);
+	if (ret == 0)
+		ret = fsync(fileno(f));
+	if (fclose(f) != 0)
+		ret = -1;
+
+	// readers see either old or new file, never a partially written one
+	if (ret != 0 || rename(tmp_path, argv[2]) != 0) {
+		fprintf(stderr, "Can't write %s: %s\n", argv[2], strerror(errno));
+		unlink(tmp_path);
+		return 1;
+	}
+
+	printf("%zu records were written into %s\n", n_entries, argv[2]);
+	return 0;
+}